@@ -1,895 +1,9365 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <stdint.h>
-#include <time.h>
-#include <ctype.h>
-
-/*
- * CUSTOM FILE SYSTEM IMPLEMENTATION USING FAT
- * 
- * DESIGN DOCUMENTATION:
- * 
- * File System Structure:
- * ---------------------
- * 1. Boot Sector (1 block): Contains metadata about the file system
- * 2. FAT Table (128 blocks): File Allocation Table for tracking file blocks
- * 3. Root Directory (1 block): Directory entries for root directory
- * 4. Data Blocks (remaining): Actual file data storage
- * 
- * Key Design Decisions:
- * - Fixed block size of 1KB for simplicity and performance
- * - Two-level directory structure (root + subdirectories)
- * - FAT entries use 16-bit integers (supports up to 65536 blocks)
- * - Directory entries contain metadata and first block pointer
- * - Free blocks marked with 0xFFFF in FAT
- * - End of file marked with 0xFFFE in FAT
- * 
- * Challenges Addressed:
- * - Efficient block allocation/deallocation using FAT
- * - Handling variable file names up to 64 bytes
- * - Managing directory hierarchy within fixed constraints
- * - Ensuring data integrity through proper error handling
- */
-
-#define BLOCK_SIZE 1024
-#define TOTAL_DISK_SIZE (64 * 1024 * 1024)  // 64 MB
-#define MAX_BLOCKS (TOTAL_DISK_SIZE / BLOCK_SIZE)
-#define MAX_FILES_IN_DIR 128
-#define MAX_FILENAME_SIZE 64
-#define MAX_FILE_BLOCKS 128
-#define FAT_ENTRY_FREE 0xFFFF
-#define FAT_ENTRY_EOF 0xFFFE
-#define FAT_ENTRY_BAD 0xFFFD
-
-// File types
-#define TYPE_FILE 0
-#define TYPE_DIRECTORY 1
-
-// File system metadata structure (Boot Sector)
-typedef struct {
-    char signature[8];        // File system signature "MYFATFS"
-    uint32_t total_blocks;    // Total number of blocks
-    uint32_t fat_blocks;      // Number of blocks for FAT
-    uint32_t root_dir_block;  // Root directory block number
-    uint32_t data_start_block;// First data block number
-    uint16_t block_size;      // Block size in bytes
-    uint8_t fat_copies;       // Number of FAT copies (we use 1)
-    char volume_label[16];    // Volume label
-    uint32_t created_time;    // File system creation time
-} BootSector;
-
-// Directory entry structure
-typedef struct {
-    char filename[MAX_FILENAME_SIZE];
-    uint32_t file_size;
-    uint16_t first_block;
-    uint8_t type;            // FILE or DIRECTORY
-    uint32_t created_time;
-    uint32_t modified_time;
-    uint8_t attributes;      // Reserved for future use
-} DirectoryEntry;
-
-// Directory structure (occupies one block)
-typedef struct {
-    DirectoryEntry entries[MAX_FILES_IN_DIR];
-    uint16_t entry_count;
-} Directory;
-
-// File System context
-typedef struct {
-    FILE* disk_file;
-    BootSector boot_sector;
-    uint16_t* fat_table;
-    uint32_t current_dir_block;
-    char current_path[256];
-} FileSystem;
-
-// Global file system instance
-FileSystem fs;
-
-// Function prototypes
-int create_partition(const char* filename);
-int format_partition(const char* filename);
-int mount_partition(const char* filename);
-void unmount_partition();
-uint16_t allocate_block();
-void free_blocks(uint16_t first_block);
-int find_free_directory_entry(uint32_t dir_block);
-int find_file_in_directory(uint32_t dir_block, const char* filename);
-int read_block(uint32_t block_num, void* buffer);
-int write_block(uint32_t block_num, const void* buffer);
-
-// Low-level block operations
-int read_block(uint32_t block_num, void* buffer) {
-    if (!fs.disk_file || block_num >= fs.boot_sector.total_blocks) {
-        return -1;
-    }
-    
-    fseek(fs.disk_file, block_num * BLOCK_SIZE, SEEK_SET);
-    return fread(buffer, BLOCK_SIZE, 1, fs.disk_file) == 1 ? 0 : -1;
-}
-
-int write_block(uint32_t block_num, const void* buffer) {
-    if (!fs.disk_file || block_num >= fs.boot_sector.total_blocks) {
-        return -1;
-    }
-    
-    fseek(fs.disk_file, block_num * BLOCK_SIZE, SEEK_SET);
-    return fwrite(buffer, BLOCK_SIZE, 1, fs.disk_file) == 1 ? 0 : -1;
-}
-
-// FAT table operations
-uint16_t allocate_block() {
-    for (uint32_t i = fs.boot_sector.data_start_block; i < fs.boot_sector.total_blocks; i++) {
-        if (fs.fat_table[i] == FAT_ENTRY_FREE) {
-            fs.fat_table[i] = FAT_ENTRY_EOF;
-            
-            // Write updated FAT to disk
-            for (uint32_t j = 0; j < fs.boot_sector.fat_blocks; j++) {
-                write_block(1 + j, (uint8_t*)fs.fat_table + j * BLOCK_SIZE);
-            }
-            
-            return i;
-        }
-    }
-    return FAT_ENTRY_FREE; // No free blocks
-}
-
-void free_blocks(uint16_t first_block) {
-    uint16_t current_block = first_block;
-    
-    while (current_block != FAT_ENTRY_EOF && current_block != FAT_ENTRY_FREE) {
-        uint16_t next_block = fs.fat_table[current_block];
-        fs.fat_table[current_block] = FAT_ENTRY_FREE;
-        current_block = next_block;
-    }
-    
-    // Write updated FAT to disk
-    for (uint32_t i = 0; i < fs.boot_sector.fat_blocks; i++) {
-        write_block(1 + i, (uint8_t*)fs.fat_table + i * BLOCK_SIZE);
-    }
-}
-
-// Directory operations
-int find_free_directory_entry(uint32_t dir_block) {
-    Directory dir;
-    if (read_block(dir_block, &dir) != 0) {
-        return -1;
-    }
-    
-    for (int i = 0; i < MAX_FILES_IN_DIR; i++) {
-        if (dir.entries[i].filename[0] == '\0') {
-            return i;
-        }
-    }
-    return -1; // Directory full
-}
-
-int find_file_in_directory(uint32_t dir_block, const char* filename) {
-    Directory dir;
-    if (read_block(dir_block, &dir) != 0) {
-        return -1;
-    }
-    
-    for (int i = 0; i < MAX_FILES_IN_DIR; i++) {
-        if (dir.entries[i].filename[0] != '\0' && 
-            strcmp(dir.entries[i].filename, filename) == 0) {
-            return i;
-        }
-    }
-    return -1; // File not found
-}
-
-
-int create_partition(const char* filename) {
-    FILE* file = fopen(filename, "wb");
-    if (!file) {
-        printf("Error: Cannot create file '%s'\n", filename);
-        return -1;
-    }
-    
-    // Create empty file of TOTAL_DISK_SIZE by writing zeros
-    printf("Creating 64MB disk file...\n");
-    uint8_t* zeros = calloc(BLOCK_SIZE, 1);
-    if (!zeros) {
-        fclose(file);
-        return -1;
-    }
-    
-    // Write zeros in blocks to create the full disk size
-    for (int i = 0; i < TOTAL_DISK_SIZE / BLOCK_SIZE; i++) {
-        if (fwrite(zeros, BLOCK_SIZE, 1, file) != 1) {
-            free(zeros);
-            fclose(file);
-            return -1;
-        }
-    }
-    
-    free(zeros);
-    fclose(file);
-    printf("Disk file created successfully\n");
-    
-    return format_partition(filename);
-}
-
-
-int format_partition(const char* filename) {
-    // Open the file directly for formatting
-    FILE* file = fopen(filename, "rb+");
-    if (!file) {
-        printf("Error: Cannot open file '%s' for formatting\n", filename);
-        return -1;
-    }
-    
-    printf("Formatting file system...\n");
-    
-    // Initialize boot sector
-    BootSector boot_sector;
-    memset(&boot_sector, 0, sizeof(BootSector));
-    strcpy(boot_sector.signature, "MYFATFS");
-    boot_sector.total_blocks = MAX_BLOCKS;
-    boot_sector.block_size = BLOCK_SIZE;
-    boot_sector.fat_copies = 1;
-    boot_sector.created_time = (uint32_t)time(NULL);
-    strcpy(boot_sector.volume_label, "MYVOLUME");
-    
-    // Calculate FAT size (each FAT entry is 2 bytes)
-    uint32_t fat_entries = MAX_BLOCKS;
-    boot_sector.fat_blocks = (fat_entries * 2 + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    boot_sector.root_dir_block = 1 + boot_sector.fat_blocks;
-    boot_sector.data_start_block = boot_sector.root_dir_block + 1;
-    
-    // Write boot sector to block 0
-    fseek(file, 0, SEEK_SET);
-    fwrite(&boot_sector, sizeof(BootSector), 1, file);
-    
-    // Initialize FAT table
-    uint16_t* fat_table = calloc(MAX_BLOCKS, sizeof(uint16_t));
-    for (uint32_t i = 0; i < MAX_BLOCKS; i++) {
-        fat_table[i] = FAT_ENTRY_FREE;
-    }
-    
-    // Mark system blocks as used
-    for (uint32_t i = 0; i < boot_sector.data_start_block; i++) {
-        fat_table[i] = FAT_ENTRY_BAD;
-    }
-    
-    // Write FAT table
-    for (uint32_t i = 0; i < boot_sector.fat_blocks; i++) {
-        fseek(file, (1 + i) * BLOCK_SIZE, SEEK_SET);
-        fwrite((uint8_t*)fat_table + i * BLOCK_SIZE, BLOCK_SIZE, 1, file);
-    }
-    
-    // Initialize root directory - PROPERLY CLEAR ALL ENTRIES
-    Directory root_dir;
-    memset(&root_dir, 0, sizeof(Directory));  // This sets ALL bytes to zero
-    root_dir.entry_count = 0;
-
-    // Explicitly clear all directory entries to be sure
-    for (int i = 0; i < MAX_FILES_IN_DIR; i++) {
-        memset(&root_dir.entries[i], 0, sizeof(DirectoryEntry));
-    }
-
-    fseek(file, boot_sector.root_dir_block * BLOCK_SIZE, SEEK_SET);
-    fwrite(&root_dir, sizeof(Directory), 1, file);
-    
-    free(fat_table);
-    fclose(file);
-    
-    printf("Format completed successfully!\n");
-    printf(" - Total blocks: %u\n", boot_sector.total_blocks);
-    printf(" - FAT blocks: %u\n", boot_sector.fat_blocks);
-    printf(" - Root directory at block: %u\n", boot_sector.root_dir_block);
-    printf(" - Data starts at block: %u\n", boot_sector.data_start_block);
-    
-    return 0;
-}
-
-int mount_partition(const char* filename) {
-    // Close any previously mounted partition
-    if (fs.disk_file) {
-        fclose(fs.disk_file);
-    }
-    if (fs.fat_table) {
-        free(fs.fat_table);
-    }
-
-    fs.disk_file = fopen(filename, "rb+");
-    if (!fs.disk_file) {
-        printf("Error: Cannot open file '%s'\n", filename);
-        return -1;
-    }
-    
-    // Read boot sector
-    fseek(fs.disk_file, 0, SEEK_SET);
-    if (fread(&fs.boot_sector, sizeof(BootSector), 1, fs.disk_file) != 1) {
-        printf("Error: Cannot read boot sector\n");
-        fclose(fs.disk_file);
-        fs.disk_file = NULL;
-        return -1;
-    }
-    
-    // Verify signature
-    if (strcmp(fs.boot_sector.signature, "MYFATFS") != 0) {
-        printf("Error: Not a valid MYFATFS partition\n");
-        printf("Signature found: '%.8s'\n", fs.boot_sector.signature);
-        fclose(fs.disk_file);
-        fs.disk_file = NULL;
-        return -1;
-    }
-    
-    printf("Boot sector loaded successfully\n");
-    printf("Volume: %s, Blocks: %u, Block Size: %u\n", 
-           fs.boot_sector.volume_label, 
-           fs.boot_sector.total_blocks,
-           fs.boot_sector.block_size);
-    
-    // Allocate and read FAT table
-    fs.fat_table = malloc(MAX_BLOCKS * sizeof(uint16_t));
-    if (!fs.fat_table) {
-        printf("Error: Cannot allocate memory for FAT table\n");
-        fclose(fs.disk_file);
-        fs.disk_file = NULL;
-        return -1;
-    }
-    
-    // Read FAT table blocks
-    for (uint32_t i = 0; i < fs.boot_sector.fat_blocks; i++) {
-        fseek(fs.disk_file, (1 + i) * BLOCK_SIZE, SEEK_SET);
-        if (fread((uint8_t*)fs.fat_table + i * BLOCK_SIZE, BLOCK_SIZE, 1, fs.disk_file) != 1) {
-            printf("Error: Cannot read FAT block %u\n", i);
-            free(fs.fat_table);
-            fclose(fs.disk_file);
-            fs.disk_file = NULL;
-            return -1;
-        }
-    }
-    
-    printf("FAT table loaded (%u blocks)\n", fs.boot_sector.fat_blocks);
-    
-    fs.current_dir_block = fs.boot_sector.root_dir_block;
-    strcpy(fs.current_path, "/");
-    
-    printf("Partition mounted successfully at %s\n", fs.current_path);
-    return 0;
-}
-
-void unmount_partition() {
-    if (fs.disk_file) {
-        fclose(fs.disk_file);
-        fs.disk_file = NULL;
-    }
-    if (fs.fat_table) {
-        free(fs.fat_table);
-        fs.fat_table = NULL;
-    }
-}
-
-// File operations
-int create_file(const char* filename) {
-    if (strlen(filename) >= MAX_FILENAME_SIZE) {
-        printf("Filename too long\n");
-        return -1;
-    }
-    
-    Directory dir;
-    if (read_block(fs.current_dir_block, &dir) != 0) {
-        return -1;
-    }
-    
-    // Check if file already exists
-    if (find_file_in_directory(fs.current_dir_block, filename) >= 0) {
-        printf("File already exists\n");
-        return -1;
-    }
-    
-    int entry_index = find_free_directory_entry(fs.current_dir_block);
-    if (entry_index < 0) {
-        printf("Directory full\n");
-        return -1;
-    }
-    
-    // Create directory entry
-    DirectoryEntry* entry = &dir.entries[entry_index];
-    strcpy(entry->filename, filename);
-    entry->file_size = 0;
-    entry->first_block = FAT_ENTRY_EOF;
-    entry->type = TYPE_FILE;
-    entry->created_time = (uint32_t)time(NULL);
-    entry->modified_time = entry->created_time;
-    entry->attributes = 0;
-    
-    dir.entry_count++;
-    
-    // Write directory back to disk
-    if (write_block(fs.current_dir_block, &dir) != 0) {
-        return -1;
-    }
-    
-    printf("File '%s' created successfully\n", filename);
-    return 0;
-}
-
-int delete_file(const char* filename) {
-    Directory dir;
-    if (read_block(fs.current_dir_block, &dir) != 0) {
-        return -1;
-    }
-    
-    int entry_index = find_file_in_directory(fs.current_dir_block, filename);
-    if (entry_index < 0) {
-        printf("File not found\n");
-        return -1;
-    }
-    
-    DirectoryEntry* entry = &dir.entries[entry_index];
-    if (entry->type != TYPE_FILE) {
-        printf("Not a file\n");
-        return -1;
-    }
-    
-    // Free file blocks
-    if (entry->first_block != FAT_ENTRY_EOF) {
-        free_blocks(entry->first_block);
-    }
-    
-    // Clear directory entry
-    memset(entry, 0, sizeof(DirectoryEntry));
-    dir.entry_count--;
-    
-    // Write directory back to disk
-    if (write_block(fs.current_dir_block, &dir) != 0) {
-        return -1;
-    }
-    
-    printf("File '%s' deleted successfully\n", filename);
-    return 0;
-}
-
-int read_file(const char* filename) {
-    Directory dir;
-    if (read_block(fs.current_dir_block, &dir) != 0) {
-        return -1;
-    }
-    
-    int entry_index = find_file_in_directory(fs.current_dir_block, filename);
-    if (entry_index < 0) {
-        printf("File not found\n");
-        return -1;
-    }
-    
-    DirectoryEntry* entry = &dir.entries[entry_index];
-    if (entry->type != TYPE_FILE) {
-        printf("Not a file\n");
-        return -1;
-    }
-    
-    if (entry->file_size == 0) {
-        printf("File is empty\n");
-        return 0;
-    }
-    
-    // Read file data
-    uint16_t current_block = entry->first_block;
-    uint32_t bytes_remaining = entry->file_size;
-    uint8_t buffer[BLOCK_SIZE];
-    
-    printf("File content (%u bytes):\n", entry->file_size);
-    
-    while (current_block != FAT_ENTRY_EOF && bytes_remaining > 0) {
-        if (read_block(current_block, buffer) != 0) {
-            printf("Error reading block\n");
-            return -1;
-        }
-        
-        uint32_t bytes_to_print = bytes_remaining > BLOCK_SIZE ? BLOCK_SIZE : bytes_remaining;
-        fwrite(buffer, 1, bytes_to_print, stdout);
-        bytes_remaining -= bytes_to_print;
-        current_block = fs.fat_table[current_block];
-    }
-    
-    printf("\n");
-    return 0;
-}
-
-int write_file(const char* filename, const char* data) {
-    Directory dir;
-    if (read_block(fs.current_dir_block, &dir) != 0) {
-        return -1;
-    }
-    
-    int entry_index = find_file_in_directory(fs.current_dir_block, filename);
-    if (entry_index < 0) {
-        printf("File not found\n");
-        return -1;
-    }
-    
-    DirectoryEntry* entry = &dir.entries[entry_index];
-    if (entry->type != TYPE_FILE) {
-        printf("Not a file\n");
-        return -1;
-    }
-    
-    uint32_t data_size = strlen(data);
-    if (data_size > MAX_FILE_BLOCKS * BLOCK_SIZE) {
-        printf("File too large\n");
-        return -1;
-    }
-    
-    // Free existing blocks if any
-    if (entry->first_block != FAT_ENTRY_EOF) {
-        free_blocks(entry->first_block);
-    }
-    
-    // Allocate new blocks and write data
-    uint32_t bytes_remaining = data_size;
-    const uint8_t* data_ptr = (const uint8_t*)data;
-    uint16_t first_block = FAT_ENTRY_EOF;
-    uint16_t prev_block = FAT_ENTRY_EOF;
-    
-    while (bytes_remaining > 0) {
-        uint16_t new_block = allocate_block();
-        if (new_block == FAT_ENTRY_FREE) {
-            printf("No free space available\n");
-            // Free any allocated blocks so far
-            if (first_block != FAT_ENTRY_EOF) {
-                free_blocks(first_block);
-            }
-            return -1;
-        }
-        
-        if (first_block == FAT_ENTRY_EOF) {
-            first_block = new_block;
-        }
-        
-        if (prev_block != FAT_ENTRY_EOF) {
-            fs.fat_table[prev_block] = new_block;
-        }
-        
-        uint32_t bytes_to_write = bytes_remaining > BLOCK_SIZE ? BLOCK_SIZE : bytes_remaining;
-        uint8_t block_data[BLOCK_SIZE];
-        memset(block_data, 0, BLOCK_SIZE);
-        memcpy(block_data, data_ptr, bytes_to_write);
-        
-        if (write_block(new_block, block_data) != 0) {
-            printf("Error writing block\n");
-            free_blocks(first_block);
-            return -1;
-        }
-        
-        data_ptr += bytes_to_write;
-        bytes_remaining -= bytes_to_write;
-        prev_block = new_block;
-    }
-    
-    if (prev_block != FAT_ENTRY_EOF) {
-        fs.fat_table[prev_block] = FAT_ENTRY_EOF;
-    }
-    
-    // Update directory entry
-    entry->first_block = first_block;
-    entry->file_size = data_size;
-    entry->modified_time = (uint32_t)time(NULL);
-    
-    // Write directory back to disk
-    if (write_block(fs.current_dir_block, &dir) != 0) {
-        return -1;
-    }
-    
-    // Write updated FAT
-    for (uint32_t i = 0; i < fs.boot_sector.fat_blocks; i++) {
-        write_block(1 + i, (uint8_t*)fs.fat_table + i * BLOCK_SIZE);
-    }
-    
-    printf("Written %u bytes to file '%s'\n", data_size, filename);
-    return 0;
-}
-
-int truncate_file(const char* filename, uint32_t new_size) {
-    Directory dir;
-    if (read_block(fs.current_dir_block, &dir) != 0) {
-        return -1;
-    }
-    
-    int entry_index = find_file_in_directory(fs.current_dir_block, filename);
-    if (entry_index < 0) {
-        printf("File not found\n");
-        return -1;
-    }
-    
-    DirectoryEntry* entry = &dir.entries[entry_index];
-    if (entry->type != TYPE_FILE) {
-        printf("Not a file\n");
-        return -1;
-    }
-    
-    if (new_size > entry->file_size) {
-        printf("New size larger than current size - use write to extend file\n");
-        return -1;
-    }
-    
-    if (new_size == entry->file_size) {
-        return 0; // No change needed
-    }
-    
-    // Calculate blocks needed for new size
-    uint32_t blocks_needed = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    
-    // Traverse FAT to find where to truncate
-    uint16_t current_block = entry->first_block;
-    uint16_t prev_block = FAT_ENTRY_EOF;
-    
-    for (uint32_t i = 0; i < blocks_needed && current_block != FAT_ENTRY_EOF; i++) {
-        prev_block = current_block;
-        current_block = fs.fat_table[current_block];
-    }
-    
-    // Free remaining blocks
-    if (current_block != FAT_ENTRY_EOF) {
-        free_blocks(current_block);
-        if (prev_block != FAT_ENTRY_EOF) {
-            fs.fat_table[prev_block] = FAT_ENTRY_EOF;
-        }
-    }
-    
-    // Update directory entry
-    entry->file_size = new_size;
-    entry->modified_time = (uint32_t)time(NULL);
-    
-    // Write directory back to disk
-    if (write_block(fs.current_dir_block, &dir) != 0) {
-        return -1;
-    }
-    
-    printf("File '%s' truncated to %u bytes\n", filename, new_size);
-    return 0;
-}
-
-// Directory operations
-int create_directory(const char* dirname) {
-    if (strlen(dirname) >= MAX_FILENAME_SIZE) {
-        printf("Directory name too long\n");
-        return -1;
-    }
-    
-    Directory current_dir;
-    if (read_block(fs.current_dir_block, &current_dir) != 0) {
-        return -1;
-    }
-    
-    // Check if directory already exists
-    if (find_file_in_directory(fs.current_dir_block, dirname) >= 0) {
-        printf("Directory already exists\n");
-        return -1;
-    }
-    
-    int entry_index = find_free_directory_entry(fs.current_dir_block);
-    if (entry_index < 0) {
-        printf("Directory full\n");
-        return -1;
-    }
-    
-    // Allocate block for new directory
-    uint16_t dir_block = allocate_block();
-    if (dir_block == FAT_ENTRY_FREE) {
-        printf("No free space available\n");
-        return -1;
-    }
-    
-    // Initialize new directory
-    Directory new_dir;
-    memset(&new_dir, 0, sizeof(Directory));
-    new_dir.entry_count = 0;
-    
-    // Add "." entry (self)
-    strcpy(new_dir.entries[0].filename, ".");
-    new_dir.entries[0].first_block = dir_block;
-    new_dir.entries[0].type = TYPE_DIRECTORY;
-    new_dir.entries[0].created_time = (uint32_t)time(NULL);
-    new_dir.entries[0].modified_time = new_dir.entries[0].created_time;
-    new_dir.entry_count++;
-    
-    // Add ".." entry (parent)
-    strcpy(new_dir.entries[1].filename, "..");
-    new_dir.entries[1].first_block = fs.current_dir_block;
-    new_dir.entries[1].type = TYPE_DIRECTORY;
-    new_dir.entries[1].created_time = (uint32_t)time(NULL);
-    new_dir.entries[1].modified_time = new_dir.entries[1].created_time;
-    new_dir.entry_count++;
-    
-    // Write new directory to disk
-    if (write_block(dir_block, &new_dir) != 0) {
-        free_blocks(dir_block);
-        return -1;
-    }
-    
-    // Add directory entry to current directory
-    DirectoryEntry* entry = &current_dir.entries[entry_index];
-    strcpy(entry->filename, dirname);
-    entry->first_block = dir_block;
-    entry->type = TYPE_DIRECTORY;
-    entry->created_time = (uint32_t)time(NULL);
-    entry->modified_time = entry->created_time;
-    current_dir.entry_count++;
-    
-    // Write current directory back to disk
-    if (write_block(fs.current_dir_block, &current_dir) != 0) {
-        return -1;
-    }
-    
-    printf("Directory '%s' created successfully\n", dirname);
-    return 0;
-}
-
-int list_directory() {
-    Directory dir;
-    if (read_block(fs.current_dir_block, &dir) != 0) {
-        return -1;
-    }
-    
-    printf("Contents of %s:\n", fs.current_path);
-    printf("%-20s %-10s %-10s %s\n", "Name", "Type", "Size", "Modified");
-    printf("------------------------------------------------------------\n");
-    
-    for (int i = 0; i < MAX_FILES_IN_DIR; i++) {
-        if (dir.entries[i].filename[0] != '\0') {
-            printf("%-20s %-10s %-10u ", 
-                   dir.entries[i].filename,
-                   dir.entries[i].type == TYPE_FILE ? "FILE" : "DIR",
-                   dir.entries[i].file_size);
-            
-            // Format time
-            time_t mod_time = dir.entries[i].modified_time;
-            struct tm* timeinfo = localtime(&mod_time);
-            char time_str[20];
-            strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M", timeinfo);
-            printf("%s\n", time_str);
-        }
-    }
-    
-    return 0;
-}
-
-// Console interface
-void print_help() {
-    printf("\nAvailable commands:\n");
-    printf("  format <filename>        - Create and format a new partition\n");
-    printf("  mount <filename>         - Mount an existing partition\n");
-    printf("  unmount                  - Unmount current partition\n");
-    printf("  mkdir <dirname>          - Create a new directory\n");
-    printf("  ls                       - List directory contents\n");
-    printf("  create <filename>        - Create a new file\n");
-    printf("  delete <filename>        - Delete a file\n");
-    printf("  read <filename>          - Read and display file content\n");
-    printf("  write <filename> <data>  - Write data to file\n");
-    printf("  truncate <filename> <size> - Truncate file to specified size\n");
-    printf("  help                     - Show this help message\n");
-    printf("  exit                     - Exit the program\n");
-}
-
-void console_interface() {
-    char command[256];
-    char arg1[256];
-    char arg2[1024];
-    
-    printf("Custom FAT File System Console\n");
-    printf("Type 'help' for available commands\n");
-    
-    while (1) {
-        printf("\n%s> ", fs.current_path);
-        fflush(stdout);
-        
-        if (fgets(command, sizeof(command), stdin) == NULL) {
-            break;
-        }
-        
-        // Remove newline
-        command[strcspn(command, "\n")] = 0;
-        
-        // Parse command
-        if (strlen(command) == 0) {
-            continue;
-        }
-        
-        if (strcmp(command, "exit") == 0) {
-            break;
-        }
-        else if (strcmp(command, "help") == 0) {
-            print_help();
-        }
-        else if (strncmp(command, "format ", 7) == 0) {
-            if (sscanf(command, "format %255s", arg1) == 1) {
-                if (create_partition(arg1) == 0) {
-                    printf("Partition created and formatted successfully\n");
-                } else {
-                    printf("Failed to create partition\n");
-                }
-            } else {
-                printf("Usage: format <filename>\n");
-            }
-        }
-        else if (strncmp(command, "mount ", 6) == 0) {
-            if (sscanf(command, "mount %255s", arg1) == 1) {
-                if (mount_partition(arg1) == 0) {
-                    printf("Partition mounted successfully\n");
-                } else {
-                    printf("Failed to mount partition\n");
-                }
-            } else {
-                printf("Usage: mount <filename>\n");
-            }
-        }
-        else if (strcmp(command, "unmount") == 0) {
-            unmount_partition();
-            printf("Partition unmounted\n");
-        }
-        else if (strncmp(command, "mkdir ", 6) == 0) {
-            if (sscanf(command, "mkdir %255s", arg1) == 1) {
-                create_directory(arg1);
-            } else {
-                printf("Usage: mkdir <dirname>\n");
-            }
-        }
-        else if (strcmp(command, "ls") == 0) {
-            list_directory();
-        }
-        else if (strncmp(command, "create ", 7) == 0) {
-            if (sscanf(command, "create %255s", arg1) == 1) {
-                create_file(arg1);
-            } else {
-                printf("Usage: create <filename>\n");
-            }
-        }
-        else if (strncmp(command, "delete ", 7) == 0) {
-            if (sscanf(command, "delete %255s", arg1) == 1) {
-                delete_file(arg1);
-            } else {
-                printf("Usage: delete <filename>\n");
-            }
-        }
-        else if (strncmp(command, "read ", 5) == 0) {
-            if (sscanf(command, "read %255s", arg1) == 1) {
-                read_file(arg1);
-            } else {
-                printf("Usage: read <filename>\n");
-            }
-        }
-        else if (strncmp(command, "write ", 6) == 0) {
-            if (sscanf(command, "write %255s %1023[^\n]", arg1, arg2) == 2) {
-                write_file(arg1, arg2);
-            } else {
-                printf("Usage: write <filename> <data>\n");
-            }
-        }
-        else if (strncmp(command, "truncate ", 9) == 0) {
-            unsigned int size;
-            if (sscanf(command, "truncate %255s %u", arg1, &size) == 2) {
-                truncate_file(arg1, size);
-            } else {
-                printf("Usage: truncate <filename> <size>\n");
-            }
-        }
-        else {
-            printf("Unknown command: %s\n", command);
-            printf("Type 'help' for available commands\n");
-        }
-    }
-}
-
-int main() {
-    printf("Custom FAT File System Implementation\n");
-    printf("=====================================\n");
-    
-    // Initialize file system
-    memset(&fs, 0, sizeof(FileSystem));
-    
-    // Start console interface
-    console_interface();
-    
-    // Cleanup
-    unmount_partition();
-    
-    printf("Goodbye!\n");
-    return 0;
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#if defined(__x86_64__) && __has_include(<wmmintrin.h>)
+#include <wmmintrin.h>
+#define HAVE_AESNI 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO)
+#include <arm_neon.h>
+#define HAVE_ARMV8_AES 1
+#endif
+
+/*
+ * CUSTOM FILE SYSTEM IMPLEMENTATION USING FAT
+ * 
+ * DESIGN DOCUMENTATION:
+ * 
+ * File System Structure:
+ * ---------------------
+ * 1. Boot Sector (1 block): Contains metadata about the file system
+ * 2. FAT Table (128 blocks by default): File Allocation Table for tracking file blocks
+ * 3. Journal (253 blocks by default): Write-ahead log for FAT and directory blocks
+ * 4. Root Directory (1 block): First block of the root directory chain
+ * 5. Data Blocks (remaining): Actual file data storage
+ * 
+ * Key Design Decisions:
+ * - Block size (512B - 32KB, 1KB by default) and volume size chosen at format
+ * - Directories nest to any depth; paths are absolute or relative, with . and ..
+ * - FAT entries use 16-bit integers (up to 65536 blocks), 32-bit beyond that
+ * - Directory entries contain metadata and first block pointer
+ * - Directories are FAT chains of blocks holding variable-length records,
+ *   grown one block at a time as entries are added
+ * - The core API is thread-safe (see Locking); block I/O is positional
+ * - Bulk block I/O is batched through io_uring or a thread pool
+ * - The FAT is paged in on demand; a clean unmount saves the free count
+ * - Optional AES-256-XTS encryption of every block but the boot sector
+ * - Free blocks marked with 0xFFFF in FAT (0xFFFFFFFF in a 32-bit FAT)
+ * - End of file marked with 0xFFFE in FAT (0xFFFFFFFE)
+ * 
+ * Challenges Addressed:
+ * - Efficient block allocation/deallocation using FAT
+ * - Handling variable file names up to 64 bytes
+ * - Managing directory hierarchy within fixed constraints
+ * - Ensuring data integrity through proper error handling
+ */
+
+#define DEFAULT_BLOCK_SIZE 1024
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 32768       // Directory record lengths are 16-bit
+#define DEFAULT_DISK_MB 64
+#define MAX_TOTAL_BLOCKS (1u << 24)  // Keeps the in-memory FAT within 64 MB
+#define FAT16_MAX_BLOCKS 65536     // Larger volumes get a 32-bit FAT
+#define MAX_FILENAME_SIZE 64
+#define INLINE_MAX_SIZE 256        // Largest file kept in its directory record
+#define FAT_ENTRY_FREE 0xFFFFFFFF  // FAT markers in memory; see fat_from_disk()
+#define FAT_ENTRY_EOF 0xFFFFFFFE
+#define FAT_ENTRY_BAD 0xFFFFFFFD
+#define FAT16_ENTRY_BAD 0xFFFD     // Lowest marker on a FAT16 volume
+#define DEFAULT_CACHE_BLOCKS 256
+#define MAX_CACHE_BLOCKS 65536
+#define DEFAULT_READAHEAD_BLOCKS 64
+#define MAX_READAHEAD_BLOCKS 4096
+#define DIR_INDEX_MIN_SLOTS 64     // Initial hash table size, power of two
+#define DIR_INDEX_CACHE_SIZE 16    // Directories whose index is kept in memory
+#define DENTRY_CACHE_SIZE 1024     // Path components remembered by path lookups
+#define MAX_PATH_SIZE 256
+#define MAX_SNAPSHOTS 64           // Keeps every share count within a byte
+#define MAX_OPEN_FILES 32
+#define MAX_COMMAND_SIZE 1536      // A console line: command, 255-byte name and 1023 bytes of data
+#define LOCK_STRIPES 64            // Reader-writer locks shared out among directories and files
+#define ALLOC_GROUP_BLOCKS 4096    // Blocks per allocation group (a multiple of 64)
+#define JOURNAL_BLOCKS 253         // Journal region made by format: header + 252 images
+#define JOURNAL_MAX_BLOCKS(block_size) (((block_size) - 4 * sizeof(uint32_t)) / sizeof(uint32_t))
+#define JOURNAL_MAGIC 0x4C4E524A   // "JRNL"
+#define DEFAULT_COMMIT_INTERVAL 5  // Seconds a transaction may stay open
+#define DEFAULT_QUEUE_DEPTH 32     // Block requests one batch keeps in flight
+#define MAX_QUEUE_DEPTH 4096
+#define IO_POOL_THREADS 4          // Workers when io_uring is unavailable
+#define CRYPT_SALT_SIZE 16
+#define CRYPT_CHECK_SIZE 16
+#define CRYPT_MAX_KEY 128          // Longest passphrase, in bytes
+
+// File types
+#define TYPE_FILE 0
+#define TYPE_DIRECTORY 1
+
+// File system metadata structure (Boot Sector)
+typedef struct {
+    char signature[8];        // File system signature "MYFATFS"
+    uint32_t total_blocks;    // Total number of blocks
+    uint32_t fat_blocks;      // Number of blocks for FAT
+    uint32_t root_dir_block;  // Root directory block number
+    uint32_t data_start_block;// First data block number
+    uint16_t block_size;      // Block size in bytes
+    uint8_t fat_copies;       // Number of FAT copies (we use 1)
+    char volume_label[16];    // Volume label
+    uint32_t created_time;    // File system creation time
+    uint32_t journal_start;   // First block of the metadata journal, 0 if none
+    uint32_t journal_blocks;  // Size of the journal region
+    uint8_t fat_bits;         // FAT entry width, 16 or 32 (0 on older volumes: 16)
+    uint8_t clean;            // Set by a clean unmount: the next two fields are current
+    uint32_t free_count;      // Free blocks at the last clean unmount
+    uint32_t next_free;       // Where allocation was continuing then
+    uint32_t clean_sequence;  // Journal sequence then; a later commit voids them
+    uint8_t encrypted;        // Every other block is AES-XTS encrypted (see Encryption)
+    uint8_t crypt_salt[CRYPT_SALT_SIZE];   // PBKDF2 salt for the passphrase
+    uint32_t crypt_iterations;
+    uint8_t crypt_check[CRYPT_CHECK_SIZE]; // Tells a wrong passphrase at mount
+} BootSector;
+
+// First block of the journal region. The logged block images follow it in
+// the order of blocks[]. count 0 means there is nothing to replay.
+typedef struct {
+    uint32_t magic;
+    uint32_t sequence;        // Increases with every commit
+    uint32_t count;           // Number of logged blocks
+    uint32_t checksum;        // Over sequence, blocks[] and the images
+    uint32_t blocks[];        // Home block of each image, filling the block
+} JournalHeader;
+
+// Directory entry structure
+typedef struct {
+    char filename[MAX_FILENAME_SIZE];
+    uint32_t file_size;
+    uint32_t first_block;
+    uint8_t type;            // FILE or DIRECTORY
+    uint32_t created_time;
+    uint32_t modified_time;
+    uint8_t attributes;      // ATTR_* flags
+    uint8_t inline_data[INLINE_MAX_SIZE]; // The data of an ATTR_INLINE file
+} DirectoryEntry;
+
+// On-disk directory record. A directory is a FAT chain of blocks, each
+// block completely covered by records laid end to end. The name follows
+// the header without a terminator; a record with name_length 0 is free
+// space, and any record may carry slack after its name that a new entry
+// can be split off from.
+typedef struct {
+    uint16_t record_length;  // Bytes from this record to the next one
+    uint8_t name_length;     // 0 marks free space
+    uint8_t type;            // FILE or DIRECTORY
+    uint32_t first_block;
+    uint32_t file_size;
+    uint32_t created_time;
+    uint32_t modified_time;
+    uint8_t attributes;
+    uint8_t reserved[3];
+} DirRecord;
+
+// Records start on 4-byte boundaries
+#define DIR_RECORD_SIZE(name_length) ((uint32_t)(sizeof(DirRecord) + (name_length) + 3) & ~3u)
+
+// A file with ATTR_INLINE set has no chain: its file_size bytes of data
+// follow the name inside its record (at DIR_RECORD_SIZE(name_length))
+#define ATTR_INLINE 0x02
+#define INLINE_RESERVE 64          // Room left for it when a record is split
+
+// Marks /.snapshots and the share table file in it (see Snapshots)
+#define ATTR_SNAPSHOTS 0x04
+#define SNAPSHOT_DIR_NAME ".snapshots"
+#define SHARE_TABLE_NAME ".refcounts"
+
+// Where a directory record lives: its block and byte offset in that block
+typedef struct {
+    uint32_t block;
+    uint16_t offset;
+} DirEntryLoc;
+
+// Physically consecutive run of a file's chain
+typedef struct {
+    uint32_t logical;        // Index in the file of its first block
+    uint32_t start;          // Its first physical block
+    uint32_t length;
+} FileExtent;
+
+// Open file handle with an extent map of the file's FAT chain
+typedef struct {
+    uint8_t in_use;
+    DirEntryLoc loc;         // Directory record of the file
+    DirectoryEntry entry;    // Copy of the record, kept current by handle_update()
+    uint32_t position;       // Offset used by fs_read() and fs_write()
+    FileExtent* extents;     // The chain as runs, in file order
+    uint32_t extent_count;
+    uint32_t extent_capacity;
+    uint32_t mapped_blocks;  // Blocks the extents cover
+    uint32_t* chunks;        // Compressed files: stream offset and stored length per chunk
+    uint32_t chunk_count;
+    uint32_t unshared;       // Leading blocks known to be the file's alone (see Block sharing)
+} FileHandle;
+
+// Block cache slot
+typedef struct {
+    uint32_t block_num;
+    int32_t hash_next;       // Next slot in the same hash bucket, -1 ends
+    uint8_t valid;
+    uint8_t dirty;
+    uint8_t referenced;      // CLOCK reference bit
+    uint16_t pin_count;      // Pinned slots are never evicted
+    uint8_t* data;
+} CacheSlot;
+
+// Write-back block cache with CLOCK replacement
+typedef struct {
+    CacheSlot* slots;
+    uint8_t* data;           // capacity * fs.block_size bytes backing the slots
+    int32_t* buckets;
+    uint32_t capacity;
+    uint32_t bucket_mask;
+    uint32_t clock_hand;
+    uint32_t dirty_count;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t writebacks;
+    uint64_t evictions;
+    uint64_t writeback_seq;  // Bumped by every write that goes around or out of the cache
+} BlockCache;
+
+// In-memory index for one directory. An open-addressing hash table maps each
+// filename to the location of its record, with the name kept in the slot
+// so a lookup never touches the directory blocks. The directory's chain is
+// remembered too, with the largest free gap of each block, so inserting an
+// entry reads only the block it goes into.
+typedef struct {
+    char name[MAX_FILENAME_SIZE];
+    uint32_t hash;
+    DirEntryLoc loc;
+    uint8_t state;           // DIR_SLOT_EMPTY, DIR_SLOT_USED or DIR_SLOT_DELETED
+} DirIndexSlot;
+
+#define DIR_SLOT_EMPTY 0
+#define DIR_SLOT_USED 1
+#define DIR_SLOT_DELETED 2
+
+typedef struct {
+    uint32_t dir_block;      // First block of the directory, 0 marks unused
+    uint64_t last_used;      // For LRU replacement
+    DirIndexSlot* slots;
+    uint32_t slot_count;     // Power of two
+    uint32_t used_count;
+    uint32_t deleted_count;
+    uint32_t* blocks;        // Directory chain in order
+    uint16_t* largest_free;  // Largest gap a record can be placed in, per block
+    uint32_t block_count;
+    uint32_t block_capacity;
+} DirIndex;
+
+// Dentry cache slot: 'name' in the directory starting at 'parent' is the
+// subdirectory starting at 'block'
+typedef struct {
+    uint32_t parent;         // 0 marks an empty slot
+    uint32_t block;
+    char name[MAX_FILENAME_SIZE];
+} DentrySlot;
+
+// Block device backends
+//
+// The mounted disk file is accessed through a small table of operations so
+// the storage path can be chosen at mount time. map() returns a pointer to
+// 'count' consecutive blocks inside the backing storage, or NULL if the
+// backend cannot do so. read_run() and write_run() transfer consecutive
+// blocks in one request and prefetch() tells the backend a run will be
+// read soon.
+typedef struct BlockDevice BlockDevice;
+
+// AES key schedule (see Encryption): round keys as words for the software
+// cipher and as bytes for the AES instructions
+typedef struct {
+    uint32_t ek[60];
+    uint32_t dk[60];
+    uint8_t enc[15][16] __attribute__((aligned(16)));
+    uint8_t dec[15][16] __attribute__((aligned(16)));
+    int rounds;
+} AesKey;
+
+typedef struct {
+    AesKey data;             // Encrypts the 16-byte units of a block
+    AesKey tweak;            // Encrypts the block number into the tweak
+    int hardware;            // AES instructions are used
+    uint32_t block_size;     // Of the volume the key belongs to
+} XtsKey;
+
+typedef struct {
+    const char* name;
+    int (*open)(BlockDevice* dev, const char* filename);
+    void (*close)(BlockDevice* dev);
+    int (*read)(BlockDevice* dev, uint32_t block_num, void* buffer);
+    int (*write)(BlockDevice* dev, uint32_t block_num, const void* buffer);
+    int (*sync)(BlockDevice* dev);
+    void* (*map)(BlockDevice* dev, uint32_t block_num, uint32_t count);
+    int (*read_run)(BlockDevice* dev, uint32_t block_num, uint32_t count, void* buffer);
+    int (*write_run)(BlockDevice* dev, uint32_t block_num, uint32_t count, const void* buffer);
+    void (*prefetch)(BlockDevice* dev, uint32_t block_num, uint32_t count);
+} BlockDeviceOps;
+
+struct BlockDevice {
+    const BlockDeviceOps* ops;  // NULL while nothing is mounted
+    const BlockDeviceOps* backend; // The storage under ops: the same, or under the encryption layer
+    XtsKey* crypt;              // Key of an encrypted volume, NULL otherwise
+    int fd;
+    uint8_t* mapping;
+    size_t mapping_size;
+    uint64_t blocks_read;       // Blocks transferred since mount
+    uint64_t blocks_written;
+};
+
+// Asynchronous block requests (see Asynchronous I/O)
+typedef void (*IoCallback)(void* ctx, int result);
+
+typedef struct IoBatch IoBatch;
+
+typedef struct IoRequest {
+    int write;
+    uint32_t block_num;
+    uint32_t count;
+    void* buffer;
+    IoCallback done;         // Optional, called once the request finished
+    void* ctx;
+    int result;
+    IoBatch* batch;
+    struct IoRequest* next;  // Thread pool queue
+} IoRequest;
+
+struct IoBatch {
+    IoRequest* requests;
+    uint32_t capacity;
+    uint32_t used;
+    uint32_t pending;        // Queued but not finished
+    int failed;
+    uint64_t started;        // When the first request was queued
+};
+
+enum { IO_SYNC, IO_URING, IO_THREADS };
+
+typedef struct {
+    int kind;
+    uint32_t queue_depth;
+    pthread_mutex_t lock;    // Ring or queue, and every completion
+    pthread_cond_t work;     // Thread pool: a request was queued
+    pthread_cond_t finished; // Thread pool: a request finished
+    // io_uring
+    int ring_fd;
+    void* sq_ring;
+    void* cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t* sq_array;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t sq_mask;
+    uint32_t cq_mask;
+    uint32_t ring_entries;
+    uint32_t unsubmitted;    // Entries queued but not yet given to the kernel
+    uint32_t in_flight;
+    // Thread pool
+    pthread_t threads[IO_POOL_THREADS];
+    uint32_t thread_count;
+    IoRequest* queue_head;
+    IoRequest* queue_tail;
+    int stopping;
+    // Statistics
+    uint64_t requests;
+    uint64_t blocks;
+    uint64_t submits;        // io_uring_enter() calls or pool hand-offs
+    uint64_t busy_ns;        // Time batches had requests outstanding
+} IoEngine;
+
+// Options accepted by mount_partition()
+typedef struct {
+    uint32_t cache_blocks;
+    uint32_t readahead_blocks;
+    uint32_t commit_interval;
+    uint32_t queue_depth;
+    int force_threads;
+    const BlockDeviceOps* backend;
+    char key[CRYPT_MAX_KEY];  // Passphrase of an encrypted volume
+} MountOptions;
+
+// Options accepted by create_partition()
+typedef struct {
+    uint32_t block_size;
+    uint32_t disk_mb;
+    uint32_t fat_bits;       // 16 or 32
+    int preallocate;
+    int encrypt;
+    char key[CRYPT_MAX_KEY];
+} FormatOptions;
+
+// Open metadata transaction. log holds a JournalHeader followed by the
+// images, exactly as the commit writes them to the journal region.
+typedef struct {
+    uint32_t start;           // Journal header block, 0 when not journaling
+    uint32_t capacity;        // Most blocks one transaction can log
+    uint32_t count;           // Blocks logged in the open transaction
+    uint32_t sequence;        // Sequence number of the last commit
+    uint8_t* log;             // (capacity + 1) * fs.block_size bytes
+    uint64_t* logged;         // One bit per disk block, set while logged
+    time_t opened;            // When the transaction's first block was logged
+    uint32_t commit_interval;
+    uint8_t dirty;            // Journal region holds a commit not yet marked clean
+    uint64_t commits;
+    uint64_t logged_blocks;   // Block writes absorbed by the journal
+} Journal;
+
+// One allocation group: a slice of the data area with its own share of
+// the free-space map. start/end are fixed at mount; the lock is held while
+// the group is searched.
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t start;           // First data block of the group
+    uint32_t end;             // One past its last block
+    uint32_t free_count;      // Free blocks in [start, end), once scanned
+    uint32_t next_free_hint;  // Where the next scan of the group starts
+    int scanned;              // Its free map bits and count have been built
+} AllocGroup;
+
+// Hot-path counters (see Instrumentation)
+#define STAT_BUCKETS 32
+
+enum { STAT_READ_BLOCK, STAT_WRITE_BLOCK, STAT_ALLOCATE, STAT_FREE, STAT_LOOKUP, STAT_FAT_FLUSH, STAT_COUNT };
+
+typedef struct {
+    uint64_t calls;
+    uint64_t blocks;          // Blocks moved, allocated, freed or flushed
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[STAT_BUCKETS];  // Latency histogram, see stat_record()
+} OpStat;
+
+// File System context
+typedef struct {
+    BlockDevice device;
+    IoEngine io;
+    BlockCache cache;
+    Journal journal;
+    BootSector boot_sector;
+    uint32_t block_size;      // From the boot sector, for the mounted volume
+    uint32_t fat_bits;        // On-disk FAT entry width
+    uint32_t fat_entries_per_block;
+    uint32_t** fat_pages;     // One page of entries per FAT block, NULL until loaded
+    uint32_t fat_pages_loaded;
+    uint8_t* fat_dirty;       // One bit per FAT block changed since last flush
+    uint32_t fat_dirty_count; // Number of bits set in fat_dirty
+    uint64_t* free_map;       // One bit per block, set while the block is free
+    uint32_t free_map_limit;  // Blocks at or above this are never allocated
+    uint32_t free_count;      // Free blocks on the volume
+    uint32_t next_free;       // Block after the last allocation
+    uint32_t base_group;      // Where threads' home groups start
+    AllocGroup* groups;
+    uint32_t group_count;
+    uint8_t* shares;          // Owners beyond the first, per block; NULL without snapshots
+    uint32_t* share_chain;    // Blocks of the share table file, in order
+    uint32_t share_table_blocks;
+    uint8_t* share_dirty;     // One bit per table block changed since last flush
+    uint32_t share_dirty_count;
+    uint32_t snapshot_dir;    // First block of /.snapshots, 0 if the volume has none
+    DirIndex* dir_indexes[DIR_INDEX_CACHE_SIZE];
+    uint64_t dir_index_clock;
+    DentrySlot dentries[DENTRY_CACHE_SIZE];
+    uint64_t dentry_hits;
+    uint64_t dentry_misses;
+    OpStat op_stats[STAT_COUNT];
+    uint32_t readahead_blocks;  // Longest run read_file() reads in one request
+    uint32_t defrag_resume;     // Files the next defrag skips, see defrag()
+    FileHandle handles[MAX_OPEN_FILES];
+    pthread_rwlock_t volume_lock;
+    pthread_rwlock_t dir_locks[LOCK_STRIPES];
+    pthread_rwlock_t file_locks[LOCK_STRIPES];
+    pthread_mutex_t dir_lock;   // Directory index, dentry cache and directory block updates
+    pthread_mutex_t fat_lock;   // Serializes fat_flush() and FAT page loads
+    pthread_mutex_t block_lock; // Block cache and journal transaction (recursive)
+    pthread_mutex_t handle_lock;
+    uint32_t current_dir_block;
+    char current_path[MAX_PATH_SIZE];
+} FileSystem;
+
+// Global file system instance
+FileSystem fs;
+
+// Function prototypes
+void fs_init();
+int stress_test(uint32_t max_threads, uint32_t seconds);
+int create_partition(const char* filename, const char* options);
+int parse_format_options(const char* options, FormatOptions* opts);
+int format_partition(const char* filename, const FormatOptions* opts);
+int parse_mount_options(const char* options, MountOptions* opts);
+int mount_partition(const char* filename, const char* options);
+void unmount_partition();
+int sync_partition();
+uint32_t fat_get(uint32_t block);
+void fat_set(uint32_t block, uint32_t value);
+int fat_flush();
+int share_flush();
+int build_free_map(int scan);
+void free_map_destroy();
+uint32_t allocate_block(uint32_t goal);
+int allocate_extent(uint32_t count, uint32_t goal, uint32_t* first);
+void free_blocks(uint32_t first_block);
+int find_file_in_directory(uint32_t dir_block, const char* filename, DirEntryLoc* loc);
+int dir_read_entry(const DirEntryLoc* loc, DirectoryEntry* entry);
+int dir_write_entry(const DirEntryLoc* loc, const DirectoryEntry* entry);
+int dir_add_entry(uint32_t dir_block, const DirectoryEntry* entry, DirEntryLoc* loc);
+int dir_remove_entry(uint32_t dir_block, const DirEntryLoc* loc);
+int dir_iterate(uint32_t dir_block,
+                int (*visit)(const DirectoryEntry* entry, const DirEntryLoc* loc, void* ctx),
+                void* ctx);
+void dir_index_clear();
+void dentry_cache_clear();
+void handle_update(const DirEntryLoc* loc, const DirectoryEntry* entry, uint32_t valid_blocks);
+void handle_close_all();
+int handle_make_plain(FileHandle* handle);
+int fs_open(const char* filename);
+int fs_close(int fd);
+int fs_ftruncate(int fd, uint32_t new_size);
+int fs_pread(int fd, void* buffer, uint32_t count, uint32_t offset);
+int fs_pwrite(int fd, const void* buffer, uint32_t count, uint32_t offset);
+int64_t fs_seek(int fd, int64_t offset, int whence);
+int fs_read(int fd, void* buffer, uint32_t count);
+int fs_write(int fd, const void* buffer, uint32_t count);
+int fs_append(int fd, const void* buffer, uint32_t count);
+int append_file(const char* filename, const char* data);
+int read_block(uint32_t block_num, void* buffer);
+int write_block(uint32_t block_num, const void* buffer);
+int journal_init(uint32_t commit_interval);
+void journal_destroy();
+int journal_replay();
+const uint8_t* journal_find(uint32_t block_num);
+int journal_write(uint32_t block_num, const void* buffer);
+void journal_revoke(uint32_t block_num);
+int journal_write_log();
+int journal_checkpoint();
+int journal_commit();
+int journal_tick();
+int journal_flush();
+int io_init(uint32_t queue_depth, int force_threads);
+void io_destroy();
+int io_batch_init(IoBatch* batch, uint32_t capacity);
+void io_batch_destroy(IoBatch* batch);
+int io_batch_add(IoBatch* batch, int write, uint32_t block_num, uint32_t count, void* buffer,
+                 IoCallback done, void* ctx);
+int io_batch_wait(IoBatch* batch);
+int cache_init(uint32_t capacity);
+void cache_destroy();
+int cache_flush();
+int cache_pin(uint32_t block_num);
+void cache_unpin(uint32_t block_num);
+const void* map_block(uint32_t block_num);
+const void* map_blocks(uint32_t block_num, uint32_t count);
+int read_blocks(uint32_t block_num, uint32_t count, void* buffer);
+int write_blocks(uint32_t block_num, uint32_t count, const void* buffer);
+int import_file(const char* host_path, const char* filename);
+int compress_file(const char* filename, int compress);
+int bench(const char* options);
+int defrag(const char* options);
+int check_volume(const char* options);
+int snapshot_create(const char* name);
+int snapshot_list();
+int snapshot_delete(const char* name);
+void print_stats();
+void print_stats_json(FILE* out);
+void stats_reset();
+int export_file(const char* filename, const char* host_path);
+
+// Every backend transfer is counted here, so benchmarks can report how
+// many blocks an operation really moved
+static void device_count(BlockDevice* dev, int write, uint32_t count) {
+    __atomic_fetch_add(write ? &dev->blocks_written : &dev->blocks_read, count, __ATOMIC_RELAXED);
+}
+
+// pread backend: positional read/write on a file descriptor. There is no
+// shared file offset, so any number of threads can do block I/O at once.
+static int pread_open(BlockDevice* dev, const char* filename) {
+    dev->fd = open(filename, O_RDWR);
+    return dev->fd >= 0 ? 0 : -1;
+}
+
+static void pread_close(BlockDevice* dev) {
+    close(dev->fd);
+    dev->fd = -1;
+}
+
+static int pread_full(int fd, void* buffer, size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t done = pread(fd, buffer, length, offset);
+        if (done <= 0) {
+            return -1;
+        }
+        buffer = (uint8_t*)buffer + done;
+        length -= done;
+        offset += done;
+    }
+    return 0;
+}
+
+static int pwrite_full(int fd, const void* buffer, size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t done = pwrite(fd, buffer, length, offset);
+        if (done <= 0) {
+            return -1;
+        }
+        buffer = (const uint8_t*)buffer + done;
+        length -= done;
+        offset += done;
+    }
+    return 0;
+}
+
+static int pread_read(BlockDevice* dev, uint32_t block_num, void* buffer) {
+    device_count(dev, 0, 1);
+    return pread_full(dev->fd, buffer, fs.block_size, (off_t)block_num * fs.block_size);
+}
+
+static int pread_write(BlockDevice* dev, uint32_t block_num, const void* buffer) {
+    device_count(dev, 1, 1);
+    return pwrite_full(dev->fd, buffer, fs.block_size, (off_t)block_num * fs.block_size);
+}
+
+static int pread_sync(BlockDevice* dev) {
+    return fdatasync(dev->fd);
+}
+
+static void* pread_map(BlockDevice* dev, uint32_t block_num, uint32_t count) {
+    (void)dev;
+    (void)block_num;
+    (void)count;
+    return NULL;
+}
+
+static int pread_read_run(BlockDevice* dev, uint32_t block_num, uint32_t count, void* buffer) {
+    device_count(dev, 0, count);
+    return pread_full(dev->fd, buffer, (size_t)count * fs.block_size, (off_t)block_num * fs.block_size);
+}
+
+static int pread_write_run(BlockDevice* dev, uint32_t block_num, uint32_t count, const void* buffer) {
+    device_count(dev, 1, count);
+    return pwrite_full(dev->fd, buffer, (size_t)count * fs.block_size, (off_t)block_num * fs.block_size);
+}
+
+static void pread_prefetch(BlockDevice* dev, uint32_t block_num, uint32_t count) {
+    posix_fadvise(dev->fd, (off_t)block_num * fs.block_size, (off_t)count * fs.block_size, POSIX_FADV_WILLNEED);
+}
+
+static const BlockDeviceOps pread_device_ops = {
+    "pread", pread_open, pread_close, pread_read, pread_write, pread_sync, pread_map,
+    pread_read_run, pread_write_run, pread_prefetch
+};
+
+// mmap backend: the whole disk file is mapped shared, so block access is a
+// memcpy (or no copy at all through map()) and sync is an msync()
+static int mmap_open(BlockDevice* dev, const char* filename) {
+    struct stat st;
+    
+    dev->fd = open(filename, O_RDWR);
+    if (dev->fd < 0) {
+        return -1;
+    }
+    if (fstat(dev->fd, &st) != 0 || st.st_size < fs.block_size) {
+        close(dev->fd);
+        return -1;
+    }
+    
+    dev->mapping_size = (size_t)st.st_size;
+    dev->mapping = mmap(NULL, dev->mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, 0);
+    if (dev->mapping == MAP_FAILED) {
+        dev->mapping = NULL;
+        close(dev->fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void mmap_close(BlockDevice* dev) {
+    munmap(dev->mapping, dev->mapping_size);
+    close(dev->fd);
+    dev->mapping = NULL;
+    dev->mapping_size = 0;
+    dev->fd = -1;
+}
+
+static void* mmap_map(BlockDevice* dev, uint32_t block_num, uint32_t count) {
+    size_t offset = (size_t)block_num * fs.block_size;
+    if (offset + (size_t)count * fs.block_size > dev->mapping_size) {
+        return NULL;
+    }
+    return dev->mapping + offset;
+}
+
+static int mmap_read(BlockDevice* dev, uint32_t block_num, void* buffer) {
+    void* block = mmap_map(dev, block_num, 1);
+    if (!block) {
+        return -1;
+    }
+    device_count(dev, 0, 1);
+    memcpy(buffer, block, fs.block_size);
+    return 0;
+}
+
+static int mmap_write(BlockDevice* dev, uint32_t block_num, const void* buffer) {
+    void* block = mmap_map(dev, block_num, 1);
+    if (!block) {
+        return -1;
+    }
+    device_count(dev, 1, 1);
+    memcpy(block, buffer, fs.block_size);
+    return 0;
+}
+
+static int mmap_sync(BlockDevice* dev) {
+    return msync(dev->mapping, dev->mapping_size, MS_SYNC);
+}
+
+static int mmap_read_run(BlockDevice* dev, uint32_t block_num, uint32_t count, void* buffer) {
+    void* blocks = mmap_map(dev, block_num, count);
+    if (!blocks) {
+        return -1;
+    }
+    device_count(dev, 0, count);
+    memcpy(buffer, blocks, (size_t)count * fs.block_size);
+    return 0;
+}
+
+static int mmap_write_run(BlockDevice* dev, uint32_t block_num, uint32_t count, const void* buffer) {
+    void* blocks = mmap_map(dev, block_num, count);
+    if (!blocks) {
+        return -1;
+    }
+    device_count(dev, 1, count);
+    memcpy(blocks, buffer, (size_t)count * fs.block_size);
+    return 0;
+}
+
+static void mmap_prefetch(BlockDevice* dev, uint32_t block_num, uint32_t count) {
+    void* blocks = mmap_map(dev, block_num, count);
+    if (blocks) {
+        // madvise() wants a page-aligned start
+        uintptr_t page_mask = (uintptr_t)sysconf(_SC_PAGESIZE) - 1;
+        uintptr_t start = (uintptr_t)blocks & ~page_mask;
+        madvise((void*)start, (uintptr_t)blocks - start + (size_t)count * fs.block_size, MADV_WILLNEED);
+    }
+}
+
+static const BlockDeviceOps mmap_device_ops = {
+    "mmap", mmap_open, mmap_close, mmap_read, mmap_write, mmap_sync, mmap_map,
+    mmap_read_run, mmap_write_run, mmap_prefetch
+};
+
+// Encryption
+//
+// An encrypted volume (format option encrypt) keeps every block except the
+// boot sector encrypted with AES-256 in XTS mode, one XTS data unit per
+// block with the block number as the tweak. The layer is a BlockDeviceOps
+// wrapping the backend chosen at mount, so the cache, the journal and all
+// in-memory structures hold plaintext and only transfers to and from the
+// device pay for the cipher. The 512-bit XTS key is derived from the
+// passphrase with PBKDF2-HMAC-SHA256 over a random salt kept in the boot
+// sector, next to a check value that rejects a wrong passphrase at mount.
+//
+// AES runs on AES-NI or the ARMv8 crypto extensions when the CPU has them,
+// eight 16-byte units in flight at a time; otherwise on a table-driven
+// software implementation.
+#define CRYPT_KDF_ITERATIONS 100000
+#define CRYPT_WRITE_BLOCKS 64      // Blocks encrypted per backend request on write
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t buffer[64];
+    uint32_t fill;
+} Sha256;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t load_be32(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void store_be32(uint8_t* p, uint32_t value) {
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)value;
+}
+
+static uint32_t ror32(uint32_t value, int bits) {
+    return value >> bits | value << (32 - bits);
+}
+
+static void sha256_block(uint32_t* state, const uint8_t* data) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = load_be32(data + 4 * i);
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+static void sha256_init(Sha256* ctx) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->fill = 0;
+}
+
+static void sha256_update(Sha256* ctx, const void* data, size_t length) {
+    const uint8_t* bytes = data;
+    ctx->length += length;
+    while (length > 0) {
+        uint32_t take = 64 - ctx->fill < length ? 64 - ctx->fill : (uint32_t)length;
+        memcpy(ctx->buffer + ctx->fill, bytes, take);
+        ctx->fill += take;
+        bytes += take;
+        length -= take;
+        if (ctx->fill == 64) {
+            sha256_block(ctx->state, ctx->buffer);
+            ctx->fill = 0;
+        }
+    }
+}
+
+static void sha256_final(Sha256* ctx, uint8_t* digest) {
+    uint64_t bits = ctx->length * 8;
+    uint8_t pad = 0x80;
+    sha256_update(ctx, &pad, 1);
+    pad = 0;
+    while (ctx->fill != 56) {
+        sha256_update(ctx, &pad, 1);
+    }
+    uint8_t length[8];
+    store_be32(length, (uint32_t)(bits >> 32));
+    store_be32(length + 4, (uint32_t)bits);
+    sha256_update(ctx, length, 8);
+    for (int i = 0; i < 8; i++) {
+        store_be32(digest + 4 * i, ctx->state[i]);
+    }
+}
+
+// HMAC-SHA256 with the padded key already hashed in, so each message
+// costs two compressions more than its own length
+typedef struct {
+    Sha256 inner;
+    Sha256 outer;
+} HmacSha256;
+
+static void hmac_init(HmacSha256* hmac, const void* key, size_t key_length) {
+    uint8_t block[64];
+    memset(block, 0, sizeof(block));
+    if (key_length > sizeof(block)) {
+        Sha256 ctx;
+        sha256_init(&ctx);
+        sha256_update(&ctx, key, key_length);
+        sha256_final(&ctx, block);
+    } else {
+        memcpy(block, key, key_length);
+    }
+    
+    uint8_t pad[64];
+    for (int i = 0; i < 64; i++) {
+        pad[i] = block[i] ^ 0x36;
+    }
+    sha256_init(&hmac->inner);
+    sha256_update(&hmac->inner, pad, sizeof(pad));
+    for (int i = 0; i < 64; i++) {
+        pad[i] = block[i] ^ 0x5c;
+    }
+    sha256_init(&hmac->outer);
+    sha256_update(&hmac->outer, pad, sizeof(pad));
+}
+
+static void hmac_sign(const HmacSha256* hmac, const void* data, size_t length, uint8_t* mac) {
+    uint8_t digest[32];
+    Sha256 ctx = hmac->inner;
+    sha256_update(&ctx, data, length);
+    sha256_final(&ctx, digest);
+    ctx = hmac->outer;
+    sha256_update(&ctx, digest, sizeof(digest));
+    sha256_final(&ctx, mac);
+}
+
+// PBKDF2-HMAC-SHA256 (RFC 8018) of 'length' bytes
+static void pbkdf2_sha256(const char* passphrase, const uint8_t* salt, size_t salt_length, uint32_t iterations,
+                          uint8_t* out, size_t length) {
+    HmacSha256 hmac;
+    hmac_init(&hmac, passphrase, strlen(passphrase));
+    
+    for (uint32_t index = 1; length > 0; index++) {
+        uint8_t input[CRYPT_SALT_SIZE + 4];
+        uint8_t u[32];
+        uint8_t t[32];
+        memcpy(input, salt, salt_length);
+        store_be32(input + salt_length, index);
+        hmac_sign(&hmac, input, salt_length + 4, u);
+        memcpy(t, u, sizeof(t));
+        for (uint32_t i = 1; i < iterations; i++) {
+            hmac_sign(&hmac, u, sizeof(u), u);
+            for (int j = 0; j < 32; j++) {
+                t[j] ^= u[j];
+            }
+        }
+        size_t take = length < sizeof(t) ? length : sizeof(t);
+        memcpy(out, t, take);
+        out += take;
+        length -= take;
+    }
+}
+
+// Software AES. The S-boxes and round tables are computed once from the
+// field arithmetic instead of being spelled out.
+static uint8_t aes_sbox[256];
+static uint8_t aes_inv_sbox[256];
+static uint32_t aes_te[256];  // SubBytes then MixColumns of one byte, first column
+static uint32_t aes_td[256];  // InvSubBytes then InvMixColumns
+static pthread_once_t aes_tables_once = PTHREAD_ONCE_INIT;
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+    uint8_t product = 0;
+    while (b) {
+        if (b & 1) {
+            product ^= a;
+        }
+        a = (uint8_t)(a << 1) ^ (a & 0x80 ? 0x1b : 0);
+        b >>= 1;
+    }
+    return product;
+}
+
+static void aes_tables_init() {
+    for (int x = 0; x < 256; x++) {
+        // Multiplicative inverse as x^254, then the affine transform
+        uint8_t inverse = x ? 1 : 0;
+        for (int i = 0; x && i < 254; i++) {
+            inverse = gf_mul(inverse, (uint8_t)x);
+        }
+        uint8_t s = inverse;
+        for (int i = 1; i < 5; i++) {
+            s ^= (uint8_t)(inverse << i | inverse >> (8 - i));
+        }
+        s ^= 0x63;
+        aes_sbox[x] = s;
+        aes_inv_sbox[s] = (uint8_t)x;
+    }
+    for (int x = 0; x < 256; x++) {
+        uint8_t s = aes_sbox[x];
+        uint8_t i = aes_inv_sbox[x];
+        aes_te[x] = (uint32_t)gf_mul(s, 2) << 24 | (uint32_t)s << 16 | (uint32_t)s << 8 | gf_mul(s, 3);
+        aes_td[x] = (uint32_t)gf_mul(i, 14) << 24 | (uint32_t)gf_mul(i, 9) << 16 |
+                    (uint32_t)gf_mul(i, 13) << 8 | gf_mul(i, 11);
+    }
+}
+
+static uint32_t aes_sub_word(uint32_t w) {
+    return (uint32_t)aes_sbox[w >> 24] << 24 | (uint32_t)aes_sbox[(w >> 16) & 0xff] << 16 |
+           (uint32_t)aes_sbox[(w >> 8) & 0xff] << 8 | aes_sbox[w & 0xff];
+}
+
+static uint32_t aes_inv_mix_word(uint32_t w) {
+    return aes_td[aes_sbox[w >> 24]] ^ ror32(aes_td[aes_sbox[(w >> 16) & 0xff]], 8) ^
+           ror32(aes_td[aes_sbox[(w >> 8) & 0xff]], 16) ^ ror32(aes_td[aes_sbox[w & 0xff]], 24);
+}
+
+// Expands a 16- or 32-byte key. The decryption schedule is that of the
+// equivalent inverse cipher, the form AES-NI and ARMv8 expect as well.
+static void aes_set_key(AesKey* key, const uint8_t* bytes, int key_bytes) {
+    pthread_once(&aes_tables_once, aes_tables_init);
+    int nk = key_bytes / 4;
+    int words = 4 * (nk + 7);
+    key->rounds = nk + 6;
+    
+    uint32_t* w = key->ek;
+    uint32_t rcon = 1;
+    for (int i = 0; i < nk; i++) {
+        w[i] = load_be32(bytes + 4 * i);
+    }
+    for (int i = nk; i < words; i++) {
+        uint32_t t = w[i - 1];
+        if (i % nk == 0) {
+            t = aes_sub_word(t << 8 | t >> 24) ^ rcon << 24;
+            rcon = gf_mul((uint8_t)rcon, 2);
+        } else if (nk > 6 && i % nk == 4) {
+            t = aes_sub_word(t);
+        }
+        w[i] = w[i - nk] ^ t;
+    }
+    
+    for (int round = 0; round <= key->rounds; round++) {
+        for (int j = 0; j < 4; j++) {
+            uint32_t word = key->ek[4 * (key->rounds - round) + j];
+            int middle = round > 0 && round < key->rounds;
+            key->dk[4 * round + j] = middle ? aes_inv_mix_word(word) : word;
+        }
+    }
+    for (int i = 0; i < words; i++) {
+        store_be32(key->enc[i / 4] + 4 * (i % 4), key->ek[i]);
+        store_be32(key->dec[i / 4] + 4 * (i % 4), key->dk[i]);
+    }
+}
+
+static void aes_encrypt_soft(const AesKey* key, const uint8_t* in, uint8_t* out) {
+    const uint32_t* rk = key->ek;
+    uint32_t s0 = load_be32(in) ^ rk[0];
+    uint32_t s1 = load_be32(in + 4) ^ rk[1];
+    uint32_t s2 = load_be32(in + 8) ^ rk[2];
+    uint32_t s3 = load_be32(in + 12) ^ rk[3];
+    
+    for (int round = 1; round < key->rounds; round++) {
+        rk += 4;
+        uint32_t t0 = aes_te[s0 >> 24] ^ ror32(aes_te[(s1 >> 16) & 0xff], 8) ^
+                      ror32(aes_te[(s2 >> 8) & 0xff], 16) ^ ror32(aes_te[s3 & 0xff], 24) ^ rk[0];
+        uint32_t t1 = aes_te[s1 >> 24] ^ ror32(aes_te[(s2 >> 16) & 0xff], 8) ^
+                      ror32(aes_te[(s3 >> 8) & 0xff], 16) ^ ror32(aes_te[s0 & 0xff], 24) ^ rk[1];
+        uint32_t t2 = aes_te[s2 >> 24] ^ ror32(aes_te[(s3 >> 16) & 0xff], 8) ^
+                      ror32(aes_te[(s0 >> 8) & 0xff], 16) ^ ror32(aes_te[s1 & 0xff], 24) ^ rk[2];
+        uint32_t t3 = aes_te[s3 >> 24] ^ ror32(aes_te[(s0 >> 16) & 0xff], 8) ^
+                      ror32(aes_te[(s1 >> 8) & 0xff], 16) ^ ror32(aes_te[s2 & 0xff], 24) ^ rk[3];
+        s0 = t0;
+        s1 = t1;
+        s2 = t2;
+        s3 = t3;
+    }
+    
+    rk += 4;
+    uint32_t s[4] = { s0, s1, s2, s3 };
+    for (int j = 0; j < 4; j++) {
+        uint32_t word = (uint32_t)aes_sbox[s[j] >> 24] << 24 | (uint32_t)aes_sbox[(s[(j + 1) % 4] >> 16) & 0xff] << 16 |
+                        (uint32_t)aes_sbox[(s[(j + 2) % 4] >> 8) & 0xff] << 8 | aes_sbox[s[(j + 3) % 4] & 0xff];
+        store_be32(out + 4 * j, word ^ rk[j]);
+    }
+}
+
+static void aes_decrypt_soft(const AesKey* key, const uint8_t* in, uint8_t* out) {
+    const uint32_t* rk = key->dk;
+    uint32_t s0 = load_be32(in) ^ rk[0];
+    uint32_t s1 = load_be32(in + 4) ^ rk[1];
+    uint32_t s2 = load_be32(in + 8) ^ rk[2];
+    uint32_t s3 = load_be32(in + 12) ^ rk[3];
+    
+    for (int round = 1; round < key->rounds; round++) {
+        rk += 4;
+        uint32_t t0 = aes_td[s0 >> 24] ^ ror32(aes_td[(s3 >> 16) & 0xff], 8) ^
+                      ror32(aes_td[(s2 >> 8) & 0xff], 16) ^ ror32(aes_td[s1 & 0xff], 24) ^ rk[0];
+        uint32_t t1 = aes_td[s1 >> 24] ^ ror32(aes_td[(s0 >> 16) & 0xff], 8) ^
+                      ror32(aes_td[(s3 >> 8) & 0xff], 16) ^ ror32(aes_td[s2 & 0xff], 24) ^ rk[1];
+        uint32_t t2 = aes_td[s2 >> 24] ^ ror32(aes_td[(s1 >> 16) & 0xff], 8) ^
+                      ror32(aes_td[(s0 >> 8) & 0xff], 16) ^ ror32(aes_td[s3 & 0xff], 24) ^ rk[2];
+        uint32_t t3 = aes_td[s3 >> 24] ^ ror32(aes_td[(s2 >> 16) & 0xff], 8) ^
+                      ror32(aes_td[(s1 >> 8) & 0xff], 16) ^ ror32(aes_td[s0 & 0xff], 24) ^ rk[3];
+        s0 = t0;
+        s1 = t1;
+        s2 = t2;
+        s3 = t3;
+    }
+    
+    rk += 4;
+    uint32_t s[4] = { s0, s1, s2, s3 };
+    for (int j = 0; j < 4; j++) {
+        uint32_t word = (uint32_t)aes_inv_sbox[s[j] >> 24] << 24 |
+                        (uint32_t)aes_inv_sbox[(s[(j + 3) % 4] >> 16) & 0xff] << 16 |
+                        (uint32_t)aes_inv_sbox[(s[(j + 2) % 4] >> 8) & 0xff] << 8 |
+                        aes_inv_sbox[s[(j + 1) % 4] & 0xff];
+        store_be32(out + 4 * j, word ^ rk[j]);
+    }
+}
+
+// XTS on eight 16-byte units: out = AES(in ^ tweak) ^ tweak
+static void xts_units_soft(const AesKey* key, int decrypt, const uint8_t* in, uint8_t* out, const uint8_t* tweaks) {
+    for (int unit = 0; unit < 8; unit++) {
+        uint8_t x[16];
+        for (int i = 0; i < 16; i++) {
+            x[i] = in[16 * unit + i] ^ tweaks[16 * unit + i];
+        }
+        if (decrypt) {
+            aes_decrypt_soft(key, x, x);
+        } else {
+            aes_encrypt_soft(key, x, x);
+        }
+        for (int i = 0; i < 16; i++) {
+            out[16 * unit + i] = x[i] ^ tweaks[16 * unit + i];
+        }
+    }
+}
+
+#ifdef HAVE_AESNI
+// The eight units go through each round together, which keeps the AES
+// unit's pipeline full
+__attribute__((target("aes,sse2")))
+static void xts_units_hw(const AesKey* key, int decrypt, const uint8_t* in, uint8_t* out, const uint8_t* tweaks) {
+    const __m128i* rk = (const __m128i*)(decrypt ? key->dec : key->enc);
+    __m128i t[8];
+    __m128i b[8];
+    for (int i = 0; i < 8; i++) {
+        t[i] = _mm_loadu_si128((const __m128i*)(tweaks + 16 * i));
+        b[i] = _mm_xor_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i*)(in + 16 * i)), t[i]), rk[0]);
+    }
+    for (int round = 1; round < key->rounds; round++) {
+        for (int i = 0; i < 8; i++) {
+            b[i] = decrypt ? _mm_aesdec_si128(b[i], rk[round]) : _mm_aesenc_si128(b[i], rk[round]);
+        }
+    }
+    for (int i = 0; i < 8; i++) {
+        b[i] = decrypt ? _mm_aesdeclast_si128(b[i], rk[key->rounds]) : _mm_aesenclast_si128(b[i], rk[key->rounds]);
+        _mm_storeu_si128((__m128i*)(out + 16 * i), _mm_xor_si128(b[i], t[i]));
+    }
+}
+
+__attribute__((target("aes,sse2")))
+static void aes_encrypt_hw(const AesKey* key, const uint8_t* in, uint8_t* out) {
+    const __m128i* rk = (const __m128i*)key->enc;
+    __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i*)in), rk[0]);
+    for (int round = 1; round < key->rounds; round++) {
+        b = _mm_aesenc_si128(b, rk[round]);
+    }
+    _mm_storeu_si128((__m128i*)out, _mm_aesenclast_si128(b, rk[key->rounds]));
+}
+
+static int aes_hw_available() {
+    return __builtin_cpu_supports("aes");
+}
+#elif defined(HAVE_ARMV8_AES)
+static void xts_units_hw(const AesKey* key, int decrypt, const uint8_t* in, uint8_t* out, const uint8_t* tweaks) {
+    const uint8_t (*rk)[16] = decrypt ? key->dec : key->enc;
+    uint8x16_t t[8];
+    uint8x16_t b[8];
+    for (int i = 0; i < 8; i++) {
+        t[i] = vld1q_u8(tweaks + 16 * i);
+        b[i] = veorq_u8(vld1q_u8(in + 16 * i), t[i]);
+    }
+    for (int round = 0; round < key->rounds - 1; round++) {
+        uint8x16_t k = vld1q_u8(rk[round]);
+        for (int i = 0; i < 8; i++) {
+            b[i] = decrypt ? vaesimcq_u8(vaesdq_u8(b[i], k)) : vaesmcq_u8(vaeseq_u8(b[i], k));
+        }
+    }
+    uint8x16_t k = vld1q_u8(rk[key->rounds - 1]);
+    uint8x16_t last = vld1q_u8(rk[key->rounds]);
+    for (int i = 0; i < 8; i++) {
+        b[i] = veorq_u8(decrypt ? vaesdq_u8(b[i], k) : vaeseq_u8(b[i], k), last);
+        vst1q_u8(out + 16 * i, veorq_u8(b[i], t[i]));
+    }
+}
+
+static void aes_encrypt_hw(const AesKey* key, const uint8_t* in, uint8_t* out) {
+    uint8x16_t b = vld1q_u8(in);
+    for (int round = 0; round < key->rounds - 1; round++) {
+        b = vaesmcq_u8(vaeseq_u8(b, vld1q_u8(key->enc[round])));
+    }
+    b = vaeseq_u8(b, vld1q_u8(key->enc[key->rounds - 1]));
+    vst1q_u8(out, veorq_u8(b, vld1q_u8(key->enc[key->rounds])));
+}
+
+static int aes_hw_available() {
+    return 1;
+}
+#else
+static void xts_units_hw(const AesKey* key, int decrypt, const uint8_t* in, uint8_t* out, const uint8_t* tweaks) {
+    xts_units_soft(key, decrypt, in, out, tweaks);
+}
+
+static void aes_encrypt_hw(const AesKey* key, const uint8_t* in, uint8_t* out) {
+    aes_encrypt_soft(key, in, out);
+}
+
+static int aes_hw_available() {
+    return 0;
+}
+#endif
+
+// Sets up the XTS keys from the 64 derived bytes, for blocks of 'block_size'
+static void xts_init(XtsKey* xts, const uint8_t* key, uint32_t block_size) {
+    aes_set_key(&xts->data, key, 32);
+    aes_set_key(&xts->tweak, key + 32, 32);
+    xts->hardware = aes_hw_available();
+    xts->block_size = block_size;
+}
+
+// Encrypts or decrypts 'count' blocks starting at 'block_num' from 'in'
+// to 'out', which may be the same buffer. The boot sector passes through
+// as it is. Block sizes are multiples of 128 bytes, so every block is a
+// whole number of eight-unit groups and no ciphertext stealing is needed.
+static void xts_crypt(const XtsKey* xts, int decrypt, uint32_t block_num, uint32_t count, const uint8_t* in,
+                      uint8_t* out) {
+    uint32_t block_size = xts->block_size;
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t* src = in + (size_t)i * block_size;
+        uint8_t* dst = out + (size_t)i * block_size;
+        if (block_num + i == 0) {
+            memmove(dst, src, block_size);
+            continue;
+        }
+    
+        // The tweak is the encrypted block number, multiplied by x in
+        // GF(2^128) from one unit to the next
+        uint8_t tweak[16] = { 0 };
+        uint32_t number = block_num + i;
+        memcpy(tweak, &number, sizeof(number));
+        if (xts->hardware) {
+            aes_encrypt_hw(&xts->tweak, tweak, tweak);
+        } else {
+            aes_encrypt_soft(&xts->tweak, tweak, tweak);
+        }
+        uint64_t lo;
+        uint64_t hi;
+        memcpy(&lo, tweak, 8);
+        memcpy(&hi, tweak + 8, 8);
+    
+        for (uint32_t offset = 0; offset < block_size; offset += 128) {
+            uint8_t tweaks[128];
+            for (int unit = 0; unit < 8; unit++) {
+                memcpy(tweaks + 16 * unit, &lo, 8);
+                memcpy(tweaks + 16 * unit + 8, &hi, 8);
+                uint64_t carry = hi >> 63;
+                hi = hi << 1 | lo >> 63;
+                lo = lo << 1 ^ (carry ? 0x87 : 0);
+            }
+            if (xts->hardware) {
+                xts_units_hw(&xts->data, decrypt, src + offset, dst + offset, tweaks);
+            } else {
+                xts_units_soft(&xts->data, decrypt, src + offset, dst + offset, tweaks);
+            }
+        }
+    }
+}
+
+// Derives the XTS key of 'boot' from 'passphrase'. With 'check' set the
+// stored check value must match; otherwise it is computed into 'boot'.
+static int crypt_derive(BootSector* boot, const char* passphrase, int check, XtsKey* xts) {
+    uint8_t key[64];
+    uint8_t mac[32];
+    HmacSha256 hmac;
+    pbkdf2_sha256(passphrase, boot->crypt_salt, CRYPT_SALT_SIZE, boot->crypt_iterations, key, sizeof(key));
+    hmac_init(&hmac, key, sizeof(key));
+    hmac_sign(&hmac, "MYFATFS key check", 17, mac);
+    
+    int result = 0;
+    if (!check) {
+        memcpy(boot->crypt_check, mac, CRYPT_CHECK_SIZE);
+    } else if (memcmp(boot->crypt_check, mac, CRYPT_CHECK_SIZE) != 0) {
+        result = -1;
+    }
+    if (result == 0) {
+        xts_init(xts, key, boot->block_size);
+    }
+    memset(key, 0, sizeof(key));
+    memset(&hmac, 0, sizeof(hmac));
+    return result;
+}
+
+// Encryption layer over dev->backend
+static int crypt_open(BlockDevice* dev, const char* filename) {
+    return dev->backend->open(dev, filename);
+}
+
+static void crypt_close(BlockDevice* dev) {
+    dev->backend->close(dev);
+    if (dev->crypt) {
+        memset(dev->crypt, 0, sizeof(XtsKey));
+        free(dev->crypt);
+        dev->crypt = NULL;
+    }
+}
+
+static int crypt_read(BlockDevice* dev, uint32_t block_num, void* buffer) {
+    if (dev->backend->read(dev, block_num, buffer) != 0) {
+        return -1;
+    }
+    xts_crypt(dev->crypt, 1, block_num, 1, buffer, buffer);
+    return 0;
+}
+
+static int crypt_write(BlockDevice* dev, uint32_t block_num, const void* buffer) {
+    uint8_t data[dev->crypt->block_size];
+    xts_crypt(dev->crypt, 0, block_num, 1, buffer, data);
+    return dev->backend->write(dev, block_num, data);
+}
+
+static int crypt_sync(BlockDevice* dev) {
+    return dev->backend->sync(dev);
+}
+
+// The mapping holds ciphertext, so nothing may read it directly
+static void* crypt_map(BlockDevice* dev, uint32_t block_num, uint32_t count) {
+    (void)dev;
+    (void)block_num;
+    (void)count;
+    return NULL;
+}
+
+static int crypt_read_run(BlockDevice* dev, uint32_t block_num, uint32_t count, void* buffer) {
+    if (dev->backend->read_run(dev, block_num, count, buffer) != 0) {
+        return -1;
+    }
+    xts_crypt(dev->crypt, 1, block_num, count, buffer, buffer);
+    return 0;
+}
+
+// The caller's plaintext must stay as it is, so runs are encrypted into a
+// bounce buffer a piece at a time
+static int crypt_write_run(BlockDevice* dev, uint32_t block_num, uint32_t count, const void* buffer) {
+    uint32_t block_size = dev->crypt->block_size;
+    uint32_t piece = count < CRYPT_WRITE_BLOCKS ? count : CRYPT_WRITE_BLOCKS;
+    uint8_t* data = malloc((size_t)piece * block_size);
+    int result = data ? 0 : -1;
+    for (uint32_t done = 0; result == 0 && done < count; done += piece) {
+        uint32_t length = count - done < piece ? count - done : piece;
+        const uint8_t* src = (const uint8_t*)buffer + (size_t)done * block_size;
+        xts_crypt(dev->crypt, 0, block_num + done, length, src, data);
+        result = dev->backend->write_run(dev, block_num + done, length, data);
+    }
+    free(data);
+    return result;
+}
+
+static void crypt_prefetch(BlockDevice* dev, uint32_t block_num, uint32_t count) {
+    dev->backend->prefetch(dev, block_num, count);
+}
+
+static const BlockDeviceOps crypt_device_ops = {
+    "xts", crypt_open, crypt_close, crypt_read, crypt_write, crypt_sync, crypt_map,
+    crypt_read_run, crypt_write_run, crypt_prefetch
+};
+
+// Fills 'buffer' from the kernel's random source
+static int crypt_random(void* buffer, size_t length) {
+    int fd = open("/dev/urandom", O_RDONLY);
+    int result = fd >= 0 && pread_full(fd, buffer, length, 0) == 0 ? 0 : -1;
+    if (fd >= 0) {
+        close(fd);
+    }
+    return result;
+}
+
+// Low-level disk operations (bypass the cache)
+static int disk_read_block(uint32_t block_num, void* buffer) {
+    return fs.device.ops->read(&fs.device, block_num, buffer);
+}
+
+static int disk_write_block(uint32_t block_num, const void* buffer) {
+    return fs.device.ops->write(&fs.device, block_num, buffer);
+}
+
+// Asynchronous I/O
+//
+// Bulk transfers (cache write-back, journal checkpoints, import and
+// export) hand their block requests to an engine in batches instead of
+// doing one blocking call per request. io_batch_add() queues a request,
+// io_batch_wait() waits for every request of the batch and returns -1 if
+// any failed. A request's callback, if given, runs on whichever thread
+// reaps its completion and must not start further I/O.
+//
+// With io_uring the requests of a batch become submission queue entries
+// and are passed to the kernel with one io_uring_enter(), which also waits
+// for completions; the ring is driven through raw system calls. Where
+// io_uring is not available a small thread pool runs the requests with
+// pread/pwrite instead. With qd=0, or a backend that is not file-descriptor
+// based, every request completes inside io_batch_add().
+static uint64_t monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int io_sync_request(const IoRequest* req) {
+    if (req->write) {
+        return fs.device.ops->write_run(&fs.device, req->block_num, req->count, req->buffer);
+    }
+    return fs.device.ops->read_run(&fs.device, req->block_num, req->count, req->buffer);
+}
+
+// Records a finished request. Called with fs.io.lock held for the
+// asynchronous engines.
+static void io_complete(IoRequest* req, int result) {
+    req->result = result;
+    if (result != 0) {
+        req->batch->failed = 1;
+    }
+    if (req->done) {
+        req->done(req->ctx, result);
+    }
+    __atomic_fetch_add(&fs.io.requests, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&fs.io.blocks, req->count, __ATOMIC_RELAXED);
+    req->batch->pending--;
+}
+
+#ifdef HAVE_IO_URING
+static int io_uring_setup_ring(uint32_t entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd < 0) {
+        return -1;
+    }
+    
+    IoEngine* io = &fs.io;
+    io->ring_fd = ring_fd;
+    io->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    io->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    io->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    
+    io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring_fd, IORING_OFF_SQ_RING);
+    io->cq_ring = mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring_fd, IORING_OFF_CQ_RING);
+    io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring_fd, IORING_OFF_SQES);
+    if (io->sq_ring == MAP_FAILED || io->cq_ring == MAP_FAILED || io->sqes == MAP_FAILED) {
+        return -1;
+    }
+    
+    uint8_t* sq = io->sq_ring;
+    uint8_t* cq = io->cq_ring;
+    io->sq_head = (uint32_t*)(sq + params.sq_off.head);
+    io->sq_tail = (uint32_t*)(sq + params.sq_off.tail);
+    io->sq_mask = *(uint32_t*)(sq + params.sq_off.ring_mask);
+    io->sq_array = (uint32_t*)(sq + params.sq_off.array);
+    io->cq_head = (uint32_t*)(cq + params.cq_off.head);
+    io->cq_tail = (uint32_t*)(cq + params.cq_off.tail);
+    io->cq_mask = *(uint32_t*)(cq + params.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    io->ring_entries = params.sq_entries;
+    return 0;
+}
+
+static void io_uring_teardown() {
+    IoEngine* io = &fs.io;
+    if (io->sq_ring && io->sq_ring != MAP_FAILED) {
+        munmap(io->sq_ring, io->sq_ring_size);
+    }
+    if (io->cq_ring && io->cq_ring != MAP_FAILED) {
+        munmap(io->cq_ring, io->cq_ring_size);
+    }
+    if (io->sqes && io->sqes != MAP_FAILED) {
+        munmap(io->sqes, io->sqes_size);
+    }
+    if (io->ring_fd >= 0) {
+        close(io->ring_fd);
+    }
+    io->sq_ring = io->cq_ring = NULL;
+    io->sqes = NULL;
+    io->ring_fd = -1;
+}
+
+// Hands queued entries to the kernel and, with 'wait' set, blocks until at
+// least one completion is posted
+static int io_uring_enter_ring(int wait) {
+    IoEngine* io = &fs.io;
+    while (1) {
+        int submitted = (int)syscall(__NR_io_uring_enter, io->ring_fd, io->unsubmitted, wait ? 1 : 0,
+                                     wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (submitted >= 0) {
+            io->unsubmitted -= submitted;
+            io->submits++;
+            return 0;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return -1;
+        }
+    }
+}
+
+// Retires every posted completion. A short transfer is finished with a
+// synchronous request rather than failed.
+static void io_uring_reap() {
+    IoEngine* io = &fs.io;
+    uint32_t head = *io->cq_head;
+    while (head != __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe* cqe = &io->cqes[head & io->cq_mask];
+        IoRequest* req = (IoRequest*)(uintptr_t)cqe->user_data;
+        int result = cqe->res == (int)(req->count * fs.block_size) ? 0 : io_sync_request(req);
+        head++;
+        __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+        io->in_flight--;
+        io_complete(req, result);
+    }
+}
+
+static int io_uring_queue(IoRequest* req) {
+    IoEngine* io = &fs.io;
+    pthread_mutex_lock(&io->lock);
+    
+    // Never have more requests out than the completion ring can report
+    while (io->in_flight == io->ring_entries) {
+        if (io_uring_enter_ring(1) != 0) {
+            pthread_mutex_unlock(&io->lock);
+            return -1;
+        }
+        io_uring_reap();
+    }
+    
+    uint32_t tail = *io->sq_tail;
+    uint32_t index = tail & io->sq_mask;
+    struct io_uring_sqe* sqe = &io->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fs.device.fd;
+    sqe->addr = (uintptr_t)req->buffer;
+    sqe->len = req->count * fs.block_size;
+    sqe->off = (uint64_t)req->block_num * fs.block_size;
+    sqe->user_data = (uintptr_t)req;
+    io->sq_array[index] = index;
+    device_count(&fs.device, req->write, req->count);
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    io->unsubmitted++;
+    io->in_flight++;
+    req->batch->pending++;
+    
+    pthread_mutex_unlock(&io->lock);
+    return 0;
+}
+
+static int io_uring_wait(IoBatch* batch) {
+    IoEngine* io = &fs.io;
+    int result = 0;
+    
+    pthread_mutex_lock(&io->lock);
+    while (batch->pending > 0) {
+        io_uring_reap();
+        if (batch->pending == 0) {
+            break;
+        }
+        if (io_uring_enter_ring(1) != 0) {
+            result = -1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&io->lock);
+    return result;
+}
+#endif
+
+// Thread pool fallback: workers take requests from a FIFO
+static void* io_worker(void* arg) {
+    (void)arg;
+    IoEngine* io = &fs.io;
+    
+    pthread_mutex_lock(&io->lock);
+    while (1) {
+        while (!io->queue_head && !io->stopping) {
+            pthread_cond_wait(&io->work, &io->lock);
+        }
+        if (!io->queue_head) {
+            break;
+        }
+        IoRequest* req = io->queue_head;
+        io->queue_head = req->next;
+        if (!io->queue_head) {
+            io->queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&io->lock);
+    
+        int result = io_sync_request(req);
+    
+        pthread_mutex_lock(&io->lock);
+        io_complete(req, result);
+        pthread_cond_broadcast(&io->finished);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return NULL;
+}
+
+static int io_pool_queue(IoRequest* req) {
+    IoEngine* io = &fs.io;
+    pthread_mutex_lock(&io->lock);
+    req->next = NULL;
+    if (io->queue_tail) {
+        io->queue_tail->next = req;
+    } else {
+        io->queue_head = req;
+    }
+    io->queue_tail = req;
+    io->submits++;
+    req->batch->pending++;
+    pthread_cond_signal(&io->work);
+    pthread_mutex_unlock(&io->lock);
+    return 0;
+}
+
+static int io_pool_wait(IoBatch* batch) {
+    IoEngine* io = &fs.io;
+    pthread_mutex_lock(&io->lock);
+    while (batch->pending > 0) {
+        pthread_cond_wait(&io->finished, &io->lock);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return 0;
+}
+
+static const char* io_engine_name() {
+    switch (fs.io.kind) {
+    case IO_URING:
+        return "io_uring";
+    case IO_THREADS:
+        return "thread pool";
+    default:
+        return "synchronous";
+    }
+}
+
+// Starts the engine for the mounted device. 'force_threads' skips io_uring.
+int io_init(uint32_t queue_depth, int force_threads) {
+    IoEngine* io = &fs.io;
+    io->kind = IO_SYNC;
+    io->queue_depth = 0;
+    io->ring_fd = -1;
+    io->requests = io->blocks = io->submits = io->busy_ns = 0;
+    if (queue_depth == 0 || fs.device.backend != &pread_device_ops) {
+        return 0;
+    }
+    io->queue_depth = queue_depth;
+    
+    // io_uring would hand the plaintext buffers straight to the kernel; the
+    // pool's workers go through the encryption layer, in parallel
+#ifdef HAVE_IO_URING
+    if (!force_threads && !fs.device.crypt) {
+        if (io_uring_setup_ring(queue_depth) == 0) {
+            io->kind = IO_URING;
+            return 0;
+        }
+        io_uring_teardown();
+    }
+#else
+    (void)force_threads;
+#endif
+    
+    io->stopping = 0;
+    for (io->thread_count = 0; io->thread_count < IO_POOL_THREADS; io->thread_count++) {
+        if (pthread_create(&io->threads[io->thread_count], NULL, io_worker, NULL) != 0) {
+            break;
+        }
+    }
+    if (io->thread_count == 0) {
+        io->queue_depth = 0;
+        return 0; // Stay synchronous
+    }
+    io->kind = IO_THREADS;
+    return 0;
+}
+
+void io_destroy() {
+    IoEngine* io = &fs.io;
+    if (io->kind == IO_THREADS) {
+        pthread_mutex_lock(&io->lock);
+        io->stopping = 1;
+        pthread_cond_broadcast(&io->work);
+        pthread_mutex_unlock(&io->lock);
+        for (uint32_t i = 0; i < io->thread_count; i++) {
+            pthread_join(io->threads[i], NULL);
+        }
+        io->thread_count = 0;
+    }
+#ifdef HAVE_IO_URING
+    if (io->kind == IO_URING) {
+        io_uring_teardown();
+    }
+#endif
+    io->kind = IO_SYNC;
+}
+
+// Prepares a batch that keeps at most 'capacity' requests (and no more
+// than the queue depth) outstanding
+int io_batch_init(IoBatch* batch, uint32_t capacity) {
+    memset(batch, 0, sizeof(IoBatch));
+    if (fs.io.queue_depth > 0 && capacity > fs.io.queue_depth) {
+        capacity = fs.io.queue_depth;
+    }
+    batch->capacity = capacity > 0 ? capacity : 1;
+    batch->requests = malloc(batch->capacity * sizeof(IoRequest));
+    return batch->requests ? 0 : -1;
+}
+
+void io_batch_destroy(IoBatch* batch) {
+    free(batch->requests);
+    batch->requests = NULL;
+}
+
+// 'pending' is only read under the engine lock, since other threads
+// retire this batch's requests
+int io_batch_wait(IoBatch* batch) {
+    int result = 0;
+#ifdef HAVE_IO_URING
+    if (fs.io.kind == IO_URING) {
+        result = io_uring_wait(batch);
+    }
+#endif
+    if (fs.io.kind == IO_THREADS) {
+        result = io_pool_wait(batch);
+    }
+    
+    if (batch->used > 0) {
+        __atomic_fetch_add(&fs.io.busy_ns, monotonic_ns() - batch->started, __ATOMIC_RELAXED);
+    }
+    if (batch->failed) {
+        result = -1;
+    }
+    batch->used = 0;
+    batch->failed = 0;
+    return result;
+}
+
+// Queues a transfer of 'count' blocks at 'block_num'. The buffer must stay
+// untouched until the batch has been waited for. A full batch is waited
+// for first, so its earlier requests must not be reused until then.
+int io_batch_add(IoBatch* batch, int write, uint32_t block_num, uint32_t count, void* buffer,
+                 IoCallback done, void* ctx) {
+    if (batch->used == batch->capacity && io_batch_wait(batch) != 0) {
+        batch->failed = 1;
+    }
+    if (batch->used == 0) {
+        batch->started = monotonic_ns();
+    }
+    
+    IoRequest* req = &batch->requests[batch->used++];
+    req->write = write;
+    req->block_num = block_num;
+    req->count = count;
+    req->buffer = buffer;
+    req->done = done;
+    req->ctx = ctx;
+    req->result = 0;
+    req->batch = batch;
+    
+    if (fs.io.kind == IO_SYNC) {
+        batch->pending++;
+        io_complete(req, io_sync_request(req));
+        return 0;
+    }
+    
+    int queued = -1;
+#ifdef HAVE_IO_URING
+    if (fs.io.kind == IO_URING) {
+        queued = io_uring_queue(req);
+    }
+#endif
+    if (fs.io.kind == IO_THREADS) {
+        queued = io_pool_queue(req);
+    }
+    if (queued != 0) {
+        // The ring failed; do the request here instead
+        pthread_mutex_lock(&fs.io.lock);
+        batch->pending++;
+        io_complete(req, io_sync_request(req));
+        pthread_mutex_unlock(&fs.io.lock);
+    }
+    return 0;
+}
+
+// Instrumentation
+//
+// The functions every operation funnels through count their calls, the
+// blocks they handled and how long they took, so I/O amplification (how
+// many FAT blocks one write flushed, how many lookups a command made) can
+// be read off with 'stats reset', the command, then 'stats'. Bucket i of
+// a histogram counts calls that took less than 2^i ns and at least
+// 2^(i-1) ns; percentiles are reported as the bucket's upper bound.
+static void stat_record(int which, uint64_t start, uint64_t blocks) {
+    OpStat* stat = &fs.op_stats[which];
+    uint64_t ns = monotonic_ns() - start;
+    uint32_t bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    if (bucket >= STAT_BUCKETS) {
+        bucket = STAT_BUCKETS - 1;
+    }
+    
+    __atomic_fetch_add(&stat->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stat->blocks, blocks, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stat->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stat->buckets[bucket], 1, __ATOMIC_RELAXED);
+    uint64_t max_ns = __atomic_load_n(&stat->max_ns, __ATOMIC_RELAXED);
+    while (ns > max_ns &&
+           !__atomic_compare_exchange_n(&stat->max_ns, &max_ns, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Block cache
+//
+// All block I/O of a mounted partition goes through a fixed number of
+// cached blocks. Writes only mark the cached copy dirty; dirty blocks reach
+// the disk when they are evicted, or on cache_flush() at sync and unmount.
+// Replacement uses the CLOCK algorithm and skips pinned slots, which hold
+// metadata we want resident (the root directory). A capacity of 0 turns
+// the cache off and sends every request straight to the backend.
+int cache_init(uint32_t capacity) {
+    BlockCache* cache = &fs.cache;
+    memset(cache, 0, sizeof(BlockCache));
+    
+    if (capacity == 0) {
+        return 0;
+    }
+    if (capacity > MAX_CACHE_BLOCKS) {
+        return -1;
+    }
+    
+    uint32_t buckets = 1;
+    while (buckets < capacity * 2) {
+        buckets <<= 1;
+    }
+    
+    cache->slots = calloc(capacity, sizeof(CacheSlot));
+    cache->data = malloc((size_t)capacity * fs.block_size);
+    cache->buckets = malloc(buckets * sizeof(int32_t));
+    if (!cache->slots || !cache->data || !cache->buckets) {
+        cache_destroy();
+        return -1;
+    }
+    
+    for (uint32_t i = 0; i < capacity; i++) {
+        cache->slots[i].data = cache->data + (size_t)i * fs.block_size;
+        cache->slots[i].hash_next = -1;
+    }
+    for (uint32_t i = 0; i < buckets; i++) {
+        cache->buckets[i] = -1;
+    }
+    cache->capacity = capacity;
+    cache->bucket_mask = buckets - 1;
+    return 0;
+}
+
+void cache_destroy() {
+    free(fs.cache.slots);
+    free(fs.cache.data);
+    free(fs.cache.buckets);
+    memset(&fs.cache, 0, sizeof(BlockCache));
+}
+
+static uint32_t cache_hash(uint32_t block_num) {
+    return (block_num * 2654435761u) & fs.cache.bucket_mask;
+}
+
+static CacheSlot* cache_lookup(uint32_t block_num) {
+    if (fs.cache.capacity == 0) {
+        return NULL;
+    }
+    
+    int32_t index = fs.cache.buckets[cache_hash(block_num)];
+    while (index >= 0) {
+        CacheSlot* slot = &fs.cache.slots[index];
+        if (slot->block_num == block_num) {
+            return slot;
+        }
+        index = slot->hash_next;
+    }
+    return NULL;
+}
+
+static void cache_unlink(CacheSlot* slot) {
+    int32_t* link = &fs.cache.buckets[cache_hash(slot->block_num)];
+    int32_t index = (int32_t)(slot - fs.cache.slots);
+    
+    while (*link >= 0) {
+        if (*link == index) {
+            *link = slot->hash_next;
+            break;
+        }
+        link = &fs.cache.slots[*link].hash_next;
+    }
+    slot->hash_next = -1;
+    slot->valid = 0;
+}
+
+static void cache_write_done(void* ctx, int result) {
+    CacheSlot* slot = ctx;
+    if (result != 0) {
+        return;
+    }
+    slot->dirty = 0;
+    fs.cache.dirty_count--;
+    fs.cache.writebacks++;
+    fs.cache.writeback_seq++;
+}
+
+static int cache_write_back(CacheSlot* slot) {
+    int result = disk_write_block(slot->block_num, slot->data);
+    cache_write_done(slot, result);
+    return result;
+}
+
+// Picks a slot for 'block_num' using CLOCK, writing back a dirty victim.
+// Returns NULL if every slot is pinned or the victim cannot be written.
+static CacheSlot* cache_claim(uint32_t block_num) {
+    BlockCache* cache = &fs.cache;
+    if (cache->capacity == 0) {
+        return NULL;
+    }
+    
+    // Two sweeps clear every reference bit, so a third finds a victim if any
+    for (uint32_t scanned = 0; scanned < cache->capacity * 3; scanned++) {
+        CacheSlot* slot = &cache->slots[cache->clock_hand];
+        cache->clock_hand = (cache->clock_hand + 1) % cache->capacity;
+        
+        if (slot->pin_count > 0) {
+            continue;
+        }
+        if (slot->valid && slot->referenced) {
+            slot->referenced = 0;
+            continue;
+        }
+        
+        if (slot->valid) {
+            if (slot->dirty && cache_write_back(slot) != 0) {
+                return NULL;
+            }
+            cache_unlink(slot);
+            cache->evictions++;
+        }
+        
+        uint32_t bucket = cache_hash(block_num);
+        slot->block_num = block_num;
+        slot->hash_next = cache->buckets[bucket];
+        cache->buckets[bucket] = (int32_t)(slot - cache->slots);
+        slot->valid = 1;
+        slot->dirty = 0;
+        slot->referenced = 1;
+        return slot;
+    }
+    return NULL;
+}
+
+static int cache_flush_locked() {
+    int result = 0;
+    
+    if (fs.cache.dirty_count == 0) {
+        return 0;
+    }
+    
+    // Write dirty blocks in ascending block order so the disk file is
+    // updated front to back rather than in slot order
+    uint32_t* order = malloc(fs.cache.dirty_count * sizeof(uint32_t));
+    if (!order) {
+        return -1;
+    }
+    
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < fs.cache.capacity && count < fs.cache.dirty_count; i++) {
+        if (fs.cache.slots[i].valid && fs.cache.slots[i].dirty) {
+            order[count++] = i;
+        }
+    }
+    for (uint32_t i = 1; i < count; i++) {
+        uint32_t key = order[i];
+        uint32_t j = i;
+        while (j > 0 && fs.cache.slots[order[j - 1]].block_num > fs.cache.slots[key].block_num) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = key;
+    }
+    
+    // Submit them as one batch; each completion marks its slot clean
+    IoBatch batch;
+    if (io_batch_init(&batch, count) != 0) {
+        free(order);
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        CacheSlot* slot = &fs.cache.slots[order[i]];
+        io_batch_add(&batch, 1, slot->block_num, 1, slot->data, cache_write_done, slot);
+    }
+    if (io_batch_wait(&batch) != 0) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (fs.cache.slots[order[i]].dirty) {
+                printf("Error: Cannot write back block %u\n", fs.cache.slots[order[i]].block_num);
+            }
+        }
+        result = -1;
+    }
+    io_batch_destroy(&batch);
+    
+    free(order);
+    return result;
+}
+
+int cache_flush() {
+    pthread_mutex_lock(&fs.block_lock);
+    int result = cache_flush_locked();
+    pthread_mutex_unlock(&fs.block_lock);
+    return result;
+}
+
+static int cache_pin_locked(uint32_t block_num) {
+    CacheSlot* slot = cache_lookup(block_num);
+    if (!slot) {
+        slot = cache_claim(block_num);
+        if (!slot) {
+            return -1;
+        }
+        if (disk_read_block(block_num, slot->data) != 0) {
+            cache_unlink(slot);
+            return -1;
+        }
+        fs.cache.misses++;
+    }
+    slot->pin_count++;
+    return 0;
+}
+
+int cache_pin(uint32_t block_num) {
+    pthread_mutex_lock(&fs.block_lock);
+    int result = cache_pin_locked(block_num);
+    pthread_mutex_unlock(&fs.block_lock);
+    return result;
+}
+
+void cache_unpin(uint32_t block_num) {
+    pthread_mutex_lock(&fs.block_lock);
+    CacheSlot* slot = cache_lookup(block_num);
+    if (slot && slot->pin_count > 0) {
+        slot->pin_count--;
+    }
+    pthread_mutex_unlock(&fs.block_lock);
+}
+
+// Block operations used by the rest of the file system. The cache and the
+// journal transaction are shared, so they are only touched under
+// block_lock; with no cache the device is read without it.
+static int read_block_cached(uint32_t block_num, void* buffer) {
+    
+    CacheSlot* slot = cache_lookup(block_num);
+    if (slot) {
+        fs.cache.hits++;
+        slot->referenced = 1;
+        memcpy(buffer, slot->data, fs.block_size);
+        return 0;
+    }
+    
+    fs.cache.misses++;
+    slot = cache_claim(block_num);
+    if (!slot) {
+        return disk_read_block(block_num, buffer); // Cache unusable, go direct
+    }
+    if (disk_read_block(block_num, slot->data) != 0) {
+        cache_unlink(slot);
+        return -1;
+    }
+    memcpy(buffer, slot->data, fs.block_size);
+    return 0;
+}
+
+int read_block(uint32_t block_num, void* buffer) {
+    if (!fs.device.ops || block_num >= fs.boot_sector.total_blocks) {
+        return -1;
+    }
+    
+    uint64_t start = monotonic_ns();
+    int result = 0;
+    pthread_mutex_lock(&fs.block_lock);
+    
+    // Metadata logged in the open transaction is newer than any other copy
+    const uint8_t* logged = journal_find(block_num);
+    if (logged) {
+        memcpy(buffer, logged, fs.block_size);
+        pthread_mutex_unlock(&fs.block_lock);
+    } else if (fs.cache.capacity == 0) {
+        pthread_mutex_unlock(&fs.block_lock);
+        result = disk_read_block(block_num, buffer);
+    } else {
+        result = read_block_cached(block_num, buffer);
+        pthread_mutex_unlock(&fs.block_lock);
+    }
+    stat_record(STAT_READ_BLOCK, start, 1);
+    return result;
+}
+
+static int write_block_cached(uint32_t block_num, const void* buffer) {
+    
+    CacheSlot* slot = cache_lookup(block_num);
+    if (!slot) {
+        slot = cache_claim(block_num); // Whole-block write, nothing to read
+        if (!slot) {
+            return disk_write_block(block_num, buffer);
+        }
+    }
+    
+    memcpy(slot->data, buffer, fs.block_size);
+    slot->referenced = 1;
+    if (!slot->dirty) {
+        slot->dirty = 1;
+        fs.cache.dirty_count++;
+    }
+    return 0;
+}
+
+int write_block(uint32_t block_num, const void* buffer) {
+    if (!fs.device.ops || block_num >= fs.boot_sector.total_blocks) {
+        return -1;
+    }
+    
+    uint64_t start = monotonic_ns();
+    int result;
+    if (fs.cache.capacity == 0) {
+        result = disk_write_block(block_num, buffer);
+    } else {
+        pthread_mutex_lock(&fs.block_lock);
+        result = write_block_cached(block_num, buffer);
+        pthread_mutex_unlock(&fs.block_lock);
+    }
+    stat_record(STAT_WRITE_BLOCK, start, 1);
+    return result;
+}
+
+// Returns a read-only pointer to the block's current contents without
+// copying, or NULL if the caller has to fall back to read_block(). Only
+// possible when the backend maps the disk and no cache sits in front of it.
+const void* map_block(uint32_t block_num) {
+    return map_blocks(block_num, 1);
+}
+
+const void* map_blocks(uint32_t block_num, uint32_t count) {
+    if (!fs.device.ops || count == 0 || block_num + count > fs.boot_sector.total_blocks ||
+        fs.cache.capacity > 0) {
+        return NULL;
+    }
+    return fs.device.ops->map(&fs.device, block_num, count);
+}
+
+// Reads 'count' consecutive blocks with a single backend request. The
+// cache is not filled, so streaming a large file does not evict hot
+// metadata, but any block that is cached (possibly dirty) is newer than
+// the disk and is copied over the result. The device read runs without
+// the lock; if a write-back happened meanwhile the read may have missed
+// it, and is repeated under the lock.
+static uint64_t read_blocks_begin() {
+    pthread_mutex_lock(&fs.block_lock);
+    uint64_t seq = fs.cache.writeback_seq;
+    pthread_mutex_unlock(&fs.block_lock);
+    return seq;
+}
+
+// Finishes a run read started after read_blocks_begin() returned 'seq'
+static int read_blocks_end(uint32_t block_num, uint32_t count, void* buffer, uint64_t seq, int result) {
+    if (fs.cache.capacity == 0) {
+        return result;
+    }
+    
+    pthread_mutex_lock(&fs.block_lock);
+    if (result == 0 && seq != fs.cache.writeback_seq) {
+        result = fs.device.ops->read_run(&fs.device, block_num, count, buffer);
+    }
+    for (uint32_t i = 0; result == 0 && i < count; i++) {
+        CacheSlot* slot = cache_lookup(block_num + i);
+        if (slot) {
+            memcpy((uint8_t*)buffer + (size_t)i * fs.block_size, slot->data, fs.block_size);
+        }
+    }
+    pthread_mutex_unlock(&fs.block_lock);
+    return result;
+}
+
+int read_blocks(uint32_t block_num, uint32_t count, void* buffer) {
+    if (!fs.device.ops || count == 0 || block_num + count > fs.boot_sector.total_blocks) {
+        return -1;
+    }
+    
+    uint64_t seq = read_blocks_begin();
+    int result = fs.device.ops->read_run(&fs.device, block_num, count, buffer);
+    return read_blocks_end(block_num, count, buffer, seq, result);
+}
+
+// Writes 'count' consecutive blocks with a single backend request. Like
+// read_blocks() this goes around the cache; a block of the run that is
+// cached gets its copy replaced so the cache never serves stale data.
+int write_blocks(uint32_t block_num, uint32_t count, const void* buffer) {
+    if (!fs.device.ops || count == 0 || block_num + count > fs.boot_sector.total_blocks) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&fs.block_lock);
+    int result = fs.device.ops->write_run(&fs.device, block_num, count, buffer);
+    for (uint32_t i = 0; result == 0 && i < count; i++) {
+        CacheSlot* slot = cache_lookup(block_num + i);
+        if (slot) {
+            memcpy(slot->data, (const uint8_t*)buffer + (size_t)i * fs.block_size, fs.block_size);
+        }
+    }
+    fs.cache.writeback_seq++;
+    pthread_mutex_unlock(&fs.block_lock);
+    return result;
+}
+
+// Queues a read_blocks() on 'batch'. Once the batch has been waited for,
+// read_blocks_end() with the returned 'seq' completes it.
+int io_read_blocks(IoBatch* batch, uint32_t block_num, uint32_t count, void* buffer, uint64_t* seq) {
+    if (!fs.device.ops || count == 0 || block_num + count > fs.boot_sector.total_blocks) {
+        return -1;
+    }
+    *seq = read_blocks_begin();
+    return io_batch_add(batch, 0, block_num, count, buffer, NULL, NULL);
+}
+
+// Queues a write_blocks() on 'batch'. Cached copies are replaced at once,
+// so this suits blocks that nothing reads from the disk before the batch
+// completes: newly allocated data, or metadata still served by the cache
+// or the journal.
+int io_write_blocks(IoBatch* batch, uint32_t block_num, uint32_t count, const void* buffer) {
+    if (!fs.device.ops || count == 0 || block_num + count > fs.boot_sector.total_blocks) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&fs.block_lock);
+    for (uint32_t i = 0; i < count; i++) {
+        CacheSlot* slot = cache_lookup(block_num + i);
+        if (slot) {
+            memcpy(slot->data, (const uint8_t*)buffer + (size_t)i * fs.block_size, fs.block_size);
+        }
+    }
+    fs.cache.writeback_seq++;
+    pthread_mutex_unlock(&fs.block_lock);
+    return io_batch_add(batch, 1, block_num, count, (void*)buffer, NULL, NULL);
+}
+
+// Metadata journal
+//
+// FAT and directory blocks are never written in place directly. They are
+// logged in an in-memory transaction through journal_write(), and
+// read_block() serves logged blocks from it, so the rest of the file system
+// sees its own changes at once. A commit writes the header and every
+// logged image into the journal region with one request, syncs, and only
+// then writes the images to their home blocks (the checkpoint). Dirty
+// data blocks are flushed before the log is written, so a committed
+// directory entry never points at data that is not on disk. Many
+// operations share one commit (group commit): journal_tick() commits once
+// the transaction is old enough or half full, and sync commits whatever is
+// pending. After a crash, mount_partition() replays a committed but
+// possibly unfinished checkpoint; a transaction whose log write was torn
+// fails its checksum and is dropped, leaving the previous state intact.
+static uint32_t journal_checksum(const uint8_t* data, size_t length, uint32_t hash) {
+    for (size_t i = 0; i < length; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t journal_header_checksum(const JournalHeader* header, const uint8_t* images) {
+    uint32_t hash = journal_checksum((const uint8_t*)&header->sequence, sizeof(uint32_t), 2166136261u);
+    hash = journal_checksum((const uint8_t*)header->blocks, header->count * sizeof(uint32_t), hash);
+    return journal_checksum(images, (size_t)header->count * fs.block_size, hash);
+}
+
+static int journal_write_header(uint32_t sequence, uint32_t count) {
+    uint8_t block[fs.block_size];
+    memset(block, 0, fs.block_size);
+    JournalHeader* header = (JournalHeader*)block;
+    header->magic = JOURNAL_MAGIC;
+    header->sequence = sequence;
+    header->count = count;
+    header->checksum = journal_header_checksum(header, NULL);
+    return disk_write_block(fs.journal.start, block);
+}
+
+// Sets up the in-memory transaction for a mounted volume. Volumes
+// formatted without a journal region run unjournaled.
+int journal_init(uint32_t commit_interval) {
+    memset(&fs.journal, 0, sizeof(Journal));
+    fs.journal.commit_interval = commit_interval;
+    if (fs.boot_sector.journal_start == 0 || fs.boot_sector.journal_blocks < 2) {
+        return 0;
+    }
+    
+    fs.journal.capacity = fs.boot_sector.journal_blocks - 1;
+    if (fs.journal.capacity > JOURNAL_MAX_BLOCKS(fs.block_size)) {
+        fs.journal.capacity = JOURNAL_MAX_BLOCKS(fs.block_size);
+    }
+    fs.journal.log = malloc((size_t)(fs.journal.capacity + 1) * fs.block_size);
+    fs.journal.logged = calloc((fs.boot_sector.total_blocks + 63) / 64, sizeof(uint64_t));
+    if (!fs.journal.log || !fs.journal.logged) {
+        journal_destroy();
+        return -1;
+    }
+    fs.journal.start = fs.boot_sector.journal_start;
+    return 0;
+}
+
+void journal_destroy() {
+    free(fs.journal.log);
+    free(fs.journal.logged);
+    memset(&fs.journal, 0, sizeof(Journal));
+}
+
+// Applies a committed transaction left in the journal by a crash. Runs
+// before the FAT is loaded so the FAT read afterwards is the replayed one.
+int journal_replay() {
+    if (!fs.journal.start) {
+        return 0;
+    }
+    
+    uint8_t* log = fs.journal.log;
+    JournalHeader* header = (JournalHeader*)log;
+    if (disk_read_block(fs.journal.start, log) != 0) {
+        printf("Error: Cannot read journal\n");
+        return -1;
+    }
+    if (header->magic != JOURNAL_MAGIC) {
+        return 0;
+    }
+    fs.journal.sequence = header->sequence;
+    if (header->count == 0) {
+        return 0;
+    }
+    
+    if (header->count > fs.journal.capacity ||
+        fs.device.ops->read_run(&fs.device, fs.journal.start + 1, header->count, log + fs.block_size) != 0 ||
+        journal_header_checksum(header, log + fs.block_size) != header->checksum) {
+        printf("Journal: discarding incomplete transaction %u\n", header->sequence);
+        return journal_write_header(header->sequence, 0);
+    }
+    
+    uint32_t count = header->count;
+    for (uint32_t i = 0; i < count; i++) {
+        if (header->blocks[i] >= fs.boot_sector.total_blocks ||
+            disk_write_block(header->blocks[i], log + (size_t)(i + 1) * fs.block_size) != 0) {
+            printf("Error: Cannot replay journal block %u\n", header->blocks[i]);
+            return -1;
+        }
+    }
+    if (fs.device.ops->sync(&fs.device) != 0 || journal_write_header(header->sequence, 0) != 0) {
+        return -1;
+    }
+    
+    printf("Journal: replayed transaction %u (%u blocks)\n", fs.journal.sequence, count);
+    return 0;
+}
+
+// Returns the logged image of 'block_num' in the open transaction, or NULL
+const uint8_t* journal_find(uint32_t block_num) {
+    if (fs.journal.count == 0 || !(fs.journal.logged[block_num / 64] & (1ULL << (block_num % 64)))) {
+        return NULL;
+    }
+    
+    JournalHeader* header = (JournalHeader*)fs.journal.log;
+    for (uint32_t i = 0; i < fs.journal.count; i++) {
+        if (header->blocks[i] == block_num) {
+            return fs.journal.log + (size_t)(i + 1) * fs.block_size;
+        }
+    }
+    return NULL;
+}
+
+// Writes a metadata block. With a journal it is logged in the open
+// transaction (replacing an earlier image of the same block), committing
+// first if the transaction is full.
+static int journal_write_locked(uint32_t block_num, const void* buffer) {
+    
+    uint8_t* image = (uint8_t*)journal_find(block_num);
+    if (!image) {
+        if (fs.journal.count == fs.journal.capacity && journal_commit() != 0) {
+            return -1;
+        }
+        if (fs.journal.count == 0) {
+            fs.journal.opened = time(NULL);
+        }
+    
+        JournalHeader* header = (JournalHeader*)fs.journal.log;
+        header->blocks[fs.journal.count] = block_num;
+        image = fs.journal.log + (size_t)(++fs.journal.count) * fs.block_size;
+        fs.journal.logged[block_num / 64] |= 1ULL << (block_num % 64);
+    }
+    memcpy(image, buffer, fs.block_size);
+    fs.journal.logged_blocks++;
+    return 0;
+}
+
+int journal_write(uint32_t block_num, const void* buffer) {
+    if (!fs.journal.start) {
+        return write_block(block_num, buffer);
+    }
+    if (block_num >= fs.boot_sector.total_blocks) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&fs.block_lock);
+    int result = journal_write_locked(block_num, buffer);
+    pthread_mutex_unlock(&fs.block_lock);
+    return result;
+}
+
+// Drops the image of a block that has just been freed from the open
+// transaction. Otherwise read_block() would keep serving it to the block's
+// next owner and the checkpoint would write it over the new contents. The
+// last image takes its slot.
+void journal_revoke(uint32_t block_num) {
+    if (!fs.journal.start) {
+        return;
+    }
+    
+    pthread_mutex_lock(&fs.block_lock);
+    uint8_t* image = (uint8_t*)journal_find(block_num);
+    if (image) {
+        JournalHeader* header = (JournalHeader*)fs.journal.log;
+        uint32_t slot = (uint32_t)((image - fs.journal.log) / fs.block_size) - 1;
+        uint32_t last = --fs.journal.count;
+        if (slot != last) {
+            header->blocks[slot] = header->blocks[last];
+            memcpy(image, fs.journal.log + (size_t)(last + 1) * fs.block_size, fs.block_size);
+        }
+        fs.journal.logged[block_num / 64] &= ~(1ULL << (block_num % 64));
+    }
+    pthread_mutex_unlock(&fs.block_lock);
+}
+
+// First half of a commit: makes the transaction durable in the journal.
+// Data blocks are flushed first, which also makes the previous checkpoint
+// durable before its log record is overwritten.
+int journal_write_log() {
+    if (cache_flush() != 0 || fs.device.ops->sync(&fs.device) != 0) {
+        return -1;
+    }
+    
+    JournalHeader* header = (JournalHeader*)fs.journal.log;
+    header->magic = JOURNAL_MAGIC;
+    header->sequence = fs.journal.sequence + 1;
+    header->count = fs.journal.count;
+    header->checksum = journal_header_checksum(header, fs.journal.log + fs.block_size);
+    
+    if (fs.device.ops->write_run(&fs.device, fs.journal.start, fs.journal.count + 1, fs.journal.log) != 0 ||
+        fs.device.ops->sync(&fs.device) != 0) {
+        printf("Error: Cannot write journal\n");
+        return -1;
+    }
+    fs.journal.sequence = header->sequence;
+    fs.journal.dirty = 1;
+    return 0;
+}
+
+// Second half: writes the committed images to their home blocks and
+// empties the transaction
+int journal_checkpoint() {
+    JournalHeader* header = (JournalHeader*)fs.journal.log;
+    IoBatch batch;
+    if (io_batch_init(&batch, fs.journal.count) != 0) {
+        return -1;
+    }
+    
+    int result = 0;
+    for (uint32_t i = 0; i < fs.journal.count && result == 0; i++) {
+        result = io_write_blocks(&batch, header->blocks[i], 1, fs.journal.log + (size_t)(i + 1) * fs.block_size);
+    }
+    if (io_batch_wait(&batch) != 0) {
+        result = -1;
+    }
+    io_batch_destroy(&batch);
+    if (result != 0) {
+        printf("Error: Cannot write journal checkpoint\n");
+        return -1;
+    }
+    
+    for (uint32_t i = 0; i < fs.journal.count; i++) {
+        uint32_t block_num = header->blocks[i];
+        fs.journal.logged[block_num / 64] &= ~(1ULL << (block_num % 64));
+    }
+    fs.journal.count = 0;
+    fs.journal.commits++;
+    return 0;
+}
+
+int journal_commit() {
+    if (!fs.journal.start) {
+        return 0;
+    }
+    
+    pthread_mutex_lock(&fs.block_lock);
+    int result = 0;
+    if (fs.journal.count > 0) {
+        result = journal_write_log();
+        if (result == 0) {
+            result = journal_checkpoint();
+        }
+    }
+    pthread_mutex_unlock(&fs.block_lock);
+    return result;
+}
+
+// Group commit policy, called between operations. Holding the volume lock
+// exclusively keeps any operation from straddling the commit.
+int journal_tick() {
+    if (!fs.journal.start || fs.journal.count == 0) {
+        return 0;
+    }
+    
+    pthread_rwlock_wrlock(&fs.volume_lock);
+    int result = 0;
+    if (fs.journal.count > 0 &&
+        (fs.journal.commit_interval == 0 || fs.journal.count >= fs.journal.capacity / 2 ||
+         time(NULL) - fs.journal.opened >= (time_t)fs.journal.commit_interval)) {
+        fat_flush();
+        result = journal_commit();
+    }
+    pthread_rwlock_unlock(&fs.volume_lock);
+    return result;
+}
+
+// Commits whatever is pending regardless of the policy, e.g. at the end of
+// a batch of commands
+int journal_flush() {
+    if (!fs.device.ops) {
+        return 0;
+    }
+    
+    pthread_rwlock_wrlock(&fs.volume_lock);
+    int result = fat_flush();
+    if (journal_commit() != 0) {
+        result = -1;
+    }
+    pthread_rwlock_unlock(&fs.volume_lock);
+    return result;
+}
+
+// After a sync the journal no longer needs replaying; marking it clean
+// keeps the next mount from redoing the last checkpoint
+static int journal_mark_clean() {
+    if (!fs.journal.start || !fs.journal.dirty) {
+        return 0;
+    }
+    if (fs.device.ops->sync(&fs.device) != 0 || journal_write_header(fs.journal.sequence, 0) != 0) {
+        return -1;
+    }
+    fs.journal.dirty = 0;
+    return 0;
+}
+
+// FAT table operations
+//
+// The FAT is paged in on demand: the first access to an entry turns its
+// FAT block into a page of in-memory entries, read through the block
+// cache so an image logged in the open transaction is seen. Pages stay
+// resident until unmount; mounting reads none. Every update goes through fat_set(),
+// which marks the FAT block holding the entry as dirty; fat_flush() writes
+// only those blocks back (into the journal when there is one). High-level operations flush once when they finish,
+// instead of rewriting the whole table on every allocation.
+//
+// On disk an entry is fs.fat_bits wide: FAT16 volumes (up to 65536 blocks)
+// keep the markers in 16 bits, in the FAT and in the first_block of
+// directory records alike. In memory entries and block numbers are always
+// 32-bit, so nothing above this layer depends on the width.
+static uint32_t fat_from_disk(uint32_t value) {
+    return fs.fat_bits == 16 && value >= FAT16_ENTRY_BAD ? value | 0xFFFF0000u : value;
+}
+
+static uint32_t fat_to_disk(uint32_t value) {
+    return fs.fat_bits == 16 ? value & 0xFFFF : value;
+}
+
+// Packs loaded FAT page 'index' into its on-disk form
+static void fat_encode_block(uint32_t index, uint8_t* block) {
+    const uint32_t* entries = fs.fat_pages[index];
+    for (uint32_t j = 0; j < fs.fat_entries_per_block; j++) {
+        uint32_t value = fat_to_disk(__atomic_load_n(&entries[j], __ATOMIC_RELAXED));
+        if (fs.fat_bits == 16) {
+            ((uint16_t*)block)[j] = (uint16_t)value;
+        } else {
+            ((uint32_t*)block)[j] = value;
+        }
+    }
+}
+
+static void fat_decode_block(uint32_t* entries, const uint8_t* block) {
+    for (uint32_t j = 0; j < fs.fat_entries_per_block; j++) {
+        entries[j] = fat_from_disk(fs.fat_bits == 16 ? ((const uint16_t*)block)[j] : ((const uint32_t*)block)[j]);
+    }
+}
+
+// Loads FAT page 'index' if no other thread has yet. Returns NULL if it
+// cannot be read.
+static uint32_t* fat_page_load(uint32_t index) {
+    pthread_mutex_lock(&fs.fat_lock);
+    uint32_t* page = fs.fat_pages[index];
+    if (!page) {
+        uint8_t block[fs.block_size];
+        page = malloc(fs.fat_entries_per_block * sizeof(uint32_t));
+        if (page && read_block(1 + index, block) == 0) {
+            fat_decode_block(page, block);
+            __atomic_store_n(&fs.fat_pages[index], page, __ATOMIC_RELEASE);
+            __atomic_fetch_add(&fs.fat_pages_loaded, 1, __ATOMIC_RELAXED);
+        } else {
+            printf("Error: Cannot read FAT block %u\n", index);
+            free(page);
+            page = NULL;
+        }
+    }
+    pthread_mutex_unlock(&fs.fat_lock);
+    return page;
+}
+
+static uint32_t* fat_page(uint32_t block) {
+    uint32_t index = block / fs.fat_entries_per_block;
+    uint32_t* page = __atomic_load_n(&fs.fat_pages[index], __ATOMIC_ACQUIRE);
+    return page ? page : fat_page_load(index);
+}
+
+// Entries are read and written without a lock, which suits chain walks of
+// a file the caller has locked: no other thread changes that file's
+// entries, and atomic accesses keep other entries' updates from tearing.
+// An entry whose page cannot be read reads as BAD, which ends any chain.
+uint32_t fat_get(uint32_t block) {
+    uint32_t* page = fat_page(block);
+    return page ? __atomic_load_n(&page[block % fs.fat_entries_per_block], __ATOMIC_RELAXED) : FAT_ENTRY_BAD;
+}
+
+// Marks the FAT block holding 'block' for the next fat_flush()
+static void fat_mark_dirty(uint32_t block) {
+    uint32_t fat_block = block / fs.fat_entries_per_block;
+    uint8_t mask = 1 << (fat_block % 8);
+    if (!(__atomic_fetch_or(&fs.fat_dirty[fat_block / 8], mask, __ATOMIC_RELAXED) & mask)) {
+        __atomic_fetch_add(&fs.fat_dirty_count, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void fat_set(uint32_t block, uint32_t value) {
+    uint32_t* page = fat_page(block);
+    if (!page) {
+        return;
+    }
+    uint32_t* entry = &page[block % fs.fat_entries_per_block];
+    
+    // A group that has not been scanned yet has no free map bits to keep in
+    // step; its lock keeps a scan from missing this update
+    AllocGroup* group = block < fs.free_map_limit ? &fs.groups[block / ALLOC_GROUP_BLOCKS] : NULL;
+    if (group && !__atomic_load_n(&group->scanned, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&group->lock);
+        if (!group->scanned) {
+            uint32_t old_value = __atomic_exchange_n(entry, value, __ATOMIC_RELAXED);
+            if ((value == FAT_ENTRY_FREE) != (old_value == FAT_ENTRY_FREE)) {
+                __atomic_fetch_add(&fs.free_count, value == FAT_ENTRY_FREE ? 1 : -1, __ATOMIC_RELAXED);
+            }
+            pthread_mutex_unlock(&group->lock);
+            if (old_value != value) {
+                fat_mark_dirty(block);
+            }
+            return;
+        }
+        pthread_mutex_unlock(&group->lock);
+    }
+    
+    uint32_t old_value = __atomic_exchange_n(entry, value, __ATOMIC_RELAXED);
+    if (old_value == value) {
+        return;
+    }
+    
+    // Keep the free-space bitmap and counts in step with the FAT
+    if (group && (value == FAT_ENTRY_FREE) != (old_value == FAT_ENTRY_FREE)) {
+        uint64_t bit = 1ULL << (block % 64);
+        if (value == FAT_ENTRY_FREE) {
+            __atomic_fetch_or(&fs.free_map[block / 64], bit, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&group->free_count, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&fs.free_count, 1, __ATOMIC_RELAXED);
+        } else {
+            __atomic_fetch_and(&fs.free_map[block / 64], ~bit, __ATOMIC_RELAXED);
+            __atomic_fetch_sub(&group->free_count, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_sub(&fs.free_count, 1, __ATOMIC_RELAXED);
+        }
+    }
+    fat_mark_dirty(block);
+}
+
+// A FAT block's dirty bit is cleared before its entries are copied, so an
+// update racing with the flush marks it dirty again for the next one
+int fat_flush() {
+    int result = 0;
+    uint8_t entries[fs.block_size];
+    uint64_t flushed = 0;
+    
+    uint64_t start = monotonic_ns();
+    pthread_mutex_lock(&fs.fat_lock);
+    for (uint32_t i = 0; i < fs.boot_sector.fat_blocks && __atomic_load_n(&fs.fat_dirty_count, __ATOMIC_RELAXED) > 0; i++) {
+        uint8_t mask = 1 << (i % 8);
+        if (!(__atomic_fetch_and(&fs.fat_dirty[i / 8], (uint8_t)~mask, __ATOMIC_RELAXED) & mask)) {
+            continue;
+        }
+        __atomic_fetch_sub(&fs.fat_dirty_count, 1, __ATOMIC_RELAXED);
+    
+        fat_encode_block(i, entries);
+        flushed++;
+        if (journal_write(1 + i, entries) != 0) {
+            printf("Error: Cannot write FAT block %u\n", i);
+            result = -1;
+            // Leave it dirty so the next flush retries
+            if (!(__atomic_fetch_or(&fs.fat_dirty[i / 8], mask, __ATOMIC_RELAXED) & mask)) {
+                __atomic_fetch_add(&fs.fat_dirty_count, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    if (share_flush() != 0) {
+        result = -1;
+    }
+    pthread_mutex_unlock(&fs.fat_lock);
+    stat_record(STAT_FAT_FLUSH, start, flushed);
+    return result;
+}
+
+// Block sharing
+//
+// Snapshots let chains share blocks. A FAT entry has a single successor,
+// so what two chains share is always a tail: once they reach the same
+// block they go on together to the end. The share table keeps one byte
+// per block, the number of owners it has beyond the first, where an owner
+// is a directory record or FAT entry leading into the block. It exists
+// only while the volume has snapshots, as the file /.snapshots/.refcounts,
+// which is read whole at mount and written back with the FAT, in the
+// same transaction.
+//
+// free_blocks() stops at a shared block after dropping one owner, as the
+// rest of the chain is still in use. A block is only written in place,
+// or its FAT entry relinked, by a file that owns the whole chain up to
+// it; handle_unshare() copies the part it does not own first.
+static uint32_t share_count(uint32_t block) {
+    if (!fs.shares || block >= fs.boot_sector.total_blocks) {
+        return 0;
+    }
+    return __atomic_load_n(&fs.shares[block], __ATOMIC_ACQUIRE);
+}
+
+static void share_mark_dirty(uint32_t block) {
+    uint32_t index = block / fs.block_size;
+    uint8_t mask = 1 << (index % 8);
+    if (!(__atomic_fetch_or(&fs.share_dirty[index / 8], mask, __ATOMIC_RELAXED) & mask)) {
+        __atomic_fetch_add(&fs.share_dirty_count, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void share_add(uint32_t block) {
+    __atomic_fetch_add(&fs.shares[block], 1, __ATOMIC_ACQ_REL);
+    share_mark_dirty(block);
+}
+
+// Drops one owner of 'block' if it has others. Returns 0 when the caller
+// was its only owner.
+static int share_drop(uint32_t block) {
+    if (!fs.shares || block >= fs.boot_sector.total_blocks) {
+        return 0;
+    }
+    uint8_t current = __atomic_load_n(&fs.shares[block], __ATOMIC_ACQUIRE);
+    do {
+        if (current == 0) {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&fs.shares[block], &current, current - 1, 0,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    share_mark_dirty(block);
+    return 1;
+}
+
+static void share_set(uint32_t block, uint32_t count) {
+    if (__atomic_exchange_n(&fs.shares[block], (uint8_t)count, __ATOMIC_ACQ_REL) != count) {
+        share_mark_dirty(block);
+    }
+}
+
+// Writes the table blocks changed since the last flush, from fat_flush()
+int share_flush() {
+    int result = 0;
+    uint8_t block[fs.block_size];
+    for (uint32_t i = 0; i < fs.share_table_blocks && __atomic_load_n(&fs.share_dirty_count, __ATOMIC_RELAXED) > 0; i++) {
+        uint8_t mask = 1 << (i % 8);
+        if (!(__atomic_fetch_and(&fs.share_dirty[i / 8], (uint8_t)~mask, __ATOMIC_RELAXED) & mask)) {
+            continue;
+        }
+        __atomic_fetch_sub(&fs.share_dirty_count, 1, __ATOMIC_RELAXED);
+    
+        const uint8_t* counts = fs.shares + (size_t)i * fs.block_size;
+        for (uint32_t j = 0; j < fs.block_size; j++) {
+            block[j] = __atomic_load_n(&counts[j], __ATOMIC_RELAXED);
+        }
+        if (journal_write(fs.share_chain[i], block) != 0) {
+            printf("Error: Cannot write share table block %u\n", i);
+            result = -1;
+            if (!(__atomic_fetch_or(&fs.share_dirty[i / 8], mask, __ATOMIC_RELAXED) & mask)) {
+                __atomic_fetch_add(&fs.share_dirty_count, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    return result;
+}
+
+static void share_table_unload() {
+    free(fs.shares);
+    free(fs.share_chain);
+    free(fs.share_dirty);
+    fs.shares = NULL;
+    fs.share_chain = NULL;
+    fs.share_dirty = NULL;
+    fs.share_table_blocks = 0;
+    fs.share_dirty_count = 0;
+}
+
+// Reads the table from the chain starting at 'first_block'
+static int share_table_load(uint32_t first_block) {
+    uint32_t blocks = (fs.boot_sector.total_blocks + fs.block_size - 1) / fs.block_size;
+    fs.shares = calloc(blocks, fs.block_size);
+    fs.share_chain = malloc(blocks * sizeof(uint32_t));
+    fs.share_dirty = calloc((blocks + 7) / 8, 1);
+    if (!fs.shares || !fs.share_chain || !fs.share_dirty) {
+        printf("Error: Cannot allocate memory for the share table\n");
+        share_table_unload();
+        return -1;
+    }
+    
+    uint32_t block = first_block;
+    for (uint32_t i = 0; i < blocks; i++, block = fat_get(block)) {
+        if (block >= FAT_ENTRY_BAD || read_block(block, fs.shares + (size_t)i * fs.block_size) != 0) {
+            printf("Error: Cannot read the share table\n");
+            share_table_unload();
+            return -1;
+        }
+        fs.share_chain[i] = block;
+    }
+    fs.share_table_blocks = blocks;
+    return 0;
+}
+
+// Finds /.snapshots at mount and loads the share table kept in it. A
+// volume that never had snapshots has neither.
+static int share_table_mount() {
+    DirEntryLoc loc;
+    DirectoryEntry entry;
+    fs.snapshot_dir = 0;
+    if (find_file_in_directory(fs.boot_sector.root_dir_block, SNAPSHOT_DIR_NAME, &loc) != 0) {
+        return 0;
+    }
+    if (dir_read_entry(&loc, &entry) != 0) {
+        return -1;
+    }
+    if (entry.type != TYPE_DIRECTORY || !(entry.attributes & ATTR_SNAPSHOTS)) {
+        return 0;
+    }
+    
+    fs.snapshot_dir = entry.first_block;
+    if (find_file_in_directory(fs.snapshot_dir, SHARE_TABLE_NAME, &loc) != 0 || dir_read_entry(&loc, &entry) != 0) {
+        printf("Error: The share table of the snapshots is missing\n");
+        return -1;
+    }
+    return share_table_load(entry.first_block);
+}
+
+// Free-space index
+//
+// free_map mirrors the FAT with one bit per block so the allocator can skip
+// 64 used blocks per word instead of testing FAT entries one at a time.
+// On a FAT16 volume block numbers from FAT16_ENTRY_BAD upwards collide
+// with the FAT markers and can never appear in a chain, so they are left
+// out of the map.
+//
+// The data area is split into allocation groups of ALLOC_GROUP_BLOCKS
+// blocks, each with its own free count, scan hint and lock. Allocation
+// holds only the lock of the group it is searching, so writers working in
+// different groups never wait for each other. Freeing takes no lock: it
+// sets bits atomically, which can only add space under a running search.
+//
+// A group's bits are built from the FAT the first time an allocation
+// looks at it. When the volume was unmounted cleanly the boot sector
+// still holds the free count, so mounting scans nothing; otherwise every
+// group is scanned at mount to count the free blocks.
+// Builds a group's free map bits and count from the FAT if that has not
+// happened yet. The caller holds the group's lock.
+static void group_scan(AllocGroup* group) {
+    if (group->scanned) {
+        return;
+    }
+    for (uint32_t i = group->start; i < group->end; i++) {
+        if (fat_get(i) == FAT_ENTRY_FREE) {
+            __atomic_fetch_or(&fs.free_map[i / 64], 1ULL << (i % 64), __ATOMIC_RELAXED);
+            group->free_count++;
+        }
+    }
+    __atomic_store_n(&group->scanned, 1, __ATOMIC_RELEASE);
+}
+
+int build_free_map(int scan) {
+    fs.free_map_limit = fs.boot_sector.total_blocks;
+    if (fs.fat_bits == 16 && fs.free_map_limit > FAT16_ENTRY_BAD) {
+        fs.free_map_limit = FAT16_ENTRY_BAD;
+    }
+    
+    free_map_destroy();
+    fs.group_count = (fs.free_map_limit + ALLOC_GROUP_BLOCKS - 1) / ALLOC_GROUP_BLOCKS;
+    fs.free_map = calloc((fs.free_map_limit + 63) / 64, sizeof(uint64_t));
+    fs.groups = calloc(fs.group_count, sizeof(AllocGroup));
+    if (!fs.free_map || !fs.groups) {
+        free_map_destroy();
+        return -1;
+    }
+    
+    for (uint32_t g = 0; g < fs.group_count; g++) {
+        AllocGroup* group = &fs.groups[g];
+        pthread_mutex_init(&group->lock, NULL);
+        group->start = g * ALLOC_GROUP_BLOCKS;
+        if (group->start < fs.boot_sector.data_start_block) {
+            group->start = fs.boot_sector.data_start_block;
+        }
+        group->end = (g + 1) * ALLOC_GROUP_BLOCKS;
+        if (group->end > fs.free_map_limit) {
+            group->end = fs.free_map_limit;
+        }
+        if (group->start > group->end) {
+            group->start = group->end;
+        }
+        group->next_free_hint = group->start;
+        if (scan) {
+            group_scan(group);
+            fs.free_count += group->free_count;
+        }
+    }
+    return 0;
+}
+
+// Groups scanned so far, for stats
+static uint32_t groups_scanned() {
+    uint32_t scanned = 0;
+    for (uint32_t g = 0; g < fs.group_count; g++) {
+        scanned += __atomic_load_n(&fs.groups[g].scanned, __ATOMIC_ACQUIRE);
+    }
+    return scanned;
+}
+
+void free_map_destroy() {
+    for (uint32_t g = 0; fs.groups && g < fs.group_count; g++) {
+        pthread_mutex_destroy(&fs.groups[g].lock);
+    }
+    free(fs.groups);
+    free(fs.free_map);
+    fs.groups = NULL;
+    fs.free_map = NULL;
+    fs.group_count = 0;
+    fs.free_count = 0;
+    fs.next_free = 0;
+    fs.base_group = 0;
+}
+
+// Returns the first free block in [from, to), or 'to'
+static uint32_t next_free_from(uint32_t from, uint32_t to) {
+    while (from < to) {
+        uint64_t word = __atomic_load_n(&fs.free_map[from / 64], __ATOMIC_RELAXED) & (~0ULL << (from % 64));
+        if (word) {
+            uint32_t block = (from & ~63u) + __builtin_ctzll(word);
+            return block < to ? block : to;
+        }
+        from = (from & ~63u) + 64;
+    }
+    return to;
+}
+
+// Returns the first used block in [from, to), or 'to'
+static uint32_t next_used_from(uint32_t from, uint32_t to) {
+    while (from < to) {
+        uint64_t word = ~__atomic_load_n(&fs.free_map[from / 64], __ATOMIC_RELAXED) & (~0ULL << (from % 64));
+        if (word) {
+            uint32_t block = (from & ~63u) + __builtin_ctzll(word);
+            return block < to ? block : to;
+        }
+        from = (from & ~63u) + 64;
+    }
+    return to;
+}
+
+// Finds a run of free blocks in a group, searching from its hint and
+// wrapping around once. Returns 'count' with the start of the first run
+// that is long enough, otherwise the length of the longest run found.
+// Returns 0 when the group is full. The caller holds the group's lock.
+static uint32_t find_free_run(AllocGroup* group, uint32_t count, uint32_t* start) {
+    uint32_t best_start = 0;
+    uint32_t best_length = 0;
+    
+    if (__atomic_load_n(&group->free_count, __ATOMIC_RELAXED) == 0 || count == 0) {
+        return 0;
+    }
+    
+    uint32_t hint = group->next_free_hint;
+    if (hint < group->start || hint >= group->end) {
+        hint = group->start;
+    }
+    
+    // Pass 0 scans [hint, end), pass 1 scans [start, hint)
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t from = pass == 0 ? hint : group->start;
+        uint32_t to = pass == 0 ? group->end : hint;
+        
+        while (from < to) {
+            uint32_t run_start = next_free_from(from, to);
+            if (run_start >= to) {
+                break;
+            }
+            uint32_t run_end = next_used_from(run_start, to);
+            
+            uint32_t length = run_end - run_start;
+            if (length >= count) {
+                *start = run_start;
+                return count;
+            }
+            if (length > best_length) {
+                best_start = run_start;
+                best_length = length;
+            }
+            from = run_end;
+        }
+    }
+    
+    *start = best_start;
+    return best_length;
+}
+
+// Takes up to 'count' blocks from a group, linking each run after *last
+// (FAT_ENTRY_EOF before the first run, which is stored in *first). With
+// 'whole' set nothing is taken unless one run holds all of them. Returns
+// the number of blocks taken. The caller holds the group's lock.
+static uint32_t group_allocate(AllocGroup* group, uint32_t count, int whole, uint32_t* first, uint32_t* last) {
+    uint32_t taken = 0;
+    
+    while (taken < count) {
+        uint32_t start;
+        uint32_t length = find_free_run(group, count - taken, &start);
+        if (length == 0 || (whole && length < count)) {
+            break;
+        }
+    
+        if (*last == FAT_ENTRY_EOF) {
+            *first = start;
+        } else {
+            fat_set(*last, start);
+        }
+        for (uint32_t i = 0; i + 1 < length; i++) {
+            fat_set(start + i, start + i + 1);
+        }
+        *last = start + length - 1;
+        fat_set(*last, FAT_ENTRY_EOF);
+    
+        taken += length;
+        group->next_free_hint = start + length;
+    }
+    return taken;
+}
+
+// Group an allocation should start in. A goal block keeps new blocks next
+// to related ones: the end of the file being extended, or the directory a
+// new file lives in. Without one the calling thread's home group is used;
+// threads get different home groups, handed out round robin on first use
+// starting where the last session left off allocating.
+static uint32_t alloc_home_group(uint32_t goal) {
+    static __thread uint32_t home_group = UINT32_MAX;
+    static uint32_t next_home_group;
+    
+    if (goal >= fs.boot_sector.data_start_block && goal < fs.free_map_limit) {
+        return goal / ALLOC_GROUP_BLOCKS;
+    }
+    if (home_group == UINT32_MAX) {
+        home_group = __atomic_fetch_add(&next_home_group, 1, __ATOMIC_RELAXED);
+    }
+    return (fs.base_group + home_group) % fs.group_count;
+}
+
+uint32_t allocate_block(uint32_t goal) {
+    uint32_t block;
+    if (allocate_extent(1, goal, &block) != 0) {
+        return FAT_ENTRY_FREE; // No free blocks
+    }
+    return block;
+}
+
+// Allocates 'count' blocks as one pre-linked FAT chain terminated by EOF.
+// Groups are tried starting with the home group for 'goal' (see
+// alloc_home_group()), first for one that holds the whole chain in a
+// single run, then taking the longest runs each group has, so a full home
+// group spills into its neighbours. Nothing is allocated if the disk
+// cannot hold all of it.
+int allocate_extent(uint32_t count, uint32_t goal, uint32_t* first) {
+    if (count == 0 || count > __atomic_load_n(&fs.free_count, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+    
+    uint64_t start = monotonic_ns();
+    uint32_t home = alloc_home_group(goal);
+    uint32_t remaining = count;
+    uint32_t last = FAT_ENTRY_EOF;
+    *first = FAT_ENTRY_EOF;
+    
+    for (int pass = 0; pass < 2 && remaining > 0; pass++) {
+        for (uint32_t i = 0; i < fs.group_count && remaining > 0; i++) {
+            AllocGroup* group = &fs.groups[(home + i) % fs.group_count];
+            if (!__atomic_load_n(&group->scanned, __ATOMIC_ACQUIRE)) {
+                pthread_mutex_lock(&group->lock);
+                group_scan(group);
+                pthread_mutex_unlock(&group->lock);
+            }
+            if (__atomic_load_n(&group->free_count, __ATOMIC_RELAXED) < (pass == 0 ? remaining : 1)) {
+                continue;
+            }
+            pthread_mutex_lock(&group->lock);
+            remaining -= group_allocate(group, remaining, pass == 0, first, &last);
+            pthread_mutex_unlock(&group->lock);
+        }
+    }
+    
+    if (remaining > 0) {
+        // Other writers took the space free_count promised; undo rather than leak
+        if (*first != FAT_ENTRY_EOF) {
+            free_blocks(*first);
+        }
+        stat_record(STAT_ALLOCATE, start, 0);
+        return -1;
+    }
+    __atomic_store_n(&fs.next_free, last + 1, __ATOMIC_RELAXED);
+    stat_record(STAT_ALLOCATE, start, count);
+    return 0;
+}
+
+void free_blocks(uint32_t first_block) {
+    uint64_t start = monotonic_ns();
+    uint32_t current_block = first_block;
+    uint64_t freed = 0;
+    
+    while (current_block != FAT_ENTRY_EOF && current_block != FAT_ENTRY_FREE) {
+        // The rest of a shared chain stays with its other owners
+        if (share_drop(current_block)) {
+            break;
+        }
+        uint32_t next_block = fat_get(current_block);
+        fat_set(current_block, FAT_ENTRY_FREE);
+        journal_revoke(current_block);
+        current_block = next_block;
+        freed++;
+    }
+    stat_record(STAT_FREE, start, freed);
+}
+
+// Directory blocks
+//
+// Blocks are parsed in place as DirRecord sequences. dir_block_normalize()
+// turns an unformatted (all-zero) or damaged tail of a block into one free
+// record, so every later walk can trust record_length.
+static void dir_block_init(uint8_t* block, uint32_t block_size) {
+    memset(block, 0, block_size);
+    ((DirRecord*)block)->record_length = block_size;
+}
+
+// Bytes a record occupies: header, name and any inline data
+static uint32_t dir_record_used(const DirRecord* rec) {
+    uint32_t used = DIR_RECORD_SIZE(rec->name_length);
+    if (rec->attributes & ATTR_INLINE) {
+        used += (rec->file_size + 3) & ~3u;
+    }
+    return used;
+}
+
+// Room for inline data in a record of 'record_length' bytes
+static uint32_t dir_record_inline_room(uint32_t record_length, uint32_t name_length) {
+    uint32_t room = record_length - DIR_RECORD_SIZE(name_length);
+    return room < INLINE_MAX_SIZE ? room : INLINE_MAX_SIZE;
+}
+
+static void dir_block_normalize(uint8_t* block) {
+    uint32_t offset = 0;
+    uint32_t prev = fs.block_size;
+    
+    while (offset < fs.block_size) {
+        DirRecord* rec = (DirRecord*)(block + offset);
+        uint32_t remaining = fs.block_size - offset;
+    
+        if (remaining < sizeof(DirRecord)) {
+            ((DirRecord*)(block + prev))->record_length += remaining;
+            return;
+        }
+        if (rec->record_length < sizeof(DirRecord) || rec->record_length > remaining ||
+            rec->record_length % 4 != 0 ||
+            (rec->name_length > 0 && dir_record_used(rec) > rec->record_length)) {
+            memset(rec, 0, sizeof(DirRecord));
+            rec->record_length = remaining;
+            return;
+        }
+        prev = offset;
+        offset += rec->record_length;
+    }
+}
+
+// Bytes a record keeps when a new one is split off it: what it occupies,
+// and for a file without blocks at least INLINE_RESERVE bytes of room to
+// hold or grow inline data in
+static uint32_t dir_record_kept(const DirRecord* rec) {
+    uint32_t kept = dir_record_used(rec);
+    uint32_t reserved = DIR_RECORD_SIZE(rec->name_length) + INLINE_RESERVE;
+    if (rec->type == TYPE_FILE && fat_from_disk(rec->first_block) == FAT_ENTRY_EOF && kept < reserved) {
+        kept = reserved;
+    }
+    return kept < rec->record_length ? kept : rec->record_length;
+}
+
+// Space a new record could take from 'rec': all of it when free, otherwise
+// whatever it does not keep
+static uint32_t dir_record_slack(const DirRecord* rec) {
+    if (rec->name_length == 0) {
+        return rec->record_length;
+    }
+    return rec->record_length - dir_record_kept(rec);
+}
+
+static uint16_t dir_block_largest_free(const uint8_t* block) {
+    uint32_t largest = 0;
+    for (uint32_t offset = 0; offset < fs.block_size; ) {
+        const DirRecord* rec = (const DirRecord*)(block + offset);
+        uint32_t slack = dir_record_slack(rec);
+        if (slack > largest) {
+            largest = slack;
+        }
+        offset += rec->record_length;
+    }
+    return largest;
+}
+
+static void dir_record_decode(const DirRecord* rec, DirectoryEntry* entry) {
+    memset(entry, 0, sizeof(DirectoryEntry));
+    uint32_t name_length = rec->name_length < MAX_FILENAME_SIZE ? rec->name_length : MAX_FILENAME_SIZE - 1;
+    memcpy(entry->filename, (const char*)(rec + 1), name_length);
+    entry->filename[name_length] = '\0';
+    entry->file_size = rec->file_size;
+    entry->first_block = fat_from_disk(rec->first_block);
+    entry->type = rec->type;
+    entry->created_time = rec->created_time;
+    entry->modified_time = rec->modified_time;
+    entry->attributes = rec->attributes;
+    if (entry->attributes & ATTR_INLINE) {
+        uint32_t room = dir_record_inline_room(rec->record_length, rec->name_length);
+        uint32_t size = entry->file_size < room ? entry->file_size : room;
+        memcpy(entry->inline_data, (const uint8_t*)rec + DIR_RECORD_SIZE(rec->name_length), size);
+    }
+}
+
+// Stores everything except the name and record length. The record must
+// have room for any inline data (see dir_write_entry()).
+static void dir_record_store(DirRecord* rec, const DirectoryEntry* entry) {
+    rec->type = entry->type;
+    rec->first_block = fat_to_disk(entry->first_block);
+    rec->file_size = entry->file_size;
+    rec->created_time = entry->created_time;
+    rec->modified_time = entry->modified_time;
+    rec->attributes = entry->attributes;
+    if (entry->attributes & ATTR_INLINE) {
+        memcpy((uint8_t*)rec + DIR_RECORD_SIZE(rec->name_length), entry->inline_data, entry->file_size);
+    }
+}
+
+// Next block of a directory chain. The root block of older images is
+// marked BAD rather than EOF in the FAT; both end the chain.
+static uint32_t dir_next_block(uint32_t block) {
+    uint32_t next = fat_get(block);
+    return next >= FAT_ENTRY_BAD ? FAT_ENTRY_EOF : next;
+}
+
+int dir_iterate(uint32_t dir_block,
+                int (*visit)(const DirectoryEntry* entry, const DirEntryLoc* loc, void* ctx),
+                void* ctx) {
+    uint8_t block[fs.block_size];
+    uint32_t blocks_seen = 0;
+    
+    for (uint32_t b = dir_block; b != FAT_ENTRY_EOF; b = dir_next_block(b)) {
+        if (++blocks_seen > fs.boot_sector.total_blocks || read_block(b, block) != 0) {
+            return -1;
+        }
+        dir_block_normalize(block);
+    
+        for (uint32_t offset = 0; offset < fs.block_size; ) {
+            const DirRecord* rec = (const DirRecord*)(block + offset);
+            if (rec->name_length > 0) {
+                DirectoryEntry entry;
+                DirEntryLoc loc = { b, (uint16_t)offset };
+                dir_record_decode(rec, &entry);
+                int result = visit(&entry, &loc, ctx);
+                if (result != 0) {
+                    return result;
+                }
+            }
+            offset += rec->record_length;
+        }
+    }
+    return 0;
+}
+
+// Directory index
+//
+// Each directory in use gets an index built on first access by walking its
+// chain once. dir_add_entry() and dir_remove_entry() keep it current, so
+// lookups and duplicate checks are O(1) and never read a block, however
+// many entries the directory holds.
+static uint32_t name_hash(const char* name) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    while (*name) {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static DirIndexSlot* dir_index_lookup(DirIndex* index, const char* name) {
+    uint32_t hash = name_hash(name);
+    uint32_t mask = index->slot_count - 1;
+    
+    for (uint32_t i = hash & mask; index->slots[i].state != DIR_SLOT_EMPTY; i = (i + 1) & mask) {
+        DirIndexSlot* slot = &index->slots[i];
+        if (slot->state == DIR_SLOT_USED && slot->hash == hash && strcmp(slot->name, name) == 0) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+// Rebuilds the table at a size that keeps it at most half full
+static int dir_index_resize(DirIndex* index) {
+    uint32_t slot_count = DIR_INDEX_MIN_SLOTS;
+    while (slot_count < (index->used_count + 1) * 2) {
+        slot_count <<= 1;
+    }
+    
+    DirIndexSlot* slots = calloc(slot_count, sizeof(DirIndexSlot));
+    if (!slots) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < index->slot_count; i++) {
+        if (index->slots[i].state == DIR_SLOT_USED) {
+            uint32_t j = index->slots[i].hash & (slot_count - 1);
+            while (slots[j].state == DIR_SLOT_USED) {
+                j = (j + 1) & (slot_count - 1);
+            }
+            slots[j] = index->slots[i];
+        }
+    }
+    
+    free(index->slots);
+    index->slots = slots;
+    index->slot_count = slot_count;
+    index->deleted_count = 0;
+    return 0;
+}
+
+static int dir_index_insert(DirIndex* index, const char* name, const DirEntryLoc* loc) {
+    if ((index->used_count + index->deleted_count + 1) * 4 > index->slot_count * 3) {
+        if (dir_index_resize(index) != 0) {
+            return -1;
+        }
+    }
+    
+    uint32_t hash = name_hash(name);
+    uint32_t mask = index->slot_count - 1;
+    uint32_t i = hash & mask;
+    while (index->slots[i].state == DIR_SLOT_USED) {
+        i = (i + 1) & mask;
+    }
+    if (index->slots[i].state == DIR_SLOT_DELETED) {
+        index->deleted_count--;
+    }
+    
+    DirIndexSlot* slot = &index->slots[i];
+    strcpy(slot->name, name);
+    slot->hash = hash;
+    slot->loc = *loc;
+    slot->state = DIR_SLOT_USED;
+    index->used_count++;
+    return 0;
+}
+
+static int dir_index_append_block(DirIndex* index, uint32_t block, uint16_t largest_free) {
+    if (index->block_count == index->block_capacity) {
+        uint32_t capacity = index->block_capacity ? index->block_capacity * 2 : 4;
+        uint32_t* blocks = realloc(index->blocks, capacity * sizeof(uint32_t));
+        if (!blocks) {
+            return -1;
+        }
+        index->blocks = blocks;
+        uint16_t* largest = realloc(index->largest_free, capacity * sizeof(uint16_t));
+        if (!largest) {
+            return -1;
+        }
+        index->largest_free = largest;
+        index->block_capacity = capacity;
+    }
+    index->blocks[index->block_count] = block;
+    index->largest_free[index->block_count] = largest_free;
+    index->block_count++;
+    return 0;
+}
+
+static void dir_index_release(DirIndex* index) {
+    free(index->slots);
+    free(index->blocks);
+    free(index->largest_free);
+    memset(index, 0, sizeof(DirIndex));
+}
+
+static DirIndex* dir_index_find(uint32_t dir_block) {
+    for (int i = 0; i < DIR_INDEX_CACHE_SIZE; i++) {
+        if (fs.dir_indexes[i] && fs.dir_indexes[i]->dir_block == dir_block) {
+            return fs.dir_indexes[i];
+        }
+    }
+    return NULL;
+}
+
+static int dir_index_build(DirIndex* index, uint32_t dir_block) {
+    uint8_t block[fs.block_size];
+    uint32_t blocks_seen = 0;
+    
+    index->slot_count = DIR_INDEX_MIN_SLOTS;
+    index->slots = calloc(index->slot_count, sizeof(DirIndexSlot));
+    if (!index->slots) {
+        return -1;
+    }
+    
+    for (uint32_t b = dir_block; b != FAT_ENTRY_EOF; b = dir_next_block(b)) {
+        if (++blocks_seen > fs.boot_sector.total_blocks || read_block(b, block) != 0) {
+            return -1;
+        }
+        dir_block_normalize(block);
+    
+        for (uint32_t offset = 0; offset < fs.block_size; ) {
+            const DirRecord* rec = (const DirRecord*)(block + offset);
+            if (rec->name_length > 0) {
+                DirectoryEntry entry;
+                DirEntryLoc loc = { b, (uint16_t)offset };
+                dir_record_decode(rec, &entry);
+                if (dir_index_insert(index, entry.filename, &loc) != 0) {
+                    return -1;
+                }
+            }
+            offset += rec->record_length;
+        }
+        if (dir_index_append_block(index, b, dir_block_largest_free(block)) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Returns the index for a directory, building it if it is not cached
+static DirIndex* dir_index_get(uint32_t dir_block) {
+    DirIndex* index = dir_index_find(dir_block);
+    if (index) {
+        index->last_used = ++fs.dir_index_clock;
+        return index;
+    }
+    
+    // Reuse an empty or the least recently used index
+    int victim = 0;
+    for (int i = 0; i < DIR_INDEX_CACHE_SIZE; i++) {
+        if (!fs.dir_indexes[i]) {
+            victim = i;
+            break;
+        }
+        if (fs.dir_indexes[i]->last_used < fs.dir_indexes[victim]->last_used) {
+            victim = i;
+        }
+    }
+    if (!fs.dir_indexes[victim]) {
+        fs.dir_indexes[victim] = calloc(1, sizeof(DirIndex));
+        if (!fs.dir_indexes[victim]) {
+            return NULL;
+        }
+    }
+    index = fs.dir_indexes[victim];
+    dir_index_release(index);
+    
+    if (dir_index_build(index, dir_block) != 0) {
+        dir_index_release(index);
+        return NULL;
+    }
+    index->dir_block = dir_block;
+    index->last_used = ++fs.dir_index_clock;
+    return index;
+}
+
+void dir_index_clear() {
+    for (int i = 0; i < DIR_INDEX_CACHE_SIZE; i++) {
+        if (fs.dir_indexes[i]) {
+            dir_index_release(fs.dir_indexes[i]);
+            free(fs.dir_indexes[i]);
+            fs.dir_indexes[i] = NULL;
+        }
+    }
+    fs.dir_index_clock = 0;
+}
+
+// Directory operations
+// The index cache and read-modify-write of directory blocks are shared
+// between directories, so these run under dir_lock
+int find_file_in_directory(uint32_t dir_block, const char* filename, DirEntryLoc* loc) {
+    uint64_t start = monotonic_ns();
+    pthread_mutex_lock(&fs.dir_lock);
+    DirIndex* index = dir_index_get(dir_block);
+    DirIndexSlot* slot = index ? dir_index_lookup(index, filename) : NULL;
+    if (slot && loc) {
+        *loc = slot->loc;
+    }
+    pthread_mutex_unlock(&fs.dir_lock);
+    stat_record(STAT_LOOKUP, start, 0);
+    return slot ? 0 : -1;
+}
+
+int dir_read_entry(const DirEntryLoc* loc, DirectoryEntry* entry) {
+    uint8_t block[fs.block_size];
+    if (read_block(loc->block, block) != 0) {
+        return -1;
+    }
+    dir_record_decode((const DirRecord*)(block + loc->offset), entry);
+    return 0;
+}
+
+// Returns 1, writing nothing, when the entry is inline and its data does
+// not fit the record. That is checked here under dir_lock, since creating
+// a file may split the record's slack off at any time.
+int dir_write_entry(const DirEntryLoc* loc, const DirectoryEntry* entry) {
+    uint8_t block[fs.block_size];
+    int result = -1;
+    
+    pthread_mutex_lock(&fs.dir_lock);
+    if (read_block(loc->block, block) == 0) {
+        DirRecord* rec = (DirRecord*)(block + loc->offset);
+        if ((entry->attributes & ATTR_INLINE) &&
+            entry->file_size > dir_record_inline_room(rec->record_length, rec->name_length)) {
+            result = 1;
+        } else {
+            dir_record_store(rec, entry);
+            result = journal_write(loc->block, block);
+        }
+    }
+    pthread_mutex_unlock(&fs.dir_lock);
+    return result;
+}
+
+// Adds a record for 'entry' to the first block with room for it, growing
+// the directory by one block when none has. The caller flushes the FAT.
+static int dir_add_entry_locked(uint32_t dir_block, const DirectoryEntry* entry, DirEntryLoc* loc) {
+    DirIndex* index = dir_index_get(dir_block);
+    if (!index) {
+        return -1;
+    }
+    
+    uint32_t name_length = strlen(entry->filename);
+    uint32_t needed = DIR_RECORD_SIZE(name_length);
+    uint8_t block[fs.block_size];
+    uint32_t i;
+    
+    for (i = 0; i < index->block_count; i++) {
+        if (index->largest_free[i] < needed) {
+            continue;
+        }
+        if (read_block(index->blocks[i], block) != 0) {
+            return -1;
+        }
+        dir_block_normalize(block);
+    
+        // Inline data written since may have taken the gap
+        index->largest_free[i] = dir_block_largest_free(block);
+        if (index->largest_free[i] >= needed) {
+            break;
+        }
+    }
+    
+    if (i == index->block_count) {
+        // Grow the directory next to its last block
+        uint32_t new_block;
+        if (allocate_extent(1, index->blocks[index->block_count - 1], &new_block) != 0) {
+            return -1;
+        }
+        dir_block_init(block, fs.block_size);
+        if (journal_write(new_block, block) != 0 ||
+            dir_index_append_block(index, new_block, fs.block_size) != 0) {
+            free_blocks(new_block);
+            return -1;
+        }
+        fat_set(index->blocks[i - 1], new_block);
+    }
+    
+    // Take the first record with enough room, splitting off its slack
+    uint32_t offset = 0;
+    while (dir_record_slack((DirRecord*)(block + offset)) < needed) {
+        offset += ((DirRecord*)(block + offset))->record_length;
+    }
+    
+    DirRecord* rec = (DirRecord*)(block + offset);
+    if (rec->name_length > 0) {
+        uint32_t used = dir_record_kept(rec);
+        uint32_t rest = rec->record_length - used;
+        rec->record_length = used;
+        offset += used;
+        rec = (DirRecord*)(block + offset);
+        rec->record_length = rest;
+    }
+    
+    uint16_t record_length = rec->record_length;
+    memset(rec, 0, needed);
+    rec->record_length = record_length;
+    rec->name_length = name_length;
+    dir_record_store(rec, entry);
+    memcpy(rec + 1, entry->filename, name_length);
+    
+    if (journal_write(index->blocks[i], block) != 0) {
+        return -1;
+    }
+    index->largest_free[i] = dir_block_largest_free(block);
+    
+    DirEntryLoc new_loc = { index->blocks[i], (uint16_t)offset };
+    if (dir_index_insert(index, entry->filename, &new_loc) != 0) {
+        index->dir_block = 0; // Out of memory; rebuild on next access
+    }
+    if (loc) {
+        *loc = new_loc;
+    }
+    return 0;
+}
+
+int dir_add_entry(uint32_t dir_block, const DirectoryEntry* entry, DirEntryLoc* loc) {
+    pthread_mutex_lock(&fs.dir_lock);
+    int result = dir_add_entry_locked(dir_block, entry, loc);
+    pthread_mutex_unlock(&fs.dir_lock);
+    return result;
+}
+
+// Removes a record by merging it into the record before it in its block
+static int dir_remove_entry_locked(uint32_t dir_block, const DirEntryLoc* loc) {
+    DirIndex* index = dir_index_get(dir_block);
+    uint8_t block[fs.block_size];
+    
+    if (!index || read_block(loc->block, block) != 0) {
+        return -1;
+    }
+    dir_block_normalize(block);
+    
+    uint32_t prev = fs.block_size;
+    uint32_t offset = 0;
+    while (offset < loc->offset) {
+        prev = offset;
+        offset += ((DirRecord*)(block + offset))->record_length;
+    }
+    if (offset != loc->offset) {
+        return -1;
+    }
+    
+    DirRecord* rec = (DirRecord*)(block + offset);
+    DirectoryEntry entry;
+    dir_record_decode(rec, &entry);
+    
+    if (prev < fs.block_size) {
+        ((DirRecord*)(block + prev))->record_length += rec->record_length;
+    } else {
+        rec->name_length = 0;
+    }
+    
+    if (journal_write(loc->block, block) != 0) {
+        return -1;
+    }
+    
+    DirIndexSlot* slot = dir_index_lookup(index, entry.filename);
+    if (slot) {
+        slot->state = DIR_SLOT_DELETED;
+        index->used_count--;
+        index->deleted_count++;
+    }
+    for (uint32_t i = 0; i < index->block_count; i++) {
+        if (index->blocks[i] == loc->block) {
+            index->largest_free[i] = dir_block_largest_free(block);
+            break;
+        }
+    }
+    return 0;
+}
+
+int dir_remove_entry(uint32_t dir_block, const DirEntryLoc* loc) {
+    pthread_mutex_lock(&fs.dir_lock);
+    int result = dir_remove_entry_locked(dir_block, loc);
+    pthread_mutex_unlock(&fs.dir_lock);
+    return result;
+}
+
+
+// Parses a comma-separated format option list such as
+// "block=4096,size=1024". The FAT is 16-bit unless the volume has more
+// than FAT16_MAX_BLOCKS blocks or fat=32 is given.
+int parse_format_options(const char* options, FormatOptions* opts) {
+    opts->block_size = DEFAULT_BLOCK_SIZE;
+    opts->disk_mb = DEFAULT_DISK_MB;
+    opts->fat_bits = 0;
+    opts->preallocate = 0;
+    opts->encrypt = 0;
+    opts->key[0] = '\0';
+    
+    if (options && options[0] != '\0') {
+        char buffer[256];
+        strncpy(buffer, options, sizeof(buffer) - 1);
+        buffer[sizeof(buffer) - 1] = '\0';
+    
+        for (char* option = strtok(buffer, ","); option; option = strtok(NULL, ",")) {
+            unsigned int value;
+            if (strcmp(option, "prealloc") == 0) {
+                opts->preallocate = 1;
+            } else if (sscanf(option, "block=%u", &value) == 1 && value >= MIN_BLOCK_SIZE &&
+                       value <= MAX_BLOCK_SIZE && (value & (value - 1)) == 0) {
+                opts->block_size = value;
+            } else if (sscanf(option, "size=%u", &value) == 1 && value > 0) {
+                opts->disk_mb = value;
+            } else if (sscanf(option, "fat=%u", &value) == 1 && (value == 16 || value == 32)) {
+                opts->fat_bits = value;
+            } else if (strcmp(option, "encrypt") == 0) {
+                opts->encrypt = 1;
+            } else if (strncmp(option, "key=", 4) == 0 && option[4] != '\0' && strlen(option + 4) < CRYPT_MAX_KEY) {
+                strcpy(opts->key, option + 4);
+            } else {
+                printf("Error: Invalid format option '%s'\n", option);
+                return -1;
+            }
+        }
+    }
+    
+    if (opts->encrypt != (opts->key[0] != '\0')) {
+        printf("Error: An encrypted volume needs both encrypt and key=<passphrase>\n");
+        return -1;
+    }
+    
+    uint64_t total_blocks = (uint64_t)opts->disk_mb * 1024 * 1024 / opts->block_size;
+    if (total_blocks > MAX_TOTAL_BLOCKS) {
+        printf("Error: %u MB in %u-byte blocks exceeds %u blocks\n", opts->disk_mb, opts->block_size,
+               MAX_TOTAL_BLOCKS);
+        return -1;
+    }
+    if (opts->fat_bits == 0) {
+        opts->fat_bits = total_blocks > FAT16_MAX_BLOCKS ? 32 : 16;
+    } else if (opts->fat_bits == 16 && total_blocks > FAT16_MAX_BLOCKS) {
+        printf("Error: A 16-bit FAT holds at most %u blocks\n", FAT16_MAX_BLOCKS);
+        return -1;
+    }
+    return 0;
+}
+
+// Creates the disk file. By default it is sized with ftruncate() and left
+// sparse, so the host only stores the blocks format and later writes touch.
+// With the prealloc option, space for the whole disk is reserved up front
+// (posix_fallocate, or explicit zero writes where that is unsupported).
+int create_partition(const char* filename, const char* options) {
+    FormatOptions opts;
+    if (fs.device.ops) {
+        printf("Error: Unmount the partition before formatting\n");
+        return -1;
+    }
+    if (parse_format_options(options, &opts) != 0) {
+        return -1;
+    }
+    off_t disk_size = (off_t)opts.disk_mb * 1024 * 1024;
+    
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("Error: Cannot create file '%s'\n", filename);
+        return -1;
+    }
+    
+    printf("Creating %uMB %s disk file...\n", opts.disk_mb, opts.preallocate ? "preallocated" : "sparse");
+    if (ftruncate(fd, disk_size) != 0) {
+        printf("Error: Cannot size file '%s'\n", filename);
+        close(fd);
+        return -1;
+    }
+    
+    if (opts.preallocate && posix_fallocate(fd, 0, disk_size) != 0) {
+        // Filesystem cannot reserve extents; force allocation by writing zeros
+        size_t chunk_size = 256 * 1024;
+        uint8_t* zeros = calloc(chunk_size, 1);
+        if (!zeros) {
+            close(fd);
+            return -1;
+        }
+        
+        for (off_t offset = 0; offset < disk_size; offset += chunk_size) {
+            if (pwrite(fd, zeros, chunk_size, offset) != (ssize_t)chunk_size) {
+                printf("Error: Cannot preallocate file '%s'\n", filename);
+                free(zeros);
+                close(fd);
+                return -1;
+            }
+        }
+        free(zeros);
+    }
+    
+    if (close(fd) != 0) {
+        return -1;
+    }
+    printf("Disk file created successfully\n");
+    
+    return format_partition(filename, &opts);
+}
+
+
+// Lays out the volume described by 'opts' in an existing disk file. Only
+// the boot sector, FAT, journal header and root directory are written.
+// Everything is sized from the options, not from the mounted volume.
+int format_partition(const char* filename, const FormatOptions* opts) {
+    uint32_t block_size = opts->block_size;
+    uint32_t total_blocks = (uint32_t)((uint64_t)opts->disk_mb * 1024 * 1024 / block_size);
+    uint32_t entries_per_block = block_size * 8 / opts->fat_bits;
+    
+    // Initialize boot sector
+    BootSector boot_sector;
+    memset(&boot_sector, 0, sizeof(BootSector));
+    strcpy(boot_sector.signature, "MYFATFS");
+    boot_sector.total_blocks = total_blocks;
+    boot_sector.block_size = block_size;
+    boot_sector.fat_bits = opts->fat_bits;
+    boot_sector.fat_copies = 1;
+    boot_sector.created_time = (uint32_t)time(NULL);
+    strcpy(boot_sector.volume_label, "MYVOLUME");
+    
+    // One FAT entry per block; the journal shrinks on small volumes and to
+    // what one header block can describe
+    boot_sector.fat_blocks = (total_blocks + entries_per_block - 1) / entries_per_block;
+    boot_sector.journal_start = 1 + boot_sector.fat_blocks;
+    boot_sector.journal_blocks = JOURNAL_BLOCKS;
+    if (boot_sector.journal_blocks > JOURNAL_MAX_BLOCKS(block_size) + 1) {
+        boot_sector.journal_blocks = JOURNAL_MAX_BLOCKS(block_size) + 1;
+    }
+    if (boot_sector.journal_blocks > total_blocks / 8) {
+        boot_sector.journal_blocks = total_blocks / 8;
+    }
+    boot_sector.root_dir_block = boot_sector.journal_start + boot_sector.journal_blocks;
+    boot_sector.data_start_block = boot_sector.root_dir_block + 1;
+    if (boot_sector.journal_blocks < 2 || boot_sector.data_start_block + 16 > total_blocks) {
+        printf("Error: %u MB is too small for %u-byte blocks\n", opts->disk_mb, block_size);
+        return -1;
+    }
+    
+    // Everything written after the boot sector is encrypted with the new key
+    XtsKey xts;
+    if (opts->encrypt) {
+        boot_sector.encrypted = 1;
+        boot_sector.crypt_iterations = CRYPT_KDF_ITERATIONS;
+        if (crypt_random(boot_sector.crypt_salt, CRYPT_SALT_SIZE) != 0) {
+            printf("Error: Cannot read random salt\n");
+            return -1;
+        }
+        crypt_derive(&boot_sector, opts->key, 0, &xts);
+    }
+    
+    // Open the file directly for formatting
+    FILE* file = fopen(filename, "rb+");
+    if (!file) {
+        printf("Error: Cannot open file '%s' for formatting\n", filename);
+        return -1;
+    }
+    
+    printf("Formatting file system...\n");
+    
+    // Write boot sector to block 0
+    fseeko(file, 0, SEEK_SET);
+    fwrite(&boot_sector, sizeof(BootSector), 1, file);
+    
+    // Write the FAT: system blocks are marked used and the root directory
+    // is the head of a chain so it can grow into data blocks. Entries past
+    // the end of the disk are never allocated.
+    uint8_t block[block_size];
+    for (uint32_t i = 0; i < boot_sector.fat_blocks; i++) {
+        for (uint32_t j = 0; j < entries_per_block; j++) {
+            uint32_t entry = i * entries_per_block + j;
+            uint32_t value = FAT_ENTRY_FREE;
+            if (entry == boot_sector.root_dir_block) {
+                value = FAT_ENTRY_EOF;
+            } else if (entry < boot_sector.data_start_block || entry >= total_blocks) {
+                value = FAT_ENTRY_BAD;
+            }
+            if (opts->fat_bits == 16) {
+                ((uint16_t*)block)[j] = (uint16_t)value;
+            } else {
+                ((uint32_t*)block)[j] = value;
+            }
+        }
+        if (opts->encrypt) {
+            xts_crypt(&xts, 0, 1 + i, 1, block, block);
+        }
+        fseeko(file, (off_t)(1 + i) * block_size, SEEK_SET);
+        fwrite(block, block_size, 1, file);
+    }
+    
+    // Empty journal header, so nothing left in the file is replayed
+    memset(block, 0, block_size);
+    ((JournalHeader*)block)->magic = JOURNAL_MAGIC;
+    if (opts->encrypt) {
+        xts_crypt(&xts, 0, boot_sector.journal_start, 1, block, block);
+    }
+    
+    fseeko(file, (off_t)boot_sector.journal_start * block_size, SEEK_SET);
+    fwrite(block, block_size, 1, file);
+    
+    // Initialize root directory - only its own block is written, the data
+    // area is left untouched (and unallocated in a sparse disk file)
+    dir_block_init(block, block_size);
+    if (opts->encrypt) {
+        xts_crypt(&xts, 0, boot_sector.root_dir_block, 1, block, block);
+        memset(&xts, 0, sizeof(xts));
+    }
+    
+    fseeko(file, (off_t)boot_sector.root_dir_block * block_size, SEEK_SET);
+    fwrite(block, block_size, 1, file);
+    
+    fclose(file);
+    
+    printf("Format completed successfully!\n");
+    printf(" - Total blocks: %u of %u bytes\n", boot_sector.total_blocks, block_size);
+    printf(" - FAT: %u-bit, %u blocks\n", opts->fat_bits, boot_sector.fat_blocks);
+    printf(" - Journal: %u blocks at block %u\n", boot_sector.journal_blocks, boot_sector.journal_start);
+    printf(" - Root directory at block: %u\n", boot_sector.root_dir_block);
+    printf(" - Data starts at block: %u\n", boot_sector.data_start_block);
+    if (opts->encrypt) {
+        printf(" - Encryption: AES-256-XTS, PBKDF2-SHA256 key (%u iterations)\n", boot_sector.crypt_iterations);
+    }
+    
+    return 0;
+}
+
+// Parses a comma-separated option list such as "cache=512,backend=mmap".
+// The mmap backend is its own cache, so it defaults to cache=0.
+int parse_mount_options(const char* options, MountOptions* opts) {
+    int cache_given = 0;
+    
+    opts->cache_blocks = DEFAULT_CACHE_BLOCKS;
+    opts->readahead_blocks = DEFAULT_READAHEAD_BLOCKS;
+    opts->commit_interval = DEFAULT_COMMIT_INTERVAL;
+    opts->queue_depth = DEFAULT_QUEUE_DEPTH;
+    opts->force_threads = 0;
+    opts->backend = &pread_device_ops;
+    opts->key[0] = '\0';
+    
+    if (!options || options[0] == '\0') {
+        return 0;
+    }
+    
+    char buffer[256];
+    strncpy(buffer, options, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = '\0';
+    
+    for (char* option = strtok(buffer, ","); option; option = strtok(NULL, ",")) {
+        unsigned int value;
+        if (sscanf(option, "cache=%u", &value) == 1 && value <= MAX_CACHE_BLOCKS) {
+            opts->cache_blocks = value;
+            cache_given = 1;
+        } else if (sscanf(option, "readahead=%u", &value) == 1 && value > 0 &&
+                   value <= MAX_READAHEAD_BLOCKS) {
+            opts->readahead_blocks = value;
+        } else if (sscanf(option, "commit=%u", &value) == 1) {
+            opts->commit_interval = value;
+        } else if (sscanf(option, "qd=%u", &value) == 1 && value <= MAX_QUEUE_DEPTH) {
+            opts->queue_depth = value;
+        } else if (strcmp(option, "aio=uring") == 0) {
+            opts->force_threads = 0;
+        } else if (strcmp(option, "aio=threads") == 0) {
+            opts->force_threads = 1;
+        } else if (strcmp(option, "backend=pread") == 0 || strcmp(option, "backend=stdio") == 0) {
+            opts->backend = &pread_device_ops;
+        } else if (strcmp(option, "backend=mmap") == 0) {
+            opts->backend = &mmap_device_ops;
+        } else if (strncmp(option, "key=", 4) == 0 && strlen(option + 4) < CRYPT_MAX_KEY) {
+            strcpy(opts->key, option + 4);
+        } else {
+            printf("Error: Invalid mount option '%s'\n", option);
+            return -1;
+        }
+    }
+    
+    if (opts->backend == &mmap_device_ops && !cache_given) {
+        opts->cache_blocks = 0;
+    }
+    return 0;
+}
+
+static int sync_volume() {
+    if (!fs.device.ops) {
+        return -1;
+    }
+    
+    int result = fat_flush();
+    if (journal_commit() != 0) {
+        result = -1;
+    }
+    if (cache_flush() != 0) {
+        result = -1;
+    }
+    if (journal_mark_clean() != 0) {
+        result = -1;
+    }
+    if (fs.device.ops->sync(&fs.device) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+// Records the free count in the boot sector after a successful sync, so
+// the next mount can skip the free-space scan. Any later commit changes
+// the journal sequence, which voids it.
+static int boot_sector_write_state() {
+    uint8_t block[fs.block_size];
+    
+    fs.boot_sector.clean = 1;
+    fs.boot_sector.free_count = __atomic_load_n(&fs.free_count, __ATOMIC_RELAXED);
+    fs.boot_sector.next_free = __atomic_load_n(&fs.next_free, __ATOMIC_RELAXED);
+    fs.boot_sector.clean_sequence = fs.journal.sequence;
+    
+    memset(block, 0, fs.block_size);
+    memcpy(block, &fs.boot_sector, sizeof(BootSector));
+    if (disk_write_block(0, block) != 0 || fs.device.ops->sync(&fs.device) != 0) {
+        printf("Error: Cannot write boot sector\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void unmount_volume() {
+    if (fs.device.ops) {
+        if (sync_volume() == 0 && fs.groups && fs.journal.start) {
+            boot_sector_write_state();
+        }
+        io_destroy();
+        fs.device.ops->close(&fs.device);
+        fs.device.ops = NULL;
+    }
+    cache_destroy();
+    journal_destroy();
+    dir_index_clear();
+    dentry_cache_clear();
+    handle_close_all();
+    share_table_unload();
+    fs.snapshot_dir = 0;
+    if (fs.fat_pages) {
+        for (uint32_t i = 0; i < fs.boot_sector.fat_blocks; i++) {
+            free(fs.fat_pages[i]);
+        }
+        free(fs.fat_pages);
+        fs.fat_pages = NULL;
+    }
+    fs.fat_pages_loaded = 0;
+    if (fs.fat_dirty) {
+        free(fs.fat_dirty);
+        fs.fat_dirty = NULL;
+    }
+    free_map_destroy();
+}
+
+static int mount_volume(const char* filename, const char* options) {
+    MountOptions opts;
+    if (parse_mount_options(options, &opts) != 0) {
+        return -1;
+    }
+    
+    // Close any previously mounted partition
+    unmount_volume();
+    
+    // The boot sector fits the smallest block size; the real one is only
+    // known once it has been read
+    fs.block_size = MIN_BLOCK_SIZE;
+    if (opts.backend->open(&fs.device, filename) != 0) {
+        printf("Error: Cannot open file '%s'\n", filename);
+        return -1;
+    }
+    fs.device.ops = opts.backend;
+    fs.device.backend = opts.backend;
+    fs.device.blocks_read = 0;
+    fs.device.blocks_written = 0;
+    
+    // Read boot sector
+    uint8_t block[MIN_BLOCK_SIZE];
+    if (disk_read_block(0, block) != 0) {
+        printf("Error: Cannot read boot sector\n");
+        unmount_volume();
+        return -1;
+    }
+    memcpy(&fs.boot_sector, block, sizeof(BootSector));
+    
+    // Verify signature
+    if (strcmp(fs.boot_sector.signature, "MYFATFS") != 0) {
+        printf("Error: Not a valid MYFATFS partition\n");
+        printf("Signature found: '%.8s'\n", fs.boot_sector.signature);
+        unmount_volume();
+        return -1;
+    }
+    
+    fs.block_size = fs.boot_sector.block_size;
+    fs.fat_bits = fs.boot_sector.fat_bits ? fs.boot_sector.fat_bits : 16;
+    fs.fat_entries_per_block = fs.block_size * 8 / fs.fat_bits;
+    if (fs.block_size < MIN_BLOCK_SIZE || fs.block_size > MAX_BLOCK_SIZE ||
+        (fs.block_size & (fs.block_size - 1)) != 0 || (fs.fat_bits != 16 && fs.fat_bits != 32) ||
+        fs.boot_sector.total_blocks > (fs.fat_bits == 16 ? FAT16_MAX_BLOCKS : MAX_TOTAL_BLOCKS) ||
+        fs.boot_sector.data_start_block >= fs.boot_sector.total_blocks ||
+        (uint64_t)fs.boot_sector.fat_blocks * fs.fat_entries_per_block < fs.boot_sector.total_blocks) {
+        printf("Error: Unsupported geometry (block size %u, %u-bit FAT, %u blocks)\n",
+               fs.block_size, fs.fat_bits, fs.boot_sector.total_blocks);
+        unmount_volume();
+        return -1;
+    }
+    
+    printf("Boot sector loaded successfully\n");
+    printf("Volume: %s, Blocks: %u, Block Size: %u, FAT%u\n", 
+           fs.boot_sector.volume_label, 
+           fs.boot_sector.total_blocks,
+           fs.boot_sector.block_size, fs.fat_bits);
+    
+    // From here on every block but the boot sector goes through the key
+    if (fs.boot_sector.encrypted) {
+        if (opts.key[0] == '\0') {
+            printf("Error: Volume is encrypted, mount it with key=<passphrase>\n");
+            unmount_volume();
+            return -1;
+        }
+        fs.device.crypt = malloc(sizeof(XtsKey));
+        if (!fs.device.crypt || fs.boot_sector.crypt_iterations == 0 ||
+            crypt_derive(&fs.boot_sector, opts.key, 1, fs.device.crypt) != 0) {
+            printf("Error: Wrong passphrase\n");
+            free(fs.device.crypt);
+            fs.device.crypt = NULL;
+            unmount_volume();
+            return -1;
+        }
+        fs.device.ops = &crypt_device_ops;
+        printf("Encryption: AES-256-XTS (%s)\n", fs.device.crypt->hardware ? "AES instructions" : "software AES");
+    }
+    
+    // Finish a commit interrupted by a crash before the FAT is read
+    if (journal_init(opts.commit_interval) != 0) {
+        printf("Error: Cannot allocate journal\n");
+        unmount_volume();
+        return -1;
+    }
+    if (journal_replay() != 0) {
+        unmount_volume();
+        return -1;
+    }
+    if (fs.journal.start) {
+        printf("Journal: %u blocks, commit interval %us\n",
+               fs.boot_sector.journal_blocks, fs.journal.commit_interval);
+    }
+    
+    // FAT pages are read on first use, widening the entries to 32 bits
+    fs.fat_pages = calloc(fs.boot_sector.fat_blocks, sizeof(uint32_t*));
+    fs.fat_dirty = calloc((fs.boot_sector.fat_blocks + 7) / 8, 1);
+    if (!fs.fat_pages || !fs.fat_dirty) {
+        printf("Error: Cannot allocate memory for FAT table\n");
+        unmount_volume();
+        return -1;
+    }
+    fs.fat_dirty_count = 0;
+    
+    if (cache_init(opts.cache_blocks) != 0) {
+        printf("Error: Cannot allocate block cache\n");
+        unmount_volume();
+        return -1;
+    }
+    cache_pin(fs.boot_sector.root_dir_block);
+    
+    // The free count saved by a clean unmount holds only if nothing was
+    // committed since, by this or any other program
+    int clean = fs.boot_sector.clean && fs.journal.start &&
+                fs.boot_sector.clean_sequence == fs.journal.sequence &&
+                fs.boot_sector.free_count <= fs.boot_sector.total_blocks;
+    if (build_free_map(!clean) != 0) {
+        printf("Error: Cannot allocate memory for free-space map\n");
+        unmount_volume();
+        return -1;
+    }
+    if (clean) {
+        fs.free_count = fs.boot_sector.free_count;
+        fs.next_free = fs.boot_sector.next_free;
+        if (fs.next_free >= fs.boot_sector.data_start_block && fs.next_free < fs.free_map_limit) {
+            fs.base_group = fs.next_free / ALLOC_GROUP_BLOCKS;
+        }
+    }
+    printf("FAT: %u blocks, paged in on demand\n", fs.boot_sector.fat_blocks);
+    printf("Free blocks: %u%s\n", fs.free_count, clean ? " (saved at unmount)" : "");
+    
+    if (share_table_mount() != 0) {
+        unmount_volume();
+        return -1;
+    }
+    if (fs.shares) {
+        printf("Snapshots: share table of %u blocks\n", fs.share_table_blocks);
+    }
+    
+    io_init(opts.queue_depth, opts.force_threads);
+    printf("I/O: %s, queue depth %u\n", io_engine_name(), fs.io.queue_depth);
+    
+    fs.readahead_blocks = opts.readahead_blocks;
+    fs.defrag_resume = 0;
+    printf("Backend: %s, block cache: %u blocks, read-ahead: %u blocks\n",
+           fs.device.backend->name, fs.cache.capacity, fs.readahead_blocks);
+    
+    fs.current_dir_block = fs.boot_sector.root_dir_block;
+    strcpy(fs.current_path, "/");
+    
+    printf("Partition mounted successfully at %s\n", fs.current_path);
+    return 0;
+}
+
+// Mount, unmount and sync hold the volume lock exclusively, so they wait
+// for every operation in progress and none starts until they are done
+int mount_partition(const char* filename, const char* options) {
+    pthread_rwlock_wrlock(&fs.volume_lock);
+    int result = mount_volume(filename, options);
+    pthread_rwlock_unlock(&fs.volume_lock);
+    return result;
+}
+
+int sync_partition() {
+    pthread_rwlock_wrlock(&fs.volume_lock);
+    int result = sync_volume();
+    pthread_rwlock_unlock(&fs.volume_lock);
+    return result;
+}
+
+void unmount_partition() {
+    pthread_rwlock_wrlock(&fs.volume_lock);
+    unmount_volume();
+    pthread_rwlock_unlock(&fs.volume_lock);
+}
+
+// Locking
+//
+// The core API may be called from several threads. Locks are taken in this
+// order, outermost first:
+//  - volume_lock: shared by every operation, exclusive for mount, unmount,
+//    sync and the journal commit between console commands, so those never
+//    see an operation half done
+//  - a directory stripe, shared for lookups and listing, exclusive while
+//    entries are added or removed
+//  - a file stripe, shared for reads, exclusive for anything that changes
+//    the file's data, size or chain
+//  - dir_lock (directory index, dentry cache and directory block updates), an allocation
+//    group's lock, fat_lock (FAT write-back) and block_lock (cache and
+//    journal), held only inside the functions that need them
+// Stripes are reader-writer locks picked by hashing the directory's first
+// block or the file's record location, so operations on different files
+// rarely share one. An open handle may be used by one thread at a time;
+// threads reading the same file each open their own handle.
+void fs_init() {
+    memset(&fs, 0, sizeof(FileSystem));
+    
+    pthread_mutexattr_t recursive;
+    pthread_mutexattr_init(&recursive);
+    pthread_mutexattr_settype(&recursive, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&fs.block_lock, &recursive);
+    pthread_mutexattr_destroy(&recursive);
+    
+    pthread_mutex_init(&fs.fat_lock, NULL);
+    pthread_mutex_init(&fs.dir_lock, NULL);
+    pthread_mutex_init(&fs.handle_lock, NULL);
+    pthread_mutex_init(&fs.io.lock, NULL);
+    pthread_cond_init(&fs.io.work, NULL);
+    pthread_cond_init(&fs.io.finished, NULL);
+    pthread_rwlock_init(&fs.volume_lock, NULL);
+    for (int i = 0; i < LOCK_STRIPES; i++) {
+        pthread_rwlock_init(&fs.dir_locks[i], NULL);
+        pthread_rwlock_init(&fs.file_locks[i], NULL);
+    }
+}
+
+static pthread_rwlock_t* dir_lock_for(uint32_t dir_block) {
+    return &fs.dir_locks[(dir_block * 2654435761u >> 16) % LOCK_STRIPES];
+}
+
+static pthread_rwlock_t* file_lock_for(const DirEntryLoc* loc) {
+    return &fs.file_locks[((loc->block * fs.block_size + loc->offset) * 2654435761u >> 16) % LOCK_STRIPES];
+}
+
+static void file_lock(const DirEntryLoc* loc, int exclusive) {
+    if (exclusive) {
+        pthread_rwlock_wrlock(file_lock_for(loc));
+    } else {
+        pthread_rwlock_rdlock(file_lock_for(loc));
+    }
+}
+
+// Paths
+//
+// Commands take paths, absolute from '/' or relative to the current
+// directory, with '.' and '..' components ('..' of the root is the root).
+// Each directory component is looked up in the dentry cache, which maps a
+// directory and a name to the subdirectory's first block, before the
+// directory index, so walking a deep path again reads no directory block.
+// Directories are never moved and only removed by 'snapshot delete' and
+// 'check repair', which clear the cache. It is direct-mapped and guarded
+// by dir_lock.
+static DentrySlot* dentry_slot(uint32_t parent, const char* name) {
+    return &fs.dentries[(name_hash(name) ^ parent * 2654435761u) % DENTRY_CACHE_SIZE];
+}
+
+void dentry_cache_clear() {
+    pthread_mutex_lock(&fs.dir_lock);
+    memset(fs.dentries, 0, sizeof(fs.dentries));
+    pthread_mutex_unlock(&fs.dir_lock);
+}
+
+// Finds the subdirectory 'name' of the directory starting at 'dir_block'
+static int path_step(uint32_t dir_block, const char* name, uint32_t* child) {
+    if (strcmp(name, ".") == 0 || (strcmp(name, "..") == 0 && dir_block == fs.boot_sector.root_dir_block)) {
+        *child = dir_block;
+        return 0;
+    }
+    
+    DentrySlot* slot = dentry_slot(dir_block, name);
+    pthread_mutex_lock(&fs.dir_lock);
+    int hit = slot->parent == dir_block && strcmp(slot->name, name) == 0;
+    if (hit) {
+        *child = slot->block;
+        fs.dentry_hits++;
+    } else {
+        fs.dentry_misses++;
+    }
+    pthread_mutex_unlock(&fs.dir_lock);
+    if (hit) {
+        return 0;
+    }
+    
+    pthread_rwlock_t* dir = dir_lock_for(dir_block);
+    pthread_rwlock_rdlock(dir);
+    DirEntryLoc loc;
+    DirectoryEntry entry;
+    int found = find_file_in_directory(dir_block, name, &loc) == 0 && dir_read_entry(&loc, &entry) == 0;
+    pthread_rwlock_unlock(dir);
+    if (!found) {
+        printf("Directory '%s' not found\n", name);
+        return -1;
+    }
+    if (entry.type != TYPE_DIRECTORY) {
+        printf("'%s' is not a directory\n", name);
+        return -1;
+    }
+    
+    *child = entry.first_block;
+    pthread_mutex_lock(&fs.dir_lock);
+    slot->parent = dir_block;
+    slot->block = entry.first_block;
+    strcpy(slot->name, name);
+    pthread_mutex_unlock(&fs.dir_lock);
+    return 0;
+}
+
+// Resolves every component of 'path' but the last, which is copied to
+// 'name' (empty for "/"), and sets '*dir_block' to the directory holding
+// it. Repeated and trailing slashes are ignored. The caller holds the
+// volume lock.
+static int path_parent(const char* path, uint32_t* dir_block, char* name) {
+    if (!fs.device.ops) {
+        printf("Error: No partition mounted\n");
+        return -1;
+    }
+    if (strlen(path) >= MAX_PATH_SIZE) {
+        printf("Path too long\n");
+        return -1;
+    }
+    
+    uint32_t dir = path[0] == '/' ? fs.boot_sector.root_dir_block : fs.current_dir_block;
+    for (;;) {
+        while (*path == '/') {
+            path++;
+        }
+        size_t length = strcspn(path, "/");
+        if (length >= MAX_FILENAME_SIZE) {
+            printf("Filename too long\n");
+            return -1;
+        }
+        memcpy(name, path, length);
+        name[length] = '\0';
+        path += length;
+        while (*path == '/') {
+            path++;
+        }
+        if (*path == '\0') {
+            *dir_block = dir;
+            return 0;
+        }
+        if (path_step(dir, name, &dir) != 0) {
+            return -1;
+        }
+    }
+}
+
+// Resolves a path naming a directory
+static int path_directory(const char* path, uint32_t* dir_block) {
+    char name[MAX_FILENAME_SIZE];
+    if (path_parent(path, dir_block, name) != 0) {
+        return -1;
+    }
+    return name[0] != '\0' ? path_step(*dir_block, name, dir_block) : 0;
+}
+
+// Writes the absolute form of 'path' to 'out', with '.' and '..' folded
+// away. 'path' must already resolve.
+static int path_absolute(const char* path, char* out) {
+    char joined[2 * MAX_PATH_SIZE];
+    snprintf(joined, sizeof(joined), "%s/%s", path[0] == '/' ? "" : fs.current_path, path);
+    
+    size_t length = 0;
+    char* saved;
+    for (char* component = strtok_r(joined, "/", &saved); component; component = strtok_r(NULL, "/", &saved)) {
+        if (strcmp(component, ".") == 0) {
+            continue;
+        }
+        if (strcmp(component, "..") == 0) {
+            // Drop the last component and its slash
+            while (length > 0 && out[length - 1] != '/') {
+                length--;
+            }
+            if (length > 0) {
+                length--;
+            }
+            continue;
+        }
+        size_t component_length = strlen(component);
+        if (length + 1 + component_length >= MAX_PATH_SIZE) {
+            printf("Path too long\n");
+            return -1;
+        }
+        out[length++] = '/';
+        memcpy(out + length, component, component_length);
+        length += component_length;
+    }
+    if (length == 0) {
+        out[length++] = '/';
+    }
+    out[length] = '\0';
+    return 0;
+}
+
+// Takes the volume lock shared, resolves 'path' to the directory holding
+// its last component, copied to 'name', and locks that directory. Returns
+// the directory's lock, released with dir_unlock(), or NULL with nothing
+// held.
+static pthread_rwlock_t* dir_lock_path(const char* path, int exclusive, uint32_t* dir_block, char* name) {
+    pthread_rwlock_rdlock(&fs.volume_lock);
+    if (path_parent(path, dir_block, name) != 0) {
+        pthread_rwlock_unlock(&fs.volume_lock);
+        return NULL;
+    }
+    if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        printf("Invalid path '%s'\n", path);
+        pthread_rwlock_unlock(&fs.volume_lock);
+        return NULL;
+    }
+    if (exclusive && *dir_block == fs.snapshot_dir) {
+        printf("Error: /%s is managed by the snapshot command\n", SNAPSHOT_DIR_NAME);
+        pthread_rwlock_unlock(&fs.volume_lock);
+        return NULL;
+    }
+    
+    pthread_rwlock_t* dir = dir_lock_for(*dir_block);
+    if (exclusive) {
+        pthread_rwlock_wrlock(dir);
+    } else {
+        pthread_rwlock_rdlock(dir);
+    }
+    return dir;
+}
+
+static void dir_unlock(pthread_rwlock_t* dir) {
+    pthread_rwlock_unlock(dir);
+    pthread_rwlock_unlock(&fs.volume_lock);
+}
+
+// Resolves 'path' for an operation on an existing file: takes the volume
+// lock shared and the file's lock, and reads its entry. On success the
+// caller ends with file_unlock(); on failure nothing is held.
+static int file_lock_lookup(const char* path, int exclusive, DirEntryLoc* loc, DirectoryEntry* entry) {
+    uint32_t dir_block;
+    char name[MAX_FILENAME_SIZE];
+    pthread_rwlock_t* dir = dir_lock_path(path, 0, &dir_block, name);
+    if (!dir) {
+        return -1;
+    }
+    
+    // The only file there is the share table
+    if (dir_block == fs.snapshot_dir) {
+        printf("Error: /%s is managed by the snapshot command\n", SNAPSHOT_DIR_NAME);
+        dir_unlock(dir);
+        return -1;
+    }
+    if (find_file_in_directory(dir_block, name, loc) != 0) {
+        printf("File not found\n");
+        dir_unlock(dir);
+        return -1;
+    }
+    file_lock(loc, exclusive);
+    pthread_rwlock_unlock(dir);
+    
+    int result = dir_read_entry(loc, entry);
+    if (result == 0 && entry->type != TYPE_FILE) {
+        printf("Not a file\n");
+        result = -1;
+    }
+    if (result != 0) {
+        pthread_rwlock_unlock(file_lock_for(loc));
+        pthread_rwlock_unlock(&fs.volume_lock);
+        return -1;
+    }
+    return 0;
+}
+
+static void file_unlock(const DirEntryLoc* loc) {
+    pthread_rwlock_unlock(file_lock_for(loc));
+    pthread_rwlock_unlock(&fs.volume_lock);
+}
+
+// Compression
+//
+// A file with ATTR_COMPRESSED set keeps its data as a stream of chunks of
+// COMPRESS_CHUNK_SIZE bytes (the last one shorter), each compressed on
+// its own in the LZ4 block format, or stored as is when that would not
+// save space. Chunks are packed end to end across the file's blocks,
+// followed by an index holding each chunk's stored length (CHUNK_STORED
+// marks an uncompressed one), and the last block ends with a
+// CompressTrailer that locates the index. file_size stays the size of the
+// uncompressed data. A read decompresses only the chunks it overlaps.
+#define ATTR_COMPRESSED 0x01       // DirectoryEntry.attributes: data stored as compressed chunks
+#define COMPRESS_CHUNK_SIZE 16384
+#define COMPRESS_MAGIC 0x315A434C  // "LCZ1"
+#define CHUNK_STORED 0x80000000u   // Index flag: chunk kept uncompressed
+#define LZ4_HASH_BITS 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5        // The format ends every block with literals
+#define LZ4_MATCH_LIMIT 12         // No match may start closer than this to the end
+
+typedef struct {
+    uint32_t magic;
+    uint32_t chunk_size;
+    uint32_t chunk_count;
+    uint32_t index_offset;   // Stream offset of the index
+} CompressTrailer;
+
+static uint32_t load32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// Appends an LZ4 length continuation (bytes of 255 and a remainder)
+static int lz4_put_length(uint8_t* dst, uint32_t* op, uint32_t capacity, uint32_t length) {
+    while (length >= 255) {
+        if (*op >= capacity) {
+            return -1;
+        }
+        dst[(*op)++] = 255;
+        length -= 255;
+    }
+    if (*op >= capacity) {
+        return -1;
+    }
+    dst[(*op)++] = (uint8_t)length;
+    return 0;
+}
+
+// Writes one sequence: 'literals' bytes from 'literals_ptr' and, unless
+// match_length is 0, a match 'offset' bytes back
+static int lz4_put_sequence(uint8_t* dst, uint32_t* op, uint32_t capacity, const uint8_t* literals_ptr,
+                            uint32_t literals, uint32_t offset, uint32_t match_length) {
+    uint32_t match_code = match_length ? match_length - LZ4_MIN_MATCH : 0;
+    if (*op >= capacity) {
+        return -1;
+    }
+    dst[(*op)++] = (uint8_t)((literals < 15 ? literals : 15) << 4 | (match_code < 15 ? match_code : 15));
+    if (literals >= 15 && lz4_put_length(dst, op, capacity, literals - 15) != 0) {
+        return -1;
+    }
+    if (*op + literals > capacity) {
+        return -1;
+    }
+    memcpy(dst + *op, literals_ptr, literals);
+    *op += literals;
+    
+    if (match_length) {
+        if (*op + 2 > capacity) {
+            return -1;
+        }
+        dst[(*op)++] = (uint8_t)offset;
+        dst[(*op)++] = (uint8_t)(offset >> 8);
+        if (match_code >= 15 && lz4_put_length(dst, op, capacity, match_code - 15) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Greedy single-pass LZ4 compressor with a hash table of recent
+// positions. Returns the compressed length, or 0 if it would not fit in
+// 'capacity' bytes.
+static uint32_t lz4_compress(const uint8_t* src, uint32_t length, uint8_t* dst, uint32_t capacity) {
+    uint32_t table[1 << LZ4_HASH_BITS];  // Position + 1, 0 for none
+    uint32_t ip = 0;
+    uint32_t anchor = 0;
+    uint32_t op = 0;
+    
+    memset(table, 0, sizeof(table));
+    while (length > LZ4_MATCH_LIMIT && ip < length - LZ4_MATCH_LIMIT) {
+        uint32_t sequence = load32(src + ip);
+        uint32_t hash = sequence * 2654435761u >> (32 - LZ4_HASH_BITS);
+        uint32_t candidate = table[hash];
+        table[hash] = ip + 1;
+    
+        if (candidate == 0 || ip - (candidate - 1) > 65535 || load32(src + candidate - 1) != sequence) {
+            ip++;
+            continue;
+        }
+    
+        uint32_t match = candidate - 1;
+        uint32_t match_length = LZ4_MIN_MATCH;
+        while (ip + match_length < length - LZ4_LAST_LITERALS && src[match + match_length] == src[ip + match_length]) {
+            match_length++;
+        }
+        if (lz4_put_sequence(dst, &op, capacity, src + anchor, ip - anchor, ip - match, match_length) != 0) {
+            return 0;
+        }
+        ip += match_length;
+        anchor = ip;
+    }
+    
+    if (lz4_put_sequence(dst, &op, capacity, src + anchor, length - anchor, 0, 0) != 0) {
+        return 0;
+    }
+    return op;
+}
+
+// Decompresses an LZ4 block that must expand to exactly 'length' bytes.
+// Every length and offset is checked, so a damaged chunk fails instead of
+// writing outside 'dst'.
+static int lz4_decompress(const uint8_t* src, uint32_t src_length, uint8_t* dst, uint32_t length) {
+    uint32_t ip = 0;
+    uint32_t op = 0;
+    
+    while (ip < src_length) {
+        uint8_t token = src[ip++];
+        uint32_t literals = token >> 4;
+        if (literals == 15) {
+            uint8_t more;
+            do {
+                if (ip >= src_length) {
+                    return -1;
+                }
+                more = src[ip++];
+                literals += more;
+            } while (more == 255);
+        }
+        if (literals > src_length - ip || literals > length - op) {
+            return -1;
+        }
+        memcpy(dst + op, src + ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == src_length) {
+            break;
+        }
+    
+        if (src_length - ip < 2) {
+            return -1;
+        }
+        uint32_t offset = src[ip] | (uint32_t)src[ip + 1] << 8;
+        ip += 2;
+        uint32_t match_length = (token & 15) + LZ4_MIN_MATCH;
+        if ((token & 15) == 15) {
+            uint8_t more;
+            do {
+                if (ip >= src_length) {
+                    return -1;
+                }
+                more = src[ip++];
+                match_length += more;
+            } while (more == 255);
+        }
+        if (offset == 0 || offset > op || match_length > length - op) {
+            return -1;
+        }
+        // Byte by byte: the match may overlap the bytes it produces
+        for (uint32_t i = 0; i < match_length; i++, op++) {
+            dst[op] = dst[op - offset];
+        }
+    }
+    return op == length ? 0 : -1;
+}
+
+// File handles
+//
+// fs_open() resolves a name once and returns a small integer naming a slot
+// in fs.handles. The slot keeps a copy of the directory entry and an
+// extent map of the file's chain: one (logical, start, length) entry per
+// physically consecutive run, so a contiguous file of any size is a single
+// entry. The map is built from the FAT when the file is opened and kept
+// covering the whole chain; finding the block at an offset is a binary
+// search, and a contiguous run is read off an extent instead of following
+// per-block links. The FAT stays the only on-disk record of the chain.
+// fs_pwrite() touches only the blocks in the written range and links new
+// blocks after the current end of the chain.
+//
+// Handles are released only with their file locked exclusively (close,
+// delete) or the volume locked (unmount), so a handle found under a file
+// lock stays valid until that lock is dropped. Maps change only with the
+// file locked exclusively, so readers holding it shared may share them.
+static FileHandle* handle_get(int fd) {
+    if (fd < 0 || fd >= MAX_OPEN_FILES || !fs.handles[fd].in_use) {
+        return NULL;
+    }
+    return &fs.handles[fd];
+}
+
+static int same_location(const DirEntryLoc* a, const DirEntryLoc* b) {
+    return a->block == b->block && a->offset == b->offset;
+}
+
+static void handle_release(FileHandle* handle) {
+    free(handle->extents);
+    free(handle->chunks);
+    memset(handle, 0, sizeof(FileHandle));
+}
+
+// Adds 'block' as the next block of the file, growing the last extent
+// when it follows on physically
+static int handle_map_append(FileHandle* handle, uint32_t block) {
+    FileExtent* last = handle->extent_count ? &handle->extents[handle->extent_count - 1] : NULL;
+    if (last && block == last->start + last->length) {
+        last->length++;
+        handle->mapped_blocks++;
+        return 0;
+    }
+    
+    if (handle->extent_count == handle->extent_capacity) {
+        uint32_t capacity = handle->extent_capacity ? handle->extent_capacity * 2 : 4;
+        FileExtent* extents = realloc(handle->extents, capacity * sizeof(FileExtent));
+        if (!extents) {
+            return -1;
+        }
+        handle->extents = extents;
+        handle->extent_capacity = capacity;
+    }
+    handle->extents[handle->extent_count++] = (FileExtent){ handle->mapped_blocks, block, 1 };
+    handle->mapped_blocks++;
+    return 0;
+}
+
+// Forgets every block from logical block 'valid_blocks' on
+static void handle_map_trim(FileHandle* handle, uint32_t valid_blocks) {
+    if (handle->unshared > valid_blocks) {
+        handle->unshared = valid_blocks;
+    }
+    while (handle->extent_count > 0 && handle->extents[handle->extent_count - 1].logical >= valid_blocks) {
+        handle->extent_count--;
+    }
+    if (handle->extent_count > 0) {
+        FileExtent* last = &handle->extents[handle->extent_count - 1];
+        if (last->logical + last->length > valid_blocks) {
+            last->length = valid_blocks - last->logical;
+        }
+        handle->mapped_blocks = last->logical + last->length;
+    } else {
+        handle->mapped_blocks = 0;
+    }
+}
+
+// Extends the map along the FAT from its last block to the end of the
+// chain. The chain is cut off at the volume size, so a corrupt, looping
+// chain cannot grow the map forever.
+static int handle_map_extend(FileHandle* handle) {
+    uint32_t next;
+    if (handle->extent_count == 0) {
+        next = handle->entry.first_block;
+    } else {
+        const FileExtent* last = &handle->extents[handle->extent_count - 1];
+        next = fat_get(last->start + last->length - 1);
+    }
+    
+    while (next < FAT_ENTRY_BAD && handle->mapped_blocks < fs.boot_sector.total_blocks) {
+        if (handle_map_append(handle, next) != 0) {
+            printf("Error: Cannot allocate extent map\n");
+            return -1;
+        }
+        next = fat_get(next);
+    }
+    return 0;
+}
+
+// Finds the physical block holding logical block 'index' and how many
+// blocks from there on are physically consecutive, up to 'max_run'.
+// Returns -1 when the chain does not reach 'index'.
+static int handle_run_at(const FileHandle* handle, uint32_t index, uint32_t max_run, uint32_t* block, uint32_t* run) {
+    if (index >= handle->mapped_blocks) {
+        return -1;
+    }
+    
+    // Last extent starting at or before 'index'
+    uint32_t low = 0;
+    uint32_t high = handle->extent_count - 1;
+    while (low < high) {
+        uint32_t middle = (low + high + 1) / 2;
+        if (handle->extents[middle].logical <= index) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    
+    const FileExtent* extent = &handle->extents[low];
+    uint32_t left = extent->length - (index - extent->logical);
+    *block = extent->start + (index - extent->logical);
+    *run = left < max_run ? left : max_run;
+    return 0;
+}
+
+static int handle_block_at(const FileHandle* handle, uint32_t index, uint32_t* block) {
+    uint32_t run;
+    return handle_run_at(handle, index, 1, block, &run);
+}
+
+// Reads 'length' bytes at byte 'offset' of the file's block stream
+static int handle_stream_read(const FileHandle* handle, uint64_t offset, uint32_t length, uint8_t* out) {
+    uint8_t block_data[fs.block_size];
+    
+    while (length > 0) {
+        uint32_t index = (uint32_t)(offset / fs.block_size);
+        uint32_t block_offset = (uint32_t)(offset % fs.block_size);
+        uint32_t whole_blocks = block_offset == 0 ? length / fs.block_size : 0;
+        uint32_t block;
+        uint32_t run;
+        if (handle_run_at(handle, index, whole_blocks ? whole_blocks : 1, &block, &run) != 0) {
+            return -1;
+        }
+    
+        uint32_t done;
+        if (whole_blocks > 0) {
+            if (read_blocks(block, run, out) != 0) {
+                return -1;
+            }
+            done = run * fs.block_size;
+        } else {
+            if (read_block(block, block_data) != 0) {
+                return -1;
+            }
+            done = fs.block_size - block_offset < length ? fs.block_size - block_offset : length;
+            memcpy(out, block_data + block_offset, done);
+        }
+        out += done;
+        offset += done;
+        length -= done;
+    }
+    return 0;
+}
+
+// Loads the chunk index of a compressed file into its handle, or drops
+// the old one. Called whenever the map is rebuilt.
+static int handle_load_chunks(FileHandle* handle) {
+    free(handle->chunks);
+    handle->chunks = NULL;
+    handle->chunk_count = 0;
+    if (!(handle->entry.attributes & ATTR_COMPRESSED) || handle->entry.file_size == 0) {
+        return 0;
+    }
+    
+    uint32_t chunk_count = (handle->entry.file_size + COMPRESS_CHUNK_SIZE - 1) / COMPRESS_CHUNK_SIZE;
+    uint64_t stream_size = (uint64_t)handle->mapped_blocks * fs.block_size;
+    CompressTrailer trailer;
+    if (stream_size < sizeof(CompressTrailer) ||
+        handle_stream_read(handle, stream_size - sizeof(CompressTrailer), sizeof(CompressTrailer),
+                           (uint8_t*)&trailer) != 0 ||
+        trailer.magic != COMPRESS_MAGIC || trailer.chunk_size != COMPRESS_CHUNK_SIZE ||
+        trailer.chunk_count != chunk_count ||
+        (uint64_t)trailer.index_offset + chunk_count * sizeof(uint32_t) > stream_size - sizeof(CompressTrailer)) {
+        printf("Error: Damaged compressed file '%s'\n", handle->entry.filename);
+        return -1;
+    }
+    
+    // Two words per chunk: its stream offset, then its stored length and flag
+    uint32_t* chunks = malloc((size_t)chunk_count * 2 * sizeof(uint32_t));
+    if (!chunks || handle_stream_read(handle, trailer.index_offset, chunk_count * sizeof(uint32_t),
+                                      (uint8_t*)(chunks + chunk_count)) != 0) {
+        printf("Error: Cannot read chunk index of '%s'\n", handle->entry.filename);
+        free(chunks);
+        return -1;
+    }
+    uint64_t offset = 0;
+    for (uint32_t i = 0; i < chunk_count; i++) {
+        uint32_t stored = chunks[chunk_count + i];
+        chunks[2 * i] = (uint32_t)offset;
+        chunks[2 * i + 1] = stored;
+        offset += stored & ~CHUNK_STORED;
+        if (offset > trailer.index_offset || (stored & ~CHUNK_STORED) > COMPRESS_CHUNK_SIZE) {
+            printf("Error: Damaged compressed file '%s'\n", handle->entry.filename);
+            free(chunks);
+            return -1;
+        }
+    }
+    handle->chunks = chunks;
+    handle->chunk_count = chunk_count;
+    return 0;
+}
+
+// Decompresses chunk 'chunk' into 'plain'. 'packed' holds
+// COMPRESS_CHUNK_SIZE bytes. Returns the chunk's length, or -1.
+static int handle_read_chunk(const FileHandle* handle, uint32_t chunk, uint8_t* plain, uint8_t* packed) {
+    uint32_t start = chunk * COMPRESS_CHUNK_SIZE;
+    uint32_t length = handle->entry.file_size - start < COMPRESS_CHUNK_SIZE ?
+                      handle->entry.file_size - start : COMPRESS_CHUNK_SIZE;
+    uint32_t stored = handle->chunks[2 * chunk + 1];
+    uint32_t stored_length = stored & ~CHUNK_STORED;
+    
+    if (stored & CHUNK_STORED) {
+        if (stored_length != length || handle_stream_read(handle, handle->chunks[2 * chunk], length, plain) != 0) {
+            return -1;
+        }
+        return (int)length;
+    }
+    if (handle_stream_read(handle, handle->chunks[2 * chunk], stored_length, packed) != 0 ||
+        lz4_decompress(packed, stored_length, plain, length) != 0) {
+        printf("Error: Cannot decompress chunk %u of '%s'\n", chunk, handle->entry.filename);
+        return -1;
+    }
+    return (int)length;
+}
+
+// Sets up 'scratch' as an unlisted handle on a file, for operations that
+// want the extent map of a file no handle is open on. The caller ends
+// with handle_release().
+static int handle_scratch(FileHandle* scratch, const DirEntryLoc* loc, const DirectoryEntry* entry) {
+    memset(scratch, 0, sizeof(FileHandle));
+    scratch->in_use = 1;
+    scratch->loc = *loc;
+    scratch->entry = *entry;
+    if (handle_map_extend(scratch) != 0) {
+        return -1;
+    }
+    return handle_load_chunks(scratch);
+}
+
+void handle_close_all() {
+    pthread_mutex_lock(&fs.handle_lock);
+    for (int fd = 0; fd < MAX_OPEN_FILES; fd++) {
+        handle_release(&fs.handles[fd]);
+    }
+    pthread_mutex_unlock(&fs.handle_lock);
+}
+
+// Returns an open handle on the file whose record is at 'loc', if any
+static FileHandle* handle_for(const DirEntryLoc* loc) {
+    FileHandle* found = NULL;
+    pthread_mutex_lock(&fs.handle_lock);
+    for (int fd = 0; fd < MAX_OPEN_FILES && !found; fd++) {
+        if (fs.handles[fd].in_use && same_location(&fs.handles[fd].loc, loc)) {
+            found = &fs.handles[fd];
+        }
+    }
+    pthread_mutex_unlock(&fs.handle_lock);
+    return found;
+}
+
+// Returns a handle on the file behind 'loc' with its extent map: an open
+// one if there is one, otherwise 'scratch', mapped now. NULL if the map
+// cannot be built. The caller releases 'scratch' either way.
+static FileHandle* handle_for_map(const DirEntryLoc* loc, const DirectoryEntry* entry, FileHandle* scratch) {
+    FileHandle* handle = handle_for(loc);
+    if (handle) {
+        memset(scratch, 0, sizeof(FileHandle));
+        return handle;
+    }
+    return handle_scratch(scratch, loc, entry) == 0 ? scratch : NULL;
+}
+
+// Takes the volume lock shared and the lock of the file 'fd' is open on,
+// then checks the handle was not released while waiting. On success the
+// caller ends with file_unlock(loc).
+static FileHandle* handle_acquire(int fd, int exclusive, DirEntryLoc* loc) {
+    pthread_rwlock_rdlock(&fs.volume_lock);
+    pthread_mutex_lock(&fs.handle_lock);
+    FileHandle* handle = handle_get(fd);
+    if (handle) {
+        *loc = handle->loc;
+    }
+    pthread_mutex_unlock(&fs.handle_lock);
+    
+    if (handle) {
+        file_lock(loc, exclusive);
+        if (!handle->in_use || !same_location(&handle->loc, loc)) {
+            pthread_rwlock_unlock(file_lock_for(loc));
+            handle = NULL;
+        }
+    }
+    if (!handle) {
+        printf("Bad file handle\n");
+        pthread_rwlock_unlock(&fs.volume_lock);
+    }
+    return handle;
+}
+
+// Called after any change to a file's entry so every open handle on it
+// sees the new size and chain. 'entry' NULL means the file was deleted and
+// its handles are closed. Only the first 'valid_blocks' blocks of each
+// extent map survive: 0 after the chain was rebuilt, UINT32_MAX when
+// blocks were only added at the end. The maps are then extended to the
+// new end of the chain.
+void handle_update(const DirEntryLoc* loc, const DirectoryEntry* entry, uint32_t valid_blocks) {
+    pthread_mutex_lock(&fs.handle_lock);
+    for (int fd = 0; fd < MAX_OPEN_FILES; fd++) {
+        FileHandle* handle = &fs.handles[fd];
+        if (!handle->in_use || !same_location(&handle->loc, loc)) {
+            continue;
+        }
+        if (!entry) {
+            handle_release(handle);
+            continue;
+        }
+        handle->entry = *entry;
+        handle_map_trim(handle, valid_blocks);
+        handle_map_extend(handle);
+        handle_load_chunks(handle);
+    }
+    pthread_mutex_unlock(&fs.handle_lock);
+}
+
+// Forgets what every open handle knew to be unshared, after share counts
+// were raised
+static void handle_reset_unshared() {
+    pthread_mutex_lock(&fs.handle_lock);
+    for (int fd = 0; fd < MAX_OPEN_FILES; fd++) {
+        fs.handles[fd].unshared = 0;
+    }
+    pthread_mutex_unlock(&fs.handle_lock);
+}
+
+// First logical block below 'limit' that the file shares with another
+// chain, or 'limit' (at most the mapped length) if there is none. Blocks
+// found unshared are remembered: only a snapshot, which resets every
+// handle, can make them shared again.
+static uint32_t handle_shared_from(FileHandle* handle, uint32_t limit) {
+    if (limit > handle->mapped_blocks) {
+        limit = handle->mapped_blocks;
+    }
+    if (!fs.shares) {
+        return limit;
+    }
+    for (uint32_t index = handle->unshared; index < limit; ) {
+        uint32_t block;
+        uint32_t run;
+        handle_run_at(handle, index, limit - index, &block, &run);
+        for (uint32_t i = 0; i < run; i++) {
+            if (share_count(block + i) > 0) {
+                handle->unshared = index + i;
+                return index + i;
+            }
+        }
+        index += run;
+    }
+    if (limit > handle->unshared) {
+        handle->unshared = limit;
+    }
+    return limit;
+}
+
+// Copy-on-write: gives the file blocks of its own for every block up to
+// logical block 'last' it does not own alone, so they can be changed in
+// place. The chain is copied from its first shared block to 'last', and
+// the copy linked to the rest, which stays shared. The caller flushes the
+// FAT and writes the entry, whose first block may have changed.
+static int handle_unshare(FileHandle* handle, uint32_t last) {
+    uint32_t first = handle_shared_from(handle, last + 1);
+    if (first > last) {
+        return 0;
+    }
+    
+    uint32_t prev = FAT_ENTRY_EOF;
+    uint32_t old_first;
+    uint32_t old_last;
+    if ((first > 0 && handle_block_at(handle, first - 1, &prev) != 0) ||
+        handle_block_at(handle, first, &old_first) != 0 || handle_block_at(handle, last, &old_last) != 0) {
+        return -1;
+    }
+    uint32_t copy;
+    if (allocate_extent(last - first + 1, prev != FAT_ENTRY_EOF ? prev : handle->loc.block, &copy) != 0) {
+        printf("No free space available\n");
+        return -1;
+    }
+    
+    // Copy run by run, a run ending where either chain jumps
+    uint8_t* buffer = malloc((size_t)fs.readahead_blocks * fs.block_size);
+    uint32_t target = copy;
+    uint32_t copy_last = copy;
+    int result = buffer ? 0 : -1;
+    for (uint32_t index = first; result == 0 && index <= last; ) {
+        uint32_t block;
+        uint32_t run;
+        uint32_t max_run = last - index + 1 < fs.readahead_blocks ? last - index + 1 : fs.readahead_blocks;
+        result = handle_run_at(handle, index, max_run, &block, &run);
+        uint32_t length = 1;
+        while (result == 0 && length < run && fat_get(target + length - 1) == target + length) {
+            length++;
+        }
+        if (result == 0) {
+            result = read_blocks(block, length, buffer) == 0 && write_blocks(target, length, buffer) == 0 ? 0 : -1;
+        }
+        index += length;
+        copy_last = target + length - 1;
+        target = fat_get(copy_last);
+    }
+    free(buffer);
+    if (result != 0) {
+        printf("Error: Cannot copy shared blocks\n");
+        free_blocks(copy);
+        return -1;
+    }
+    
+    // The rest gains its new owner before the old one lets go of the copied
+    // part, so no other file can see it unowned in between
+    uint32_t rest = fat_get(old_last);
+    if (rest < FAT_ENTRY_BAD) {
+        share_add(rest);
+        fat_set(copy_last, rest);
+    }
+    if (first == 0) {
+        handle->entry.first_block = copy;
+    } else {
+        fat_set(prev, copy);
+    }
+    free_blocks(old_first);
+    
+    // Listed handles are updated by handle_update(); a scratch one is not
+    handle_update(&handle->loc, &handle->entry, first);
+    handle_map_trim(handle, first);
+    return handle_map_extend(handle);
+}
+
+// Cuts a file's chain after the blocks 'new_size' needs. When a handle is
+// open on the file its block map gives the cut point directly; otherwise
+// the chain is walked from first_block. The caller flushes the FAT.
+static int truncate_chain(DirectoryEntry* entry, uint32_t new_size, FileHandle* handle) {
+    uint32_t blocks_needed = (new_size + fs.block_size - 1) / fs.block_size;
+    uint32_t prev_block = FAT_ENTRY_EOF;
+    uint32_t current_block = entry->first_block;
+    
+    if (blocks_needed > 0) {
+        if (handle) {
+            if (handle_block_at(handle, blocks_needed - 1, &prev_block) != 0) {
+                return -1;
+            }
+            current_block = fat_get(prev_block);
+        } else {
+            for (uint32_t i = 0; i < blocks_needed && current_block < FAT_ENTRY_BAD; i++) {
+                prev_block = current_block;
+                current_block = fat_get(current_block);
+            }
+        }
+    }
+    
+    // Free remaining blocks
+    if (current_block < FAT_ENTRY_BAD) {
+        free_blocks(current_block);
+        if (prev_block != FAT_ENTRY_EOF) {
+            fat_set(prev_block, FAT_ENTRY_EOF);
+        } else {
+            entry->first_block = FAT_ENTRY_EOF;
+        }
+    }
+    return 0;
+}
+
+// Shrinks the file behind 'loc' and writes its entry. Sizes above the
+// current one are rejected, as growing is done by writing.
+static int truncate_entry(const DirEntryLoc* loc, DirectoryEntry* entry, uint32_t new_size) {
+    if (new_size > entry->file_size) {
+        printf("New size larger than current size - use write to extend file\n");
+        return -1;
+    }
+    if (entry->attributes & ATTR_COMPRESSED) {
+        FileHandle scratch;
+        FileHandle* handle = handle_for_map(loc, entry, &scratch);
+        int result = handle ? handle_make_plain(handle) : -1;
+        if (handle) {
+            *entry = handle->entry;
+        }
+        handle_release(&scratch);
+        if (result != 0) {
+            return -1;
+        }
+    }
+    
+    // Inline data just shrinks inside its record
+    int inline_file = (entry->attributes & ATTR_INLINE) != 0;
+    
+    // The new last block gets an EOF link, so it must not be shared
+    uint32_t blocks_kept = (new_size + fs.block_size - 1) / fs.block_size;
+    if (!inline_file && fs.shares && blocks_kept > 0 &&
+        blocks_kept < (entry->file_size + fs.block_size - 1) / fs.block_size) {
+        FileHandle scratch;
+        FileHandle* handle = handle_for_map(loc, entry, &scratch);
+        int result = handle ? handle_unshare(handle, blocks_kept - 1) : -1;
+        if (handle) {
+            *entry = handle->entry;
+        }
+        handle_release(&scratch);
+        if (result != 0) {
+            fat_flush();
+            return -1;
+        }
+    }
+    if (!inline_file && truncate_chain(entry, new_size, handle_for(loc)) != 0) {
+        printf("Error: File chain shorter than file size\n");
+        return -1;
+    }
+    if (!inline_file && fat_flush() != 0) {
+        return -1;
+    }
+    
+    // Update directory entry
+    entry->file_size = new_size;
+    entry->modified_time = (uint32_t)time(NULL);
+    
+    if (dir_write_entry(loc, entry) != 0) {
+        return -1;
+    }
+    handle_update(loc, entry, (new_size + fs.block_size - 1) / fs.block_size);
+    return 0;
+}
+
+// The file is locked shared while its entry is copied and its chain mapped
+// into the handle, so no writer can change them in between
+int fs_open(const char* filename) {
+    DirEntryLoc loc;
+    DirectoryEntry entry;
+    if (file_lock_lookup(filename, 0, &loc, &entry) != 0) {
+        return -1;
+    }
+    
+    // Map the chain before the handle is listed, as other readers of the
+    // file may use a listed handle's map
+    FileHandle opened;
+    if (handle_scratch(&opened, &loc, &entry) != 0) {
+        handle_release(&opened);
+        file_unlock(&loc);
+        return -1;
+    }
+    
+    int result = -1;
+    pthread_mutex_lock(&fs.handle_lock);
+    for (int fd = 0; fd < MAX_OPEN_FILES; fd++) {
+        if (!fs.handles[fd].in_use) {
+            fs.handles[fd] = opened;
+            result = fd;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fs.handle_lock);
+    file_unlock(&loc);
+    
+    if (result < 0) {
+        handle_release(&opened);
+        printf("Too many open files\n");
+    }
+    return result;
+}
+
+int fs_close(int fd) {
+    DirEntryLoc loc;
+    FileHandle* handle = handle_acquire(fd, 1, &loc);
+    if (!handle) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&fs.handle_lock);
+    handle_release(handle);
+    pthread_mutex_unlock(&fs.handle_lock);
+    file_unlock(&loc);
+    return 0;
+}
+
+int fs_ftruncate(int fd, uint32_t new_size) {
+    DirEntryLoc loc;
+    FileHandle* handle = handle_acquire(fd, 1, &loc);
+    if (!handle) {
+        return -1;
+    }
+    
+    DirectoryEntry entry = handle->entry;
+    int result = truncate_entry(&loc, &entry, new_size);
+    file_unlock(&loc);
+    return result;
+}
+
+// Reads 'count' bytes at 'offset' of a compressed file, one chunk at a
+// time. Chunks the range covers whole are decompressed straight into the
+// caller's buffer.
+static int handle_pread_compressed(const FileHandle* handle, uint8_t* buffer, uint32_t count, uint32_t offset) {
+    uint8_t* packed = malloc(COMPRESS_CHUNK_SIZE);
+    uint8_t* plain = malloc(COMPRESS_CHUNK_SIZE);
+    int result = packed && plain ? 0 : -1;
+    uint32_t done = 0;
+    
+    while (result == 0 && done < count) {
+        uint32_t chunk = (offset + done) / COMPRESS_CHUNK_SIZE;
+        uint32_t chunk_offset = (offset + done) % COMPRESS_CHUNK_SIZE;
+        uint32_t take = COMPRESS_CHUNK_SIZE - chunk_offset < count - done ?
+                        COMPRESS_CHUNK_SIZE - chunk_offset : count - done;
+        int whole = chunk_offset == 0 && take == COMPRESS_CHUNK_SIZE;
+        if (chunk >= handle->chunk_count ||
+            handle_read_chunk(handle, chunk, whole ? buffer + done : plain, packed) < 0) {
+            printf("Error reading compressed data\n");
+            result = -1;
+            break;
+        }
+        if (!whole) {
+            memcpy(buffer + done, plain + chunk_offset, take);
+        }
+        done += take;
+    }
+    free(packed);
+    free(plain);
+    return result == 0 ? (int)done : -1;
+}
+
+// Reads up to 'count' bytes at 'offset'. Returns the number of bytes read,
+// which is short at the end of the file, or -1 on error. Whole blocks are
+// read straight into the caller's buffer, each extent (up to the
+// read-ahead size) with one request.
+static int handle_pread(const FileHandle* handle, void* buffer, uint32_t count, uint32_t offset) {
+    uint32_t file_size = handle->entry.file_size;
+    if (offset >= file_size || count == 0) {
+        return 0;
+    }
+    if (count > file_size - offset) {
+        count = file_size - offset;
+    }
+    if (handle->entry.attributes & ATTR_COMPRESSED) {
+        return handle_pread_compressed(handle, buffer, count, offset);
+    }
+    if (handle->entry.attributes & ATTR_INLINE) {
+        memcpy(buffer, handle->entry.inline_data + offset, count);
+        return (int)count;
+    }
+    
+    uint32_t index = offset / fs.block_size;
+    uint32_t block_offset = offset % fs.block_size;
+    uint32_t done = 0;
+    uint8_t block_data[fs.block_size];
+    
+    while (done < count) {
+        uint32_t whole_blocks = block_offset == 0 ? (count - done) / fs.block_size : 0;
+        uint32_t max_run = whole_blocks < fs.readahead_blocks ? whole_blocks : fs.readahead_blocks;
+        uint32_t block;
+        uint32_t run_length;
+        if (handle_run_at(handle, index, max_run ? max_run : 1, &block, &run_length) != 0) {
+            printf("Error: File chain shorter than file size\n");
+            return -1;
+        }
+    
+        // Copy straight from the mapping when the backend allows it
+        const uint8_t* data = map_block(block);
+        if (!data && whole_blocks > 0) {
+            if (read_blocks(block, run_length, (uint8_t*)buffer + done) != 0) {
+                printf("Error reading block\n");
+                return -1;
+            }
+            done += run_length * fs.block_size;
+            index += run_length;
+            continue;
+        }
+        if (!data) {
+            if (read_block(block, block_data) != 0) {
+                printf("Error reading block\n");
+                return -1;
+            }
+            data = block_data;
+        }
+    
+        uint32_t chunk = fs.block_size - block_offset;
+        if (chunk > count - done) {
+            chunk = count - done;
+        }
+        memcpy((uint8_t*)buffer + done, data + block_offset, chunk);
+        done += chunk;
+        block_offset = 0;
+        index++;
+    }
+    
+    return (int)done;
+}
+
+int fs_pread(int fd, void* buffer, uint32_t count, uint32_t offset) {
+    DirEntryLoc loc;
+    FileHandle* handle = handle_acquire(fd, 0, &loc);
+    if (!handle) {
+        return -1;
+    }
+    
+    int result = handle_pread(handle, buffer, count, offset);
+    file_unlock(&loc);
+    return result;
+}
+
+// Compressed files
+//
+// ChunkWriter turns a byte stream into the compressed layout described
+// under Compression: each full chunk is compressed as it completes and
+// the packed bytes are written out whole blocks at a time, each batch of
+// blocks allocated next to the previous one. chunk_writer_finish() adds
+// the index and trailer and returns the new chain, which the caller links
+// into the directory entry.
+typedef struct {
+    uint8_t* plain;           // The chunk being filled
+    uint32_t plain_fill;
+    uint8_t* packed;          // Compressor output for one chunk
+    uint8_t* out;             // Stream bytes not yet written
+    uint32_t out_fill;
+    uint32_t flush_size;      // Whole blocks written once this many bytes wait
+    uint32_t* lengths;        // The index: stored length of each chunk
+    uint32_t chunk_count;
+    uint32_t chunk_capacity;
+    uint64_t stream_size;
+    uint64_t plain_size;
+    uint32_t goal;
+    uint32_t first_block;
+    uint32_t last_block;
+} ChunkWriter;
+
+static int chunk_writer_init(ChunkWriter* writer, uint32_t goal) {
+    memset(writer, 0, sizeof(ChunkWriter));
+    writer->flush_size = fs.readahead_blocks * fs.block_size;
+    writer->plain = malloc(COMPRESS_CHUNK_SIZE);
+    writer->packed = malloc(COMPRESS_CHUNK_SIZE);
+    writer->out = malloc((size_t)writer->flush_size + COMPRESS_CHUNK_SIZE + fs.block_size);
+    writer->goal = goal;
+    writer->first_block = FAT_ENTRY_EOF;
+    writer->last_block = FAT_ENTRY_EOF;
+    if (!writer->plain || !writer->packed || !writer->out) {
+        printf("Error: Cannot allocate compression buffers\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Frees the buffers, and the chain too unless it was handed over
+static void chunk_writer_destroy(ChunkWriter* writer) {
+    if (writer->first_block != FAT_ENTRY_EOF) {
+        free_blocks(writer->first_block);
+    }
+    free(writer->plain);
+    free(writer->packed);
+    free(writer->out);
+    free(writer->lengths);
+}
+
+// Writes the first 'blocks' whole blocks of the output buffer to newly
+// allocated blocks at the end of the chain
+static int chunk_writer_flush(ChunkWriter* writer, uint32_t blocks) {
+    if (blocks == 0) {
+        return 0;
+    }
+    uint32_t first;
+    uint32_t goal = writer->last_block != FAT_ENTRY_EOF ? writer->last_block : writer->goal;
+    if (allocate_extent(blocks, goal, &first) != 0) {
+        printf("No free space available\n");
+        return -1;
+    }
+    if (writer->last_block == FAT_ENTRY_EOF) {
+        writer->first_block = first;
+    } else {
+        fat_set(writer->last_block, first);
+    }
+    
+    // One request per contiguous run of the new blocks
+    uint32_t run_start = first;
+    uint32_t done = 0;
+    while (done < blocks) {
+        uint32_t run_length = 1;
+        uint32_t next_block = fat_get(run_start);
+        while (done + run_length < blocks && next_block == run_start + run_length) {
+            run_length++;
+            next_block = fat_get(next_block);
+        }
+        writer->last_block = run_start + run_length - 1;
+        if (write_blocks(run_start, run_length, writer->out + (size_t)done * fs.block_size) != 0) {
+            printf("Error writing block\n");
+            return -1;
+        }
+        done += run_length;
+        run_start = next_block;
+    }
+    
+    uint32_t written = blocks * fs.block_size;
+    memmove(writer->out, writer->out + written, writer->out_fill - written);
+    writer->out_fill -= written;
+    return 0;
+}
+
+static int chunk_writer_emit(ChunkWriter* writer, const void* data, uint32_t length) {
+    const uint8_t* bytes = data;
+    while (length > 0) {
+        uint32_t room = writer->flush_size + fs.block_size - writer->out_fill;
+        uint32_t take = length < room ? length : room;
+        memcpy(writer->out + writer->out_fill, bytes, take);
+        writer->out_fill += take;
+        writer->stream_size += take;
+        bytes += take;
+        length -= take;
+        if (writer->out_fill >= writer->flush_size &&
+            chunk_writer_flush(writer, writer->out_fill / fs.block_size) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Compresses the filled chunk and queues it
+static int chunk_writer_seal(ChunkWriter* writer) {
+    if (writer->chunk_count == writer->chunk_capacity) {
+        uint32_t capacity = writer->chunk_capacity ? writer->chunk_capacity * 2 : 64;
+        uint32_t* lengths = realloc(writer->lengths, capacity * sizeof(uint32_t));
+        if (!lengths) {
+            printf("Error: Cannot allocate chunk index\n");
+            return -1;
+        }
+        writer->lengths = lengths;
+        writer->chunk_capacity = capacity;
+    }
+    
+    uint32_t packed = lz4_compress(writer->plain, writer->plain_fill, writer->packed, writer->plain_fill - 1);
+    int result = packed ? chunk_writer_emit(writer, writer->packed, packed)
+                        : chunk_writer_emit(writer, writer->plain, writer->plain_fill);
+    writer->lengths[writer->chunk_count++] = packed ? packed : writer->plain_fill | CHUNK_STORED;
+    writer->plain_fill = 0;
+    return result;
+}
+
+static int chunk_writer_write(ChunkWriter* writer, const void* data, uint32_t length) {
+    const uint8_t* bytes = data;
+    while (length > 0) {
+        uint32_t take = COMPRESS_CHUNK_SIZE - writer->plain_fill;
+        take = length < take ? length : take;
+        memcpy(writer->plain + writer->plain_fill, bytes, take);
+        writer->plain_fill += take;
+        writer->plain_size += take;
+        bytes += take;
+        length -= take;
+        if (writer->plain_fill == COMPRESS_CHUNK_SIZE && chunk_writer_seal(writer) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Writes the last chunk, the index and the trailer. The chain is then the
+// caller's, in *first_block (EOF for an empty file).
+static int chunk_writer_finish(ChunkWriter* writer, uint32_t* first_block) {
+    if (writer->plain_fill > 0 && chunk_writer_seal(writer) != 0) {
+        return -1;
+    }
+    
+    if (writer->chunk_count > 0) {
+        CompressTrailer trailer = { COMPRESS_MAGIC, COMPRESS_CHUNK_SIZE, writer->chunk_count,
+                                    (uint32_t)writer->stream_size };
+        if (writer->stream_size + (uint64_t)writer->chunk_count * sizeof(uint32_t) + sizeof(trailer) > UINT32_MAX ||
+            chunk_writer_emit(writer, writer->lengths, writer->chunk_count * sizeof(uint32_t)) != 0) {
+            return -1;
+        }
+    
+        // Zeros up to where the trailer ends a block
+        uint8_t zeros[sizeof(CompressTrailer)] = { 0 };
+        while ((writer->stream_size + sizeof(trailer)) % fs.block_size != 0) {
+            uint32_t gap = fs.block_size - (uint32_t)((writer->stream_size + sizeof(trailer)) % fs.block_size);
+            if (chunk_writer_emit(writer, zeros, gap < sizeof(zeros) ? gap : sizeof(zeros)) != 0) {
+                return -1;
+            }
+        }
+        if (chunk_writer_emit(writer, &trailer, sizeof(trailer)) != 0 ||
+            chunk_writer_flush(writer, writer->out_fill / fs.block_size) != 0) {
+            return -1;
+        }
+    }
+    
+    *first_block = writer->first_block;
+    writer->first_block = FAT_ENTRY_EOF;
+    return 0;
+}
+
+// Points the entry at 'first_block', a chain holding 'size' bytes in the
+// layout 'attributes' says, and frees the old chain. The caller holds the
+// file locked exclusively.
+static int entry_swap_chain(const DirEntryLoc* loc, DirectoryEntry* entry, uint32_t first_block, uint32_t size,
+                            uint8_t attributes) {
+    // Write the new chain before the directory entry that points into it
+    if (fat_flush() != 0) {
+        return -1;
+    }
+    uint32_t old_first_block = entry->first_block;
+    entry->first_block = first_block;
+    entry->file_size = size;
+    entry->attributes = (entry->attributes & ~(ATTR_COMPRESSED | ATTR_INLINE)) | (attributes & ATTR_COMPRESSED);
+    entry->modified_time = (uint32_t)time(NULL);
+    if (dir_write_entry(loc, entry) != 0) {
+        return -1;
+    }
+    handle_update(loc, entry, 0);
+    if (old_first_block != FAT_ENTRY_EOF) {
+        free_blocks(old_first_block);
+    }
+    return fat_flush();
+}
+
+// Rewrites the file mapped by 'handle' in the other layout: compressed
+// when 'compress' is set, plain otherwise. 'handle' is updated too, even
+// if it is a scratch handle.
+static int handle_convert(FileHandle* handle, int compress) {
+    uint32_t size = handle->entry.file_size;
+    int compressed = (handle->entry.attributes & ATTR_COMPRESSED) != 0;
+    uint8_t* plain = malloc(COMPRESS_CHUNK_SIZE);
+    uint8_t* packed = malloc(COMPRESS_CHUNK_SIZE);
+    ChunkWriter writer;
+    int result = plain && packed ? 0 : -1;
+    uint32_t first_block = FAT_ENTRY_EOF;
+    
+    // Plain files are written in whole blocks, so the staging buffer holds
+    // a chunk plus the partial block left over from the previous one
+    uint8_t* staged = malloc(COMPRESS_CHUNK_SIZE + 2 * fs.block_size);
+    uint32_t staged_fill = 0;
+    uint32_t written_blocks = 0;
+    FileHandle target;
+    memset(&target, 0, sizeof(FileHandle));
+    memset(&writer, 0, sizeof(ChunkWriter));
+    writer.first_block = FAT_ENTRY_EOF;
+    
+    if (result == 0 && compress) {
+        result = chunk_writer_init(&writer, handle->loc.block);
+    } else if (result == 0) {
+        uint32_t blocks = (size + fs.block_size - 1) / fs.block_size;
+        target.entry.first_block = FAT_ENTRY_EOF;
+        result = staged ? 0 : -1;
+        if (result == 0 && blocks > 0) {
+            result = allocate_extent(blocks, handle->loc.block, &target.entry.first_block);
+            if (result != 0) {
+                printf("No free space available\n");
+            } else {
+                result = handle_map_extend(&target);
+            }
+        }
+        first_block = target.entry.first_block;
+    }
+    
+    for (uint32_t offset = 0; result == 0 && offset < size; offset += COMPRESS_CHUNK_SIZE) {
+        uint32_t length = size - offset < COMPRESS_CHUNK_SIZE ? size - offset : COMPRESS_CHUNK_SIZE;
+        int got = compressed ? handle_read_chunk(handle, offset / COMPRESS_CHUNK_SIZE, plain, packed)
+                             : handle_pread(handle, plain, length, offset);
+        if (got != (int)length) {
+            result = -1;
+            break;
+        }
+        if (compress) {
+            result = chunk_writer_write(&writer, plain, length);
+            continue;
+        }
+    
+        memcpy(staged + staged_fill, plain, length);
+        staged_fill += length;
+        if (offset + length == size) {
+            memset(staged + staged_fill, 0, fs.block_size - 1);
+            staged_fill = (staged_fill + fs.block_size - 1) / fs.block_size * fs.block_size;
+        }
+        uint32_t blocks = staged_fill / fs.block_size;
+        for (uint32_t done = 0; result == 0 && done < blocks; ) {
+            uint32_t block;
+            uint32_t run;
+            result = handle_run_at(&target, written_blocks, blocks - done, &block, &run);
+            if (result == 0) {
+                result = write_blocks(block, run, staged + (size_t)done * fs.block_size);
+            }
+            done += run;
+            written_blocks += run;
+        }
+        memmove(staged, staged + blocks * fs.block_size, staged_fill - blocks * fs.block_size);
+        staged_fill -= blocks * fs.block_size;
+    }
+    
+    if (result == 0 && compress) {
+        result = chunk_writer_finish(&writer, &first_block);
+    }
+    if (result == 0) {
+        result = entry_swap_chain(&handle->loc, &handle->entry, first_block, size, compress ? ATTR_COMPRESSED : 0);
+    } else if (!compress && first_block != FAT_ENTRY_EOF) {
+        free_blocks(first_block);
+        fat_flush();
+    }
+    if (result == 0) {
+        // Listed handles were updated by handle_update(); a scratch one is not
+        handle_map_trim(handle, 0);
+        handle_map_extend(handle);
+        result = handle_load_chunks(handle);
+    }
+    
+    if (compress) {
+        chunk_writer_destroy(&writer);
+    }
+    free(target.extents);
+    free(staged);
+    free(plain);
+    free(packed);
+    return result;
+}
+
+// In-place changes (pwrite, append, truncate) work on the plain layout; a
+// compressed file is stored plain again first, until 'compress' is run
+// on it again
+int handle_make_plain(FileHandle* handle) {
+    if (!(handle->entry.attributes & ATTR_COMPRESSED)) {
+        return 0;
+    }
+    return handle_convert(handle, 0);
+}
+
+// Inline files
+//
+// Files of up to INLINE_MAX_SIZE bytes keep their data in their directory
+// record (ATTR_INLINE) while it has room, so creating, writing and reading
+// one touches a single directory block. A record has the slack it was
+// given when it was split off; data outgrowing it moves to a block.
+
+// Stores 'size' bytes as the whole contents of the file, inline, and frees
+// its old chain. Returns 1, changing nothing, when they do not fit.
+static int entry_store_inline(const DirEntryLoc* loc, DirectoryEntry* entry, const void* data, uint32_t size) {
+    if (size > INLINE_MAX_SIZE || (entry->attributes & ATTR_COMPRESSED)) {
+        return 1;
+    }
+    DirectoryEntry updated = *entry;
+    memmove(updated.inline_data, data, size);
+    updated.first_block = FAT_ENTRY_EOF;
+    updated.file_size = size;
+    updated.attributes |= ATTR_INLINE;
+    updated.modified_time = (uint32_t)time(NULL);
+    
+    int result = dir_write_entry(loc, &updated);
+    if (result != 0) {
+        return result;
+    }
+    uint32_t old_first_block = entry->first_block;
+    *entry = updated;
+    handle_update(loc, entry, 0);
+    if (old_first_block != FAT_ENTRY_EOF) {
+        free_blocks(old_first_block);
+        return fat_flush();
+    }
+    return 0;
+}
+
+// Moves an inline file's data out to a block of its own. 'handle' is
+// updated too, even if it is a scratch handle.
+static int handle_make_blocks(FileHandle* handle) {
+    DirectoryEntry* entry = &handle->entry;
+    if (!(entry->attributes & ATTR_INLINE)) {
+        return 0;
+    }
+    
+    uint32_t first_block = FAT_ENTRY_EOF;
+    if (entry->file_size > 0) {
+        uint8_t block_data[fs.block_size];
+        memset(block_data, 0, fs.block_size);
+        memcpy(block_data, entry->inline_data, entry->file_size);
+        if (allocate_extent(1, handle->loc.block, &first_block) != 0) {
+            printf("No free space available\n");
+            return -1;
+        }
+        if (write_block(first_block, block_data) != 0) {
+            free_blocks(first_block);
+            fat_flush();
+            return -1;
+        }
+    }
+    if (entry_swap_chain(&handle->loc, entry, first_block, entry->file_size, 0) != 0) {
+        return -1;
+    }
+    handle_map_trim(handle, 0);
+    return handle_map_extend(handle);
+}
+
+// Writes 'count' bytes at 'offset', overwriting in place and extending the
+// file when the range ends past it. A gap between the old end and 'offset'
+// reads back as zeros. Returns 'count', or -1 on error.
+static int handle_pwrite(FileHandle* handle, const void* buffer, uint32_t count, uint32_t offset) {
+    if (count == 0) {
+        return 0;
+    }
+    
+    uint64_t end = (uint64_t)offset + count;
+    if (end > UINT32_MAX) {
+        printf("File too large\n");
+        return -1;
+    }
+    if (handle_make_plain(handle) != 0) {
+        return -1;
+    }
+    
+    DirectoryEntry* entry = &handle->entry;
+    uint32_t old_size = entry->file_size;
+    
+    // A small file stays inline while the result fits its record
+    int inline_file = (entry->attributes & ATTR_INLINE) || entry->first_block == FAT_ENTRY_EOF;
+    if (inline_file && end <= INLINE_MAX_SIZE) {
+        uint8_t data[INLINE_MAX_SIZE];
+        uint32_t kept = entry->attributes & ATTR_INLINE ? old_size : 0;
+        memcpy(data, entry->inline_data, kept);
+        if (offset > kept) {
+            memset(data + kept, 0, offset - kept);
+        }
+        memcpy(data + offset, buffer, count);
+        int result = entry_store_inline(&handle->loc, entry, data, end > kept ? (uint32_t)end : kept);
+        if (result <= 0) {
+            return result == 0 ? (int)count : -1;
+        }
+    }
+    if (handle_make_blocks(handle) != 0) {
+        return -1;
+    }
+    uint32_t blocks_have = (old_size + fs.block_size - 1) / fs.block_size;
+    uint32_t blocks_need = (uint32_t)((end + fs.block_size - 1) / fs.block_size);
+    
+    // The blocks written in place, and the last one when new blocks are
+    // linked after it, must not be shared with a snapshot
+    uint32_t last_changed = (blocks_need < blocks_have ? blocks_need : blocks_have) - 1;
+    if (blocks_have > 0 && handle_unshare(handle, last_changed) != 0) {
+        fat_flush();
+        return -1;
+    }
+    
+    // Link new blocks after the current last block
+    if (blocks_need > blocks_have) {
+        uint32_t last_block = FAT_ENTRY_EOF;
+        if (blocks_have > 0 && handle_block_at(handle, blocks_have - 1, &last_block) != 0) {
+            printf("Error: File chain shorter than file size\n");
+            return -1;
+        }
+    
+        // Continue after the last block, or start near the file's directory
+        uint32_t first_new;
+        uint32_t goal = last_block != FAT_ENTRY_EOF ? last_block : handle->loc.block;
+        if (allocate_extent(blocks_need - blocks_have, goal, &first_new) != 0) {
+            printf("No free space available\n");
+            return -1;
+        }
+    
+        if (last_block == FAT_ENTRY_EOF) {
+            entry->first_block = first_new;
+        } else {
+            fat_set(last_block, first_new);
+        }
+        if (handle_map_extend(handle) != 0) {
+            return -1;
+        }
+    }
+    
+    // New blocks may hold stale data, so every one of them is written,
+    // including those in a gap before 'offset', and so is the tail of the
+    // old last block
+    uint32_t first_index = (offset < old_size ? offset : old_size) / fs.block_size;
+    
+    const uint8_t* data_ptr = (const uint8_t*)buffer;
+    uint8_t block_data[fs.block_size];
+    
+    for (uint32_t index = first_index; index < blocks_need; index++) {
+        uint64_t block_start = (uint64_t)index * fs.block_size;
+        uint64_t write_from = offset > block_start ? offset : block_start;
+        uint64_t write_to = end < block_start + fs.block_size ? end : block_start + fs.block_size;
+    
+        uint32_t block;
+        if (handle_block_at(handle, index, &block) != 0) {
+            printf("Error: File chain shorter than file size\n");
+            return -1;
+        }
+    
+        if (index < blocks_have && (write_from > block_start || write_to < block_start + fs.block_size)) {
+            // Partial overwrite of an existing block
+            if (read_block(block, block_data) != 0) {
+                printf("Error reading block\n");
+                return -1;
+            }
+            // Bytes past the old end (left over by truncate) must read as zeros
+            if (block_start + fs.block_size > old_size && old_size > block_start) {
+                memset(block_data + (old_size - block_start), 0, block_start + fs.block_size - old_size);
+            }
+        } else {
+            memset(block_data, 0, fs.block_size);
+        }
+    
+        if (write_to > write_from) {
+            memcpy(block_data + (write_from - block_start), data_ptr + (write_from - offset),
+                   write_to - write_from);
+        }
+    
+        if (write_block(block, block_data) != 0) {
+            printf("Error writing block\n");
+            return -1;
+        }
+    }
+    
+    // Write updated FAT before the directory entry that points into it
+    if (fat_flush() != 0) {
+        return -1;
+    }
+    
+    if (end > old_size) {
+        entry->file_size = (uint32_t)end;
+    }
+    entry->modified_time = (uint32_t)time(NULL);
+    
+    if (dir_write_entry(&handle->loc, entry) != 0) {
+        return -1;
+    }
+    handle_update(&handle->loc, entry, UINT32_MAX);
+    
+    return (int)count;
+}
+
+int fs_pwrite(int fd, const void* buffer, uint32_t count, uint32_t offset) {
+    DirEntryLoc loc;
+    FileHandle* handle = handle_acquire(fd, 1, &loc);
+    if (!handle) {
+        return -1;
+    }
+    
+    int result = handle_pwrite(handle, buffer, count, offset);
+    file_unlock(&loc);
+    return result;
+}
+
+// Moves the position used by fs_read() and fs_write(). Returns the new
+// position, or -1 when it would be negative.
+int64_t fs_seek(int fd, int64_t offset, int whence) {
+    DirEntryLoc loc;
+    FileHandle* handle = handle_acquire(fd, 0, &loc);
+    if (!handle) {
+        return -1;
+    }
+    
+    int64_t base = 0;
+    if (whence == SEEK_CUR) {
+        base = handle->position;
+    } else if (whence == SEEK_END) {
+        base = handle->entry.file_size;
+    }
+    
+    int64_t result = -1;
+    if (base + offset < 0 || base + offset > UINT32_MAX) {
+        printf("Invalid seek offset\n");
+    } else {
+        handle->position = (uint32_t)(base + offset);
+        result = handle->position;
+    }
+    file_unlock(&loc);
+    return result;
+}
+
+int fs_read(int fd, void* buffer, uint32_t count) {
+    FileHandle* handle = handle_get(fd);
+    int result = fs_pread(fd, buffer, count, handle ? handle->position : 0);
+    if (result > 0) {
+        handle->position += result;
+    }
+    return result;
+}
+
+int fs_write(int fd, const void* buffer, uint32_t count) {
+    FileHandle* handle = handle_get(fd);
+    int result = fs_pwrite(fd, buffer, count, handle ? handle->position : 0);
+    if (result > 0) {
+        handle->position += result;
+    }
+    return result;
+}
+
+// Writes at the current end of the file, whatever the handle's position
+int fs_append(int fd, const void* buffer, uint32_t count) {
+    DirEntryLoc loc;
+    FileHandle* handle = handle_acquire(fd, 1, &loc);
+    if (!handle) {
+        return -1;
+    }
+    
+    int result = handle_pwrite(handle, buffer, count, handle->entry.file_size);
+    file_unlock(&loc);
+    return result;
+}
+
+// File operations
+//
+// Each public operation takes its locks in a short wrapper and leaves the
+// work to a function that assumes them held.
+static int create_file_locked(uint32_t dir_block, const char* filename) {
+    // Check if file already exists
+    if (find_file_in_directory(dir_block, filename, NULL) == 0) {
+        printf("File already exists\n");
+        return -1;
+    }
+    
+    // Create directory entry
+    DirectoryEntry entry;
+    memset(&entry, 0, sizeof(DirectoryEntry));
+    strcpy(entry.filename, filename);
+    entry.file_size = 0;
+    entry.first_block = FAT_ENTRY_EOF;
+    entry.type = TYPE_FILE;
+    entry.created_time = (uint32_t)time(NULL);
+    entry.modified_time = entry.created_time;
+    entry.attributes = 0;
+    
+    // Add it to the directory, which grows by a block if it is full
+    int result = dir_add_entry(dir_block, &entry, NULL);
+    fat_flush();
+    if (result != 0) {
+        printf("Directory full\n");
+        return -1;
+    }
+    
+    printf("File '%s' created successfully\n", filename);
+    return 0;
+}
+
+int create_file(const char* path) {
+    uint32_t dir_block;
+    char name[MAX_FILENAME_SIZE];
+    pthread_rwlock_t* dir = dir_lock_path(path, 1, &dir_block, name);
+    if (!dir) {
+        return -1;
+    }
+    int result = create_file_locked(dir_block, name);
+    dir_unlock(dir);
+    return result;
+}
+
+// Frees the file behind 'loc' and removes its record
+static int delete_entry(uint32_t dir_block, const DirEntryLoc* loc) {
+    DirectoryEntry entry;
+    if (dir_read_entry(loc, &entry) != 0) {
+        return -1;
+    }
+    if (entry.type != TYPE_FILE) {
+        printf("Not a file\n");
+        return -1;
+    }
+    
+    // Free file blocks
+    if (entry.first_block != FAT_ENTRY_EOF) {
+        free_blocks(entry.first_block);
+        fat_flush();
+    }
+    
+    // Remove directory entry
+    if (dir_remove_entry(dir_block, loc) != 0) {
+        return -1;
+    }
+    handle_update(loc, NULL, 0);
+    return 0;
+}
+
+// The directory is locked exclusively so the record cannot be found again
+// while it goes, and the file so no reader is still using its blocks
+int delete_file(const char* filename) {
+    uint32_t dir_block;
+    char name[MAX_FILENAME_SIZE];
+    pthread_rwlock_t* dir = dir_lock_path(filename, 1, &dir_block, name);
+    if (!dir) {
+        return -1;
+    }
+    DirEntryLoc loc;
+    int result = -1;
+    
+    if (find_file_in_directory(dir_block, name, &loc) != 0) {
+        printf("File not found\n");
+    } else {
+        file_lock(&loc, 1);
+        result = delete_entry(dir_block, &loc);
+        pthread_rwlock_unlock(file_lock_for(&loc));
+    }
+    dir_unlock(dir);
+    
+    if (result == 0) {
+        printf("File '%s' deleted successfully\n", filename);
+    }
+    return result;
+}
+
+// Copies a file's contents to 'out'. Each extent of the chain, up to the
+// read-ahead size, is fetched with one request, and the backend is told
+// about the following run while this one is written out.
+static int stream_file_sync(const FileHandle* handle, FILE* out) {
+    uint32_t bytes_remaining = handle->entry.file_size;
+    uint32_t index = 0;
+    int result = 0;
+    
+    uint8_t* buffer = malloc((size_t)fs.readahead_blocks * fs.block_size);
+    if (!buffer) {
+        printf("Error: Cannot allocate read buffer\n");
+        return -1;
+    }
+    
+    while (result == 0 && bytes_remaining > 0) {
+        uint32_t blocks_left = (bytes_remaining + fs.block_size - 1) / fs.block_size;
+        uint32_t max_run = blocks_left < fs.readahead_blocks ? blocks_left : fs.readahead_blocks;
+        uint32_t current_block;
+        uint32_t run_length;
+        if (handle_run_at(handle, index, max_run, &current_block, &run_length) != 0) {
+            break;
+        }
+    
+        blocks_left -= run_length;
+        uint32_t next_block;
+        uint32_t next_run;
+        if (blocks_left > 0 && handle_run_at(handle, index + run_length, blocks_left < fs.readahead_blocks ?
+                                             blocks_left : fs.readahead_blocks, &next_block, &next_run) == 0) {
+            fs.device.ops->prefetch(&fs.device, next_block, next_run);
+        }
+    
+        // Print straight from the mapping when the backend allows it
+        const void* data = map_blocks(current_block, run_length);
+        if (!data) {
+            if (read_blocks(current_block, run_length, buffer) != 0) {
+                printf("Error reading block\n");
+                result = -1;
+                break;
+            }
+            data = buffer;
+        }
+    
+        uint32_t run_bytes = run_length * fs.block_size;
+        uint32_t bytes_to_print = bytes_remaining > run_bytes ? run_bytes : bytes_remaining;
+        if (fwrite(data, 1, bytes_to_print, out) != bytes_to_print) {
+            printf("Error writing output\n");
+            result = -1;
+        }
+        bytes_remaining -= bytes_to_print;
+        index += run_length;
+    }
+    
+    free(buffer);
+    return result;
+}
+
+// Decompresses a compressed file to 'out' chunk by chunk
+static int stream_file_compressed(const FileHandle* handle, FILE* out) {
+    uint8_t* packed = malloc(COMPRESS_CHUNK_SIZE);
+    uint8_t* plain = malloc(COMPRESS_CHUNK_SIZE);
+    int result = packed && plain ? 0 : -1;
+    
+    for (uint32_t chunk = 0; result == 0 && chunk < handle->chunk_count; chunk++) {
+        int length = handle_read_chunk(handle, chunk, plain, packed);
+        if (length < 0) {
+            printf("Error reading compressed data\n");
+            result = -1;
+        } else if (fwrite(plain, 1, length, out) != (size_t)length) {
+            printf("Error writing output\n");
+            result = -1;
+        }
+    }
+    free(packed);
+    free(plain);
+    return result;
+}
+
+// Copies any file to 'out': compressed and inline files take their own
+// paths, plain ones are streamed by runs. With an asynchronous engine the
+// next run is read into a second buffer while the current one is written
+// out.
+static int stream_file(const FileHandle* handle, FILE* out) {
+    if (handle->entry.attributes & ATTR_COMPRESSED) {
+        return stream_file_compressed(handle, out);
+    }
+    if (handle->entry.attributes & ATTR_INLINE) {
+        uint32_t size = handle->entry.file_size;
+        return fwrite(handle->entry.inline_data, 1, size, out) == size ? 0 : -1;
+    }
+    if (fs.io.kind == IO_SYNC) {
+        return stream_file_sync(handle, out);
+    }
+    
+    size_t run_size = (size_t)fs.readahead_blocks * fs.block_size;
+    uint8_t* buffers = malloc(2 * run_size);
+    IoBatch batches[2];
+    memset(batches, 0, sizeof(batches));
+    int result = buffers && io_batch_init(&batches[0], 1) == 0 && io_batch_init(&batches[1], 1) == 0 ? 0 : -1;
+    
+    uint32_t run_start[2];
+    uint32_t run_length[2];
+    uint64_t run_seq[2];
+    uint32_t next_index = 0;
+    uint32_t blocks_left = (handle->entry.file_size + fs.block_size - 1) / fs.block_size;
+    uint32_t bytes_remaining = handle->entry.file_size;
+    uint32_t current = 0;
+    uint32_t queued = 0;
+    
+    while (result == 0) {
+        // Keep up to two runs in flight
+        while (queued < 2 && blocks_left > 0) {
+            uint32_t slot = (current + queued) % 2;
+            uint32_t max_run = blocks_left < fs.readahead_blocks ? blocks_left : fs.readahead_blocks;
+            if (handle_run_at(handle, next_index, max_run, &run_start[slot], &run_length[slot]) != 0) {
+                blocks_left = 0;
+                break;
+            }
+            next_index += run_length[slot];
+            blocks_left -= run_length[slot];
+            if (io_read_blocks(&batches[slot], run_start[slot], run_length[slot],
+                               buffers + slot * run_size, &run_seq[slot]) != 0) {
+                result = -1;
+                break;
+            }
+            queued++;
+        }
+        if (result != 0 || queued == 0) {
+            break;
+        }
+    
+        uint8_t* data = buffers + current * run_size;
+        if (read_blocks_end(run_start[current], run_length[current], data, run_seq[current],
+                            io_batch_wait(&batches[current])) != 0) {
+            result = -1;
+            break;
+        }
+        queued--;
+    
+        uint32_t run_bytes = run_length[current] * fs.block_size;
+        uint32_t bytes_to_print = bytes_remaining > run_bytes ? run_bytes : bytes_remaining;
+        if (fwrite(data, 1, bytes_to_print, out) != bytes_to_print) {
+            printf("Error writing output\n");
+            result = -2;
+            break;
+        }
+        bytes_remaining -= bytes_to_print;
+        current ^= 1;
+    }
+    if (result == -1) {
+        printf("Error reading block\n");
+    }
+    
+    // Nothing may still be reading into the buffers when they are freed
+    io_batch_wait(&batches[0]);
+    io_batch_wait(&batches[1]);
+    io_batch_destroy(&batches[0]);
+    io_batch_destroy(&batches[1]);
+    free(buffers);
+    return result == 0 ? 0 : -1;
+}
+
+int read_file(const char* filename) {
+    DirEntryLoc loc;
+    DirectoryEntry entry;
+    if (file_lock_lookup(filename, 0, &loc, &entry) != 0) {
+        return -1;
+    }
+    
+    int result = 0;
+    if (entry.file_size == 0) {
+        printf("File is empty\n");
+    } else {
+        FileHandle scratch;
+        FileHandle* handle = handle_for_map(&loc, &entry, &scratch);
+        result = handle ? 0 : -1;
+        if (handle) {
+            printf("File content (%u bytes):\n", entry.file_size);
+            result = stream_file(handle, stdout);
+        }
+        if (result == 0) {
+            printf("\n");
+        }
+        handle_release(&scratch);
+    }
+    
+    file_unlock(&loc);
+    return result;
+}
+
+// Replaces the contents of a compressed file, which stays compressed
+static int write_entry_compressed(const DirEntryLoc* loc, DirectoryEntry* entry, const char* data, uint32_t size) {
+    ChunkWriter writer;
+    uint32_t first_block;
+    int result = chunk_writer_init(&writer, loc->block);
+    if (result == 0) {
+        result = chunk_writer_write(&writer, data, size);
+    }
+    if (result == 0) {
+        result = chunk_writer_finish(&writer, &first_block);
+    }
+    if (result == 0) {
+        result = entry_swap_chain(loc, entry, first_block, size, ATTR_COMPRESSED);
+    }
+    chunk_writer_destroy(&writer);
+    if (result != 0) {
+        fat_flush();
+    }
+    return result;
+}
+
+// Replaces the contents of the file behind 'loc'
+static int write_entry(const DirEntryLoc* loc, DirectoryEntry* entry, const char* data) {
+    uint32_t data_size = strlen(data);
+    if (entry->attributes & ATTR_COMPRESSED) {
+        return write_entry_compressed(loc, entry, data, data_size);
+    }
+    int stored = entry_store_inline(loc, entry, data, data_size);
+    if (stored <= 0) {
+        return stored;
+    }
+    
+    // Free existing blocks if any
+    if (entry->first_block != FAT_ENTRY_EOF) {
+        free_blocks(entry->first_block);
+        entry->first_block = FAT_ENTRY_EOF;
+        entry->file_size = 0;
+        handle_update(loc, entry, 0);
+    }
+    
+    // Reserve the whole chain up front so the file lands contiguously
+    uint32_t blocks_needed = (data_size + fs.block_size - 1) / fs.block_size;
+    uint32_t first_block = FAT_ENTRY_EOF;
+    
+    if (blocks_needed > 0 && allocate_extent(blocks_needed, loc->block, &first_block) != 0) {
+        printf("No free space available\n");
+        fat_flush();
+        dir_write_entry(loc, entry);
+        return -1;
+    }
+    
+    // Write data along the pre-linked chain
+    uint32_t bytes_remaining = data_size;
+    const uint8_t* data_ptr = (const uint8_t*)data;
+    uint32_t current_block = first_block;
+    
+    while (bytes_remaining > 0) {
+        uint32_t bytes_to_write = bytes_remaining > fs.block_size ? fs.block_size : bytes_remaining;
+        uint8_t block_data[fs.block_size];
+        memset(block_data, 0, fs.block_size);
+        memcpy(block_data, data_ptr, bytes_to_write);
+    
+        if (write_block(current_block, block_data) != 0) {
+            printf("Error writing block\n");
+            free_blocks(first_block);
+            fat_flush();
+            dir_write_entry(loc, entry);
+            return -1;
+        }
+    
+        data_ptr += bytes_to_write;
+        bytes_remaining -= bytes_to_write;
+        current_block = fat_get(current_block);
+    }
+    
+    // Write updated FAT before the directory entry that points into it
+    if (fat_flush() != 0) {
+        return -1;
+    }
+    
+    // Update directory entry
+    entry->first_block = first_block;
+    entry->file_size = data_size;
+    entry->attributes &= ~ATTR_INLINE;
+    entry->modified_time = (uint32_t)time(NULL);
+    
+    // Write directory back to disk
+    if (dir_write_entry(loc, entry) != 0) {
+        return -1;
+    }
+    handle_update(loc, entry, 0);
+    return 0;
+}
+
+int write_file(const char* filename, const char* data) {
+    DirEntryLoc loc;
+    DirectoryEntry entry;
+    if (file_lock_lookup(filename, 1, &loc, &entry) != 0) {
+        return -1;
+    }
+    
+    int result = write_entry(&loc, &entry, data);
+    file_unlock(&loc);
+    
+    if (result == 0) {
+        printf("Written %u bytes to file '%s'\n", entry.file_size, filename);
+    }
+    return result;
+}
+
+// Adds data to the end of a file. The tail of the last block is filled in
+// place and only the blocks beyond it are allocated and linked after the
+// old end of the chain; the rest of the file is not touched. An open
+// handle's extent map is reused to find the last block.
+int append_file(const char* filename, const char* data) {
+    DirEntryLoc loc;
+    DirectoryEntry entry;
+    if (file_lock_lookup(filename, 1, &loc, &entry) != 0) {
+        return -1;
+    }
+    
+    FileHandle scratch;
+    FileHandle* handle = handle_for_map(&loc, &entry, &scratch);
+    uint32_t data_size = strlen(data);
+    int result = handle ? handle_pwrite(handle, data, data_size, handle->entry.file_size) : -1;
+    handle_release(&scratch);
+    file_unlock(&loc);
+    if (result < 0) {
+        return -1;
+    }
+    
+    printf("Appended %u bytes to file '%s'\n", data_size, filename);
+    return 0;
+}
+
+// Copies a host file into the file system without holding it in memory.
+// The host file is read in chunks the size of the read-ahead buffer; each
+// chunk gets an extent from allocate_extent(), linked after the previous
+// one, and is written with one request per contiguous run. The new chain
+// replaces the file's old one only after all data is on disk, and the file
+// is created if it does not exist. Its size is bounded only by free space.
+// Two chunk buffers alternate, so the host file is read while the previous
+// chunk's writes are still in flight.
+// Copying holds no directory or file lock, so the old contents stay
+// readable; the name is looked up again for the swap.
+static int import_swap(uint32_t dir_block, const char* filename, uint32_t first_block, uint32_t size,
+                       uint8_t attributes) {
+    DirEntryLoc loc;
+    DirectoryEntry entry;
+    int exists = find_file_in_directory(dir_block, filename, &loc) == 0;
+    if (exists) {
+        file_lock(&loc, 1);
+        if (dir_read_entry(&loc, &entry) != 0 || entry.type != TYPE_FILE) {
+            printf("Not a file\n");
+            pthread_rwlock_unlock(file_lock_for(&loc));
+            return -1;
+        }
+    } else {
+        memset(&entry, 0, sizeof(DirectoryEntry));
+        strcpy(entry.filename, filename);
+        entry.type = TYPE_FILE;
+        entry.created_time = (uint32_t)time(NULL);
+    }
+    
+    uint32_t old_first_block = entry.first_block;
+    entry.first_block = first_block;
+    entry.file_size = size;
+    entry.attributes = (entry.attributes & ~(ATTR_COMPRESSED | ATTR_INLINE)) | attributes;
+    entry.modified_time = (uint32_t)time(NULL);
+    
+    if (!exists) {
+        if (dir_add_entry(dir_block, &entry, &loc) != 0) {
+            printf("Directory full\n");
+            return -1;
+        }
+        return 0;
+    }
+    
+    int result = dir_write_entry(&loc, &entry);
+    if (result == 0) {
+        // Only now is the old data unreferenced
+        handle_update(&loc, &entry, 0);
+        if (old_first_block != FAT_ENTRY_EOF) {
+            free_blocks(old_first_block);
+        }
+    }
+    pthread_rwlock_unlock(file_lock_for(&loc));
+    return result;
+}
+
+// Whether 'filename' exists in the directory and is compressed
+static int import_target_compressed(uint32_t dir_block, const char* filename) {
+    pthread_rwlock_t* dir = dir_lock_for(dir_block);
+    pthread_rwlock_rdlock(dir);
+    DirEntryLoc loc;
+    DirectoryEntry entry;
+    int compressed = find_file_in_directory(dir_block, filename, &loc) == 0 &&
+                     dir_read_entry(&loc, &entry) == 0 && entry.type == TYPE_FILE &&
+                     (entry.attributes & ATTR_COMPRESSED);
+    pthread_rwlock_unlock(dir);
+    return compressed;
+}
+
+int import_file(const char* host_path, const char* filename) {
+    uint32_t dir_block;
+    char name[MAX_FILENAME_SIZE];
+    pthread_rwlock_t* dir = dir_lock_path(filename, 0, &dir_block, name);
+    if (!dir) {
+        return -1;
+    }
+    pthread_rwlock_unlock(dir);
+    
+    FILE* in = fopen(host_path, "rb");
+    if (!in) {
+        printf("Error: Cannot open host file %s\n", host_path);
+        pthread_rwlock_unlock(&fs.volume_lock);
+        return -1;
+    }
+    
+    size_t chunk_size = (size_t)fs.readahead_blocks * fs.block_size;
+    uint8_t* buffers = malloc(2 * chunk_size);
+    IoBatch batches[2];
+    memset(batches, 0, sizeof(batches));
+    uint32_t first_block = FAT_ENTRY_EOF;
+    uint32_t last_block = FAT_ENTRY_EOF;
+    uint64_t total = 0;
+    int result = buffers && io_batch_init(&batches[0], fs.readahead_blocks) == 0 &&
+                 io_batch_init(&batches[1], fs.readahead_blocks) == 0 ? 0 : -1;
+    
+    // Importing over a compressed file keeps it compressed: the data goes
+    // through a ChunkWriter instead of straight to disk
+    ChunkWriter writer;
+    int compressed = import_target_compressed(dir_block, name);
+    memset(&writer, 0, sizeof(ChunkWriter));
+    writer.first_block = FAT_ENTRY_EOF;
+    if (result == 0 && compressed) {
+        result = chunk_writer_init(&writer, dir_block);
+    }
+    
+    for (uint32_t chunk = 0; result == 0; chunk++) {
+        uint8_t* buffer = buffers + (chunk % 2) * chunk_size;
+        IoBatch* batch = &batches[chunk % 2];
+    
+        // The writes still reading from this buffer must finish first
+        if (io_batch_wait(batch) != 0) {
+            printf("Error writing block\n");
+            result = -1;
+            break;
+        }
+        size_t got = fread(buffer, 1, chunk_size, in);
+        if (got == 0) {
+            break;
+        }
+        if (total + got > UINT32_MAX) {
+            printf("File too large\n");
+            result = -1;
+            break;
+        }
+        if (compressed) {
+            result = chunk_writer_write(&writer, buffer, (uint32_t)got);
+            total += got;
+            if (got < chunk_size) {
+                break;
+            }
+            continue;
+        }
+    
+        uint32_t blocks = (uint32_t)((got + fs.block_size - 1) / fs.block_size);
+        memset(buffer + got, 0, (size_t)blocks * fs.block_size - got);
+    
+        uint32_t chunk_first;
+        uint32_t goal = last_block != FAT_ENTRY_EOF ? last_block : dir_block;
+        if (allocate_extent(blocks, goal, &chunk_first) != 0) {
+            printf("No free space available\n");
+            result = -1;
+            break;
+        }
+        if (last_block == FAT_ENTRY_EOF) {
+            first_block = chunk_first;
+        } else {
+            fat_set(last_block, chunk_first);
+        }
+    
+        // Write each contiguous run of the chunk's chain with one request
+        uint32_t run_start = chunk_first;
+        uint32_t done = 0;
+        while (done < blocks) {
+            uint32_t run_length = 1;
+            uint32_t next_block = fat_get(run_start);
+            while (done + run_length < blocks && next_block == run_start + run_length) {
+                run_length++;
+                next_block = fat_get(next_block);
+            }
+    
+            if (io_write_blocks(batch, run_start, run_length, buffer + (size_t)done * fs.block_size) != 0) {
+                printf("Error writing block\n");
+                result = -1;
+                break;
+            }
+            last_block = run_start + run_length - 1;
+            done += run_length;
+            run_start = next_block;
+        }
+    
+        total += got;
+        if (got < chunk_size) {
+            break;
+        }
+    }
+    
+    if (result == 0 && ferror(in)) {
+        printf("Error: Cannot read host file %s\n", host_path);
+        result = -1;
+    }
+    fclose(in);
+    for (int i = 0; i < 2; i++) {
+        if (io_batch_wait(&batches[i]) != 0 && result == 0) {
+            printf("Error writing block\n");
+            result = -1;
+        }
+        io_batch_destroy(&batches[i]);
+    }
+    free(buffers);
+    if (result == 0 && compressed) {
+        result = chunk_writer_finish(&writer, &first_block);
+    }
+    chunk_writer_destroy(&writer);
+    
+    // Write the new chain before the directory entry that points into it
+    if (result == 0 && fat_flush() == 0) {
+        pthread_rwlock_wrlock(dir);
+        result = import_swap(dir_block, name, first_block, (uint32_t)total, compressed ? ATTR_COMPRESSED : 0);
+        pthread_rwlock_unlock(dir);
+    } else {
+        result = -1;
+    }
+    if (result != 0 && first_block != FAT_ENTRY_EOF) {
+        free_blocks(first_block);
+    }
+    fat_flush();
+    pthread_rwlock_unlock(&fs.volume_lock);
+    
+    if (result != 0) {
+        return -1;
+    }
+    printf("Imported %u bytes from '%s' into '%s'\n", (uint32_t)total, host_path, filename);
+    return 0;
+}
+
+// Copies a file out to a host file, streaming it run by run
+int export_file(const char* filename, const char* host_path) {
+    DirEntryLoc loc;
+    DirectoryEntry entry;
+    if (file_lock_lookup(filename, 0, &loc, &entry) != 0) {
+        return -1;
+    }
+    
+    FILE* out = fopen(host_path, "wb");
+    if (!out) {
+        printf("Error: Cannot create host file %s\n", host_path);
+        file_unlock(&loc);
+        return -1;
+    }
+    
+    FileHandle scratch;
+    FileHandle* handle = handle_for_map(&loc, &entry, &scratch);
+    int result = handle ? stream_file(handle, out) : -1;
+    handle_release(&scratch);
+    file_unlock(&loc);
+    if (fclose(out) != 0 && result == 0) {
+        printf("Error writing output\n");
+        result = -1;
+    }
+    if (result != 0) {
+        return -1;
+    }
+    
+    printf("Exported %u bytes from '%s' to '%s'\n", entry.file_size, filename, host_path);
+    return 0;
+}
+
+int truncate_file(const char* filename, uint32_t new_size) {
+    DirEntryLoc loc;
+    DirectoryEntry entry;
+    if (file_lock_lookup(filename, 1, &loc, &entry) != 0) {
+        return -1;
+    }
+    
+    int unchanged = new_size == entry.file_size; // No change needed
+    int result = unchanged ? 0 : truncate_entry(&loc, &entry, new_size);
+    file_unlock(&loc);
+    if (result != 0) {
+        return -1;
+    }
+    
+    if (!unchanged) {
+        printf("File '%s' truncated to %u bytes\n", filename, new_size);
+    }
+    return 0;
+}
+
+// Rewrites a file compressed ('compress' set) or plain. Open handles on
+// the file see the new layout.
+int compress_file(const char* filename, int compress) {
+    DirEntryLoc loc;
+    DirectoryEntry entry;
+    if (file_lock_lookup(filename, 1, &loc, &entry) != 0) {
+        return -1;
+    }
+    
+    int compressed = (entry.attributes & ATTR_COMPRESSED) != 0;
+    int inline_file = (entry.attributes & ATTR_INLINE) != 0;
+    uint32_t old_blocks = 0;
+    uint32_t new_blocks = 0;
+    int result = 0;
+    if (compressed != compress && !inline_file) {
+        FileHandle scratch;
+        FileHandle* handle = handle_for_map(&loc, &entry, &scratch);
+        old_blocks = handle ? handle->mapped_blocks : 0;
+        result = handle ? handle_convert(handle, compress) : -1;
+        new_blocks = handle ? handle->mapped_blocks : 0;
+        handle_release(&scratch);
+    }
+    file_unlock(&loc);
+    if (result != 0) {
+        return -1;
+    }
+    
+    if (inline_file) {
+        printf("File '%s' is stored inline in its directory entry\n", filename);
+    } else if (compressed == compress) {
+        printf("File '%s' is already %s\n", filename, compress ? "compressed" : "uncompressed");
+    } else {
+        printf("File '%s' %s: %u blocks -> %u blocks\n", filename, compress ? "compressed" : "decompressed",
+               old_blocks, new_blocks);
+    }
+    return 0;
+}
+
+// Directory operations
+// Adds an empty directory 'dirname' with 'attributes' to the directory at
+// 'parent_block' and returns its first block
+static int dir_create_locked(uint32_t parent_block, const char* dirname, uint8_t attributes, uint32_t* first_block) {
+    // Check if directory already exists
+    if (find_file_in_directory(parent_block, dirname, NULL) == 0) {
+        printf("Directory already exists\n");
+        return -1;
+    }
+    
+    // Allocate block for new directory in this thread's home group, so
+    // directories (and the files placed near them) spread over the disk
+    uint32_t dir_block;
+    if (allocate_extent(1, 0, &dir_block) != 0) {
+        printf("No free space available\n");
+        return -1;
+    }
+    fat_flush();
+    
+    // Initialize new directory
+    uint8_t block[fs.block_size];
+    dir_block_init(block, fs.block_size);
+    if (journal_write(dir_block, block) != 0) {
+        free_blocks(dir_block);
+        fat_flush();
+        return -1;
+    }
+    
+    DirectoryEntry entry;
+    memset(&entry, 0, sizeof(DirectoryEntry));
+    entry.type = TYPE_DIRECTORY;
+    entry.created_time = (uint32_t)time(NULL);
+    entry.modified_time = entry.created_time;
+    
+    // Add "." entry (self) and ".." entry (parent)
+    strcpy(entry.filename, ".");
+    entry.first_block = dir_block;
+    int result = dir_add_entry(dir_block, &entry, NULL);
+    
+    strcpy(entry.filename, "..");
+    entry.first_block = parent_block;
+    if (result == 0) {
+        result = dir_add_entry(dir_block, &entry, NULL);
+    }
+    
+    // Add directory entry to its parent
+    strcpy(entry.filename, dirname);
+    entry.first_block = dir_block;
+    entry.attributes = attributes;
+    if (result == 0) {
+        result = dir_add_entry(parent_block, &entry, NULL);
+    }
+    
+    if (result != 0) {
+        printf("Directory full\n");
+        free_blocks(dir_block);
+        fat_flush();
+        return -1;
+    }
+    fat_flush();
+    *first_block = dir_block;
+    return 0;
+}
+
+int create_directory(const char* path) {
+    uint32_t parent_block;
+    char name[MAX_FILENAME_SIZE];
+    pthread_rwlock_t* dir = dir_lock_path(path, 1, &parent_block, name);
+    if (!dir) {
+        return -1;
+    }
+    uint32_t dir_block;
+    int result = dir_create_locked(parent_block, name, 0, &dir_block);
+    dir_unlock(dir);
+    if (result == 0) {
+        printf("Directory '%s' created successfully\n", name);
+    }
+    return result;
+}
+
+// Moves the current directory. The volume is locked exclusively, since
+// every operation resolves relative paths from it.
+int change_directory(const char* path) {
+    uint32_t dir_block;
+    char absolute[MAX_PATH_SIZE];
+    pthread_rwlock_wrlock(&fs.volume_lock);
+    int result = path_directory(path, &dir_block);
+    if (result == 0) {
+        result = path_absolute(path, absolute);
+    }
+    if (result == 0) {
+        fs.current_dir_block = dir_block;
+        strcpy(fs.current_path, absolute);
+    }
+    pthread_rwlock_unlock(&fs.volume_lock);
+    return result;
+}
+
+static int print_directory_entry(const DirectoryEntry* entry, const DirEntryLoc* loc, void* ctx) {
+    (void)loc;
+    (void)ctx;
+    
+    const char* type = entry->type != TYPE_FILE ? "DIR" :
+                       entry->attributes & ATTR_COMPRESSED ? "FILE (c)" :
+                       entry->attributes & ATTR_INLINE ? "FILE (i)" : "FILE";
+    printf("%-20s %-10s %-10u ", entry->filename, type, entry->file_size);
+    
+    // Format time
+    time_t mod_time = entry->modified_time;
+    struct tm* timeinfo = localtime(&mod_time);
+    char time_str[20];
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M", timeinfo);
+    printf("%s\n", time_str);
+    return 0;
+}
+
+// Lists the directory at 'path', or the current one when it is NULL
+int list_directory(const char* path) {
+    uint32_t dir_block;
+    pthread_rwlock_rdlock(&fs.volume_lock);
+    char absolute[MAX_PATH_SIZE];
+    if (path_directory(path ? path : ".", &dir_block) != 0 || path_absolute(path ? path : ".", absolute) != 0) {
+        pthread_rwlock_unlock(&fs.volume_lock);
+        return -1;
+    }
+    
+    printf("Contents of %s:\n", absolute);
+    printf("%-20s %-10s %-10s %s\n", "Name", "Type", "Size", "Modified");
+    printf("------------------------------------------------------------\n");
+    
+    pthread_rwlock_t* dir = dir_lock_for(dir_block);
+    pthread_rwlock_rdlock(dir);
+    int result = dir_iterate(dir_block, print_directory_entry, NULL);
+    dir_unlock(dir);
+    return result;
+}
+
+// Snapshots
+//
+// A snapshot is a copy of every directory block of the tree, kept as
+// /.snapshots/<name>; the files in it share their chains with the live
+// ones, so creating one costs the directories only. Each shared chain
+// gets one more owner in the share table (see Block sharing), and a file
+// changed afterwards copies the blocks it changes first. Snapshots are
+// browsed like any directory, and what is changed in one is copied on
+// write as well. /.snapshots itself only changes through these commands,
+// with the volume locked exclusively; the share table lives in it and is
+// removed with the last snapshot.
+typedef struct {
+    uint32_t source;          // First block of the directory
+    uint32_t parent;          // Its index, UINT32_MAX for the top of the tree
+    uint32_t blocks;          // Length of its chain
+    uint32_t copy;            // First block of its copy
+} SnapshotDir;
+
+typedef struct {
+    SnapshotDir* dirs;        // Breadth first, so children follow in record order
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t current;         // Directory being read
+    uint32_t files;           // Files with a chain
+} SnapshotWalk;
+
+// Whether the directory record leads into the tree below it: not "." or
+// "..", and not /.snapshots, which snapshots leave out
+static int snapshot_follows(const DirectoryEntry* entry) {
+    return entry->type == TYPE_DIRECTORY && !(entry->attributes & ATTR_SNAPSHOTS) &&
+           strcmp(entry->filename, ".") != 0 && strcmp(entry->filename, "..") != 0;
+}
+
+static int snapshot_has_chain(const DirectoryEntry* entry) {
+    return entry->type == TYPE_FILE && !(entry->attributes & ATTR_INLINE) &&
+           entry->first_block < fs.boot_sector.total_blocks;
+}
+
+static int snapshot_visit(const DirectoryEntry* entry, const DirEntryLoc* loc, void* arg) {
+    (void)loc;
+    SnapshotWalk* walk = arg;
+    walk->files += snapshot_has_chain(entry);
+    if (!snapshot_follows(entry)) {
+        return 0;
+    }
+    if (walk->count == walk->capacity) {
+        uint32_t capacity = walk->capacity * 2;
+        SnapshotDir* dirs = realloc(walk->dirs, capacity * sizeof(SnapshotDir));
+        if (!dirs) {
+            return -1;
+        }
+        walk->dirs = dirs;
+        walk->capacity = capacity;
+    }
+    walk->dirs[walk->count++] = (SnapshotDir){ entry->first_block, walk->current, 0, 0 };
+    return 0;
+}
+
+// Lists every directory of the tree below 'top' with its chain length
+static int snapshot_walk(uint32_t top, SnapshotWalk* walk) {
+    memset(walk, 0, sizeof(SnapshotWalk));
+    walk->capacity = 16;
+    walk->dirs = malloc(walk->capacity * sizeof(SnapshotDir));
+    if (!walk->dirs) {
+        printf("Error: Cannot allocate memory for the snapshot\n");
+        return -1;
+    }
+    walk->dirs[walk->count++] = (SnapshotDir){ top, UINT32_MAX, 0, 0 };
+    
+    for (uint32_t i = 0; i < walk->count; i++) {
+        // A corrupt tree could name a directory more than once
+        walk->current = i;
+        if (walk->count > fs.boot_sector.total_blocks || dir_iterate(walk->dirs[i].source, snapshot_visit, walk) != 0) {
+            printf("Error: Cannot read the directory tree\n");
+            return -1;
+        }
+        for (uint32_t b = walk->dirs[i].source; b != FAT_ENTRY_EOF; b = dir_next_block(b)) {
+            walk->dirs[i].blocks++;
+        }
+    }
+    return 0;
+}
+
+static int snapshot_name_valid(const char* name) {
+    if (name[0] == '\0' || strchr(name, '/') || strlen(name) >= MAX_FILENAME_SIZE || strcmp(name, ".") == 0 ||
+        strcmp(name, "..") == 0 || strcmp(name, SHARE_TABLE_NAME) == 0) {
+        printf("Error: Invalid snapshot name '%s'\n", name);
+        return 0;
+    }
+    return 1;
+}
+
+static int snapshot_count_visit(const DirectoryEntry* entry, const DirEntryLoc* loc, void* arg) {
+    (void)loc;
+    *(uint32_t*)arg += snapshot_follows(entry);
+    return 0;
+}
+
+static uint32_t snapshot_count() {
+    uint32_t count = 0;
+    dir_iterate(fs.snapshot_dir, snapshot_count_visit, &count);
+    return count;
+}
+
+// Owners beyond the first, over all blocks
+static uint64_t share_total() {
+    uint64_t total = 0;
+    for (uint32_t block = 0; block < fs.boot_sector.total_blocks; block++) {
+        total += share_count(block);
+    }
+    return total;
+}
+
+// Removes /.snapshots and the share table
+static int snapshot_teardown() {
+    DirEntryLoc loc;
+    DirectoryEntry entry;
+    share_table_unload();
+    if (find_file_in_directory(fs.snapshot_dir, SHARE_TABLE_NAME, &loc) == 0 && dir_read_entry(&loc, &entry) == 0) {
+        free_blocks(entry.first_block);
+    }
+    int result = find_file_in_directory(fs.boot_sector.root_dir_block, SNAPSHOT_DIR_NAME, &loc) == 0 &&
+                 dir_remove_entry(fs.boot_sector.root_dir_block, &loc) == 0 ? 0 : -1;
+    if (result == 0) {
+        free_blocks(fs.snapshot_dir);
+        fs.snapshot_dir = 0;
+    }
+    dir_index_clear();
+    dentry_cache_clear();
+    return fat_flush() == 0 ? result : -1;
+}
+
+// Creates /.snapshots with an empty share table, the first time
+static int snapshot_setup() {
+    if (fs.snapshot_dir) {
+        return 0;
+    }
+    if (find_file_in_directory(fs.boot_sector.root_dir_block, SNAPSHOT_DIR_NAME, NULL) == 0) {
+        printf("Error: /%s exists and does not hold snapshots\n", SNAPSHOT_DIR_NAME);
+        return -1;
+    }
+    uint32_t dir_block;
+    if (dir_create_locked(fs.boot_sector.root_dir_block, SNAPSHOT_DIR_NAME, ATTR_SNAPSHOTS, &dir_block) != 0) {
+        return -1;
+    }
+    fs.snapshot_dir = dir_block;
+    
+    DirectoryEntry entry;
+    memset(&entry, 0, sizeof(DirectoryEntry));
+    strcpy(entry.filename, SHARE_TABLE_NAME);
+    entry.type = TYPE_FILE;
+    entry.attributes = ATTR_SNAPSHOTS;
+    entry.file_size = fs.boot_sector.total_blocks;
+    entry.created_time = (uint32_t)time(NULL);
+    entry.modified_time = entry.created_time;
+    entry.first_block = FAT_ENTRY_EOF;
+    
+    uint32_t blocks = (fs.boot_sector.total_blocks + fs.block_size - 1) / fs.block_size;
+    int result = allocate_extent(blocks, dir_block, &entry.first_block);
+    if (result != 0) {
+        printf("No free space available\n");
+    }
+    uint8_t zeros[fs.block_size];
+    memset(zeros, 0, fs.block_size);
+    for (uint32_t b = entry.first_block; result == 0 && b != FAT_ENTRY_EOF; b = fat_get(b)) {
+        result = journal_write(b, zeros);
+    }
+    if (result == 0 && (fat_flush() != 0 || dir_add_entry(dir_block, &entry, NULL) != 0)) {
+        result = -1;
+    }
+    if (result == 0) {
+        result = share_table_load(entry.first_block);
+    } else if (entry.first_block < FAT_ENTRY_BAD) {
+        free_blocks(entry.first_block);
+    }
+    if (result != 0) {
+        snapshot_teardown();
+    }
+    return result;
+}
+
+// Takes the share table away with the last snapshot, unless some count
+// is left over for 'check' to explain
+static int snapshot_tidy() {
+    if (fs.snapshot_dir && snapshot_count() == 0 && share_total() == 0) {
+        return snapshot_teardown();
+    }
+    return 0;
+}
+
+// Second pass of snapshot_create(): writes the copy of each directory
+// block, pointing its subdirectory records at their copies, and adds an
+// owner to every file chain it names. The record of /.snapshots in the
+// root's copy is returned in 'skipped' to be removed.
+static int snapshot_copy_dirs(SnapshotWalk* walk, DirEntryLoc* skipped) {
+    uint8_t data[fs.block_size];
+    uint32_t child = 1;
+    for (uint32_t i = 0; i < walk->count; i++) {
+        const SnapshotDir* dir = &walk->dirs[i];
+        uint32_t source = dir->source;
+        uint32_t target = dir->copy;
+        for (uint32_t j = 0; j < dir->blocks; j++, source = dir_next_block(source), target = fat_get(target)) {
+            if (read_block(source, data) != 0) {
+                return -1;
+            }
+            dir_block_normalize(data);
+            for (uint32_t offset = 0; offset < fs.block_size; offset += ((DirRecord*)(data + offset))->record_length) {
+                DirRecord* rec = (DirRecord*)(data + offset);
+                DirectoryEntry entry;
+                if (rec->name_length == 0) {
+                    continue;
+                }
+                dir_record_decode(rec, &entry);
+                if (snapshot_has_chain(&entry)) {
+                    share_add(entry.first_block);
+                } else if (strcmp(entry.filename, ".") == 0) {
+                    rec->first_block = fat_to_disk(dir->copy);
+                } else if (strcmp(entry.filename, "..") == 0 && dir->parent != UINT32_MAX) {
+                    rec->first_block = fat_to_disk(walk->dirs[dir->parent].copy);
+                } else if (snapshot_follows(&entry) && child < walk->count) {
+                    rec->first_block = fat_to_disk(walk->dirs[child++].copy);
+                } else if (entry.type == TYPE_DIRECTORY && (entry.attributes & ATTR_SNAPSHOTS)) {
+                    *skipped = (DirEntryLoc){ target, (uint16_t)offset };
+                }
+            }
+            if (journal_write(target, data) != 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+int snapshot_create(const char* name) {
+    if (!snapshot_name_valid(name)) {
+        return -1;
+    }
+    pthread_rwlock_wrlock(&fs.volume_lock);
+    if (!fs.device.ops) {
+        printf("Error: No partition mounted\n");
+        pthread_rwlock_unlock(&fs.volume_lock);
+        return -1;
+    }
+    
+    SnapshotWalk walk;
+    memset(&walk, 0, sizeof(SnapshotWalk));
+    int result = snapshot_setup();
+    if (result == 0 && find_file_in_directory(fs.snapshot_dir, name, NULL) == 0) {
+        printf("Error: Snapshot '%s' already exists\n", name);
+        result = -1;
+    }
+    if (result == 0 && snapshot_count() >= MAX_SNAPSHOTS) {
+        printf("Error: A volume holds at most %d snapshots\n", MAX_SNAPSHOTS);
+        result = -1;
+    }
+    if (result == 0) {
+        result = snapshot_walk(fs.boot_sector.root_dir_block, &walk);
+    }
+    
+    // One extent for every copy, cut into a chain per directory
+    uint32_t total = 0;
+    uint32_t first_block = FAT_ENTRY_EOF;
+    for (uint32_t i = 0; result == 0 && i < walk.count; i++) {
+        total += walk.dirs[i].blocks;
+    }
+    if (result == 0 && allocate_extent(total, 0, &first_block) != 0) {
+        printf("No free space available\n");
+        result = -1;
+    }
+    for (uint32_t i = 0, block = first_block; result == 0 && i < walk.count; i++) {
+        walk.dirs[i].copy = block;
+        for (uint32_t j = 1; j < walk.dirs[i].blocks; j++) {
+            block = fat_get(block);
+        }
+        uint32_t last = block;
+        block = fat_get(last);
+        fat_set(last, FAT_ENTRY_EOF);
+    }
+    
+    DirEntryLoc skipped = { 0, 0 };
+    if (result == 0 && snapshot_copy_dirs(&walk, &skipped) != 0) {
+        printf("Error: Cannot write snapshot '%s'; run 'check repair' to reclaim its blocks\n", name);
+        result = -1;
+    }
+    
+    // The copy of the root becomes /.snapshots/<name>
+    uint32_t top = walk.count ? walk.dirs[0].copy : FAT_ENTRY_EOF;
+    DirectoryEntry entry;
+    memset(&entry, 0, sizeof(DirectoryEntry));
+    entry.type = TYPE_DIRECTORY;
+    entry.created_time = (uint32_t)time(NULL);
+    entry.modified_time = entry.created_time;
+    if (result == 0 && skipped.block != 0 && dir_remove_entry(top, &skipped) != 0) {
+        result = -1;
+    }
+    strcpy(entry.filename, ".");
+    entry.first_block = top;
+    if (result == 0) {
+        result = dir_add_entry(top, &entry, NULL);
+    }
+    strcpy(entry.filename, "..");
+    entry.first_block = fs.snapshot_dir;
+    if (result == 0) {
+        result = dir_add_entry(top, &entry, NULL);
+    }
+    strcpy(entry.filename, name);
+    entry.first_block = top;
+    if (result == 0) {
+        result = dir_add_entry(fs.snapshot_dir, &entry, NULL);
+    }
+    if (fat_flush() != 0) {
+        result = -1;
+    }
+    
+    // Blocks open files had to themselves may be shared now
+    handle_reset_unshared();
+    if (result != 0) {
+        snapshot_tidy();
+    } else {
+        printf("Snapshot '%s' created: %u directories copied, %u files shared\n", name, walk.count, walk.files);
+    }
+    free(walk.dirs);
+    pthread_rwlock_unlock(&fs.volume_lock);
+    return result;
+}
+
+static int snapshot_print(const DirectoryEntry* entry, const DirEntryLoc* loc, void* ctx) {
+    (void)loc;
+    if (!snapshot_follows(entry)) {
+        return 0;
+    }
+    time_t created = entry->created_time;
+    char time_str[20];
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M", localtime(&created));
+    printf("%-20s %s\n", entry->filename, time_str);
+    (*(uint32_t*)ctx)++;
+    return 0;
+}
+
+int snapshot_list() {
+    pthread_rwlock_rdlock(&fs.volume_lock);
+    if (!fs.device.ops) {
+        printf("Error: No partition mounted\n");
+        pthread_rwlock_unlock(&fs.volume_lock);
+        return -1;
+    }
+    
+    uint32_t count = 0;
+    int result = 0;
+    if (fs.snapshot_dir) {
+        printf("%-20s %s\n", "Name", "Created");
+        printf("------------------------------------\n");
+        result = dir_iterate(fs.snapshot_dir, snapshot_print, &count);
+    }
+    printf("%u snapshot%s, %llu shared chain tails\n", count, count == 1 ? "" : "s",
+           (unsigned long long)share_total());
+    pthread_rwlock_unlock(&fs.volume_lock);
+    return result;
+}
+
+static int snapshot_free_file(const DirectoryEntry* entry, const DirEntryLoc* loc, void* arg) {
+    (void)loc;
+    (void)arg;
+    if (snapshot_has_chain(entry)) {
+        free_blocks(entry->first_block);
+    }
+    return 0;
+}
+
+// Whether an open file, or the current directory, is in the tree
+static int snapshot_in_use(const SnapshotWalk* walk, int* holds_cwd) {
+    *holds_cwd = 0;
+    for (uint32_t i = 0; i < walk->count; i++) {
+        *holds_cwd |= walk->dirs[i].source == fs.current_dir_block;
+        for (uint32_t b = walk->dirs[i].source; b != FAT_ENTRY_EOF; b = dir_next_block(b)) {
+            for (int fd = 0; fd < MAX_OPEN_FILES; fd++) {
+                if (fs.handles[fd].in_use && fs.handles[fd].loc.block == b) {
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+int snapshot_delete(const char* name) {
+    if (!snapshot_name_valid(name)) {
+        return -1;
+    }
+    pthread_rwlock_wrlock(&fs.volume_lock);
+    if (!fs.device.ops) {
+        printf("Error: No partition mounted\n");
+        pthread_rwlock_unlock(&fs.volume_lock);
+        return -1;
+    }
+    
+    DirEntryLoc loc;
+    DirectoryEntry entry;
+    if (!fs.snapshot_dir || find_file_in_directory(fs.snapshot_dir, name, &loc) != 0 ||
+        dir_read_entry(&loc, &entry) != 0 || !snapshot_follows(&entry)) {
+        printf("Error: No snapshot '%s'\n", name);
+        pthread_rwlock_unlock(&fs.volume_lock);
+        return -1;
+    }
+    
+    SnapshotWalk walk;
+    int holds_cwd = 0;
+    int result = snapshot_walk(entry.first_block, &walk);
+    if (result == 0 && snapshot_in_use(&walk, &holds_cwd)) {
+        printf("Error: Snapshot '%s' has open files\n", name);
+        result = -1;
+    }
+    
+    // Files first, while their directories can still be read
+    uint32_t free_before = fs.free_count;
+    for (uint32_t i = 0; result == 0 && i < walk.count; i++) {
+        result = dir_iterate(walk.dirs[i].source, snapshot_free_file, NULL);
+    }
+    if (result == 0) {
+        result = dir_remove_entry(fs.snapshot_dir, &loc);
+    }
+    for (uint32_t i = 0; result == 0 && i < walk.count; i++) {
+        free_blocks(walk.dirs[i].source);
+    }
+    if (result == 0 && holds_cwd) {
+        fs.current_dir_block = fs.boot_sector.root_dir_block;
+        strcpy(fs.current_path, "/");
+    }
+    if (fat_flush() != 0) {
+        result = -1;
+    }
+    dir_index_clear();
+    dentry_cache_clear();
+    if (result == 0) {
+        result = snapshot_tidy();
+    }
+    if (result == 0) {
+        printf("Snapshot '%s' deleted: %u blocks freed\n", name, fs.free_count - free_before);
+    }
+    free(walk.dirs);
+    pthread_rwlock_unlock(&fs.volume_lock);
+    return result;
+}
+
+static const char* const stat_names[STAT_COUNT] = {
+    "read_block", "write_block", "allocate_block/extent", "free_blocks", "find_file_in_directory", "fat_flush"
+};
+
+// Upper bound of the histogram bucket reached by 'fraction' of the calls,
+// or the slowest call if that is lower
+static uint64_t stat_percentile(const OpStat* stat, double fraction) {
+    uint64_t target = (uint64_t)(stat->calls * fraction + 0.5);
+    uint64_t seen = 0;
+    if (target == 0) {
+        target = 1;
+    }
+    for (int i = 0; i < STAT_BUCKETS; i++) {
+        seen += stat->buckets[i];
+        if (seen >= target) {
+            return (1ULL << i) < stat->max_ns ? 1ULL << i : stat->max_ns;
+        }
+    }
+    return 0;
+}
+
+void print_stats() {
+    uint64_t lookups = fs.cache.hits + fs.cache.misses;
+    
+    printf("Block cache:\n");
+    printf("  Capacity:    %u blocks\n", fs.cache.capacity);
+    printf("  Hits:        %llu\n", (unsigned long long)fs.cache.hits);
+    printf("  Misses:      %llu\n", (unsigned long long)fs.cache.misses);
+    printf("  Hit rate:    %.1f%%\n", lookups ? 100.0 * fs.cache.hits / lookups : 0.0);
+    printf("  Dirty:       %u blocks\n", fs.cache.dirty_count);
+    printf("  Write-backs: %llu\n", (unsigned long long)fs.cache.writebacks);
+    printf("  Evictions:   %llu\n", (unsigned long long)fs.cache.evictions);
+    printf("Dentry cache:\n");
+    printf("  Hits:        %llu\n", (unsigned long long)fs.dentry_hits);
+    printf("  Misses:      %llu\n", (unsigned long long)fs.dentry_misses);
+    
+    if (fs.device.ops) {
+        double seconds = fs.io.busy_ns / 1e9;
+        printf("I/O engine:\n");
+        printf("  Engine:      %s, queue depth %u\n", io_engine_name(), fs.io.queue_depth);
+        printf("  Requests:    %llu (%llu blocks)\n", (unsigned long long)fs.io.requests,
+               (unsigned long long)fs.io.blocks);
+        printf("  Submits:     %llu\n", (unsigned long long)fs.io.submits);
+        printf("  IOPS:        %.0f\n", seconds > 0 ? fs.io.requests / seconds : 0.0);
+    }
+    
+    if (fs.group_count > 0) {
+        uint32_t least = UINT32_MAX, most = 0;
+        for (uint32_t g = 0; g < fs.group_count; g++) {
+            if (!__atomic_load_n(&fs.groups[g].scanned, __ATOMIC_ACQUIRE)) {
+                continue;
+            }
+            uint32_t free_blocks = fs.groups[g].free_count;
+            least = free_blocks < least ? free_blocks : least;
+            most = free_blocks > most ? free_blocks : most;
+        }
+        printf("Allocation groups:\n");
+        printf("  Groups:      %u of %u blocks, %u scanned\n", fs.group_count, ALLOC_GROUP_BLOCKS,
+               groups_scanned());
+        if (least <= most) {
+            printf("  Free:        %u to %u blocks per scanned group\n", least, most);
+        }
+        printf("  FAT pages:   %u of %u loaded\n", __atomic_load_n(&fs.fat_pages_loaded, __ATOMIC_RELAXED),
+               fs.boot_sector.fat_blocks);
+    }
+    
+    if (fs.journal.start) {
+        printf("Journal:\n");
+        printf("  Commits:     %llu\n", (unsigned long long)fs.journal.commits);
+        printf("  Logged:      %llu block writes\n", (unsigned long long)fs.journal.logged_blocks);
+        printf("  Open:        %u blocks\n", fs.journal.count);
+    }
+    
+    printf("Device:\n");
+    printf("  Read:        %llu blocks\n", (unsigned long long)fs.device.blocks_read);
+    printf("  Written:     %llu blocks\n", (unsigned long long)fs.device.blocks_written);
+    
+    printf("Hot paths:\n");
+    printf("  %-22s %10s %10s %9s %9s %9s %9s\n", "Function", "Calls", "Blocks", "Avg us", "p50 us",
+           "p99 us", "Max us");
+    for (int i = 0; i < STAT_COUNT; i++) {
+        const OpStat* stat = &fs.op_stats[i];
+        printf("  %-22s %10llu %10llu %9.1f %9.1f %9.1f %9.1f\n", stat_names[i],
+               (unsigned long long)stat->calls, (unsigned long long)stat->blocks,
+               stat->calls ? stat->total_ns / 1e3 / stat->calls : 0.0, stat_percentile(stat, 0.50) / 1e3,
+               stat_percentile(stat, 0.99) / 1e3, stat->max_ns / 1e3);
+    }
+}
+
+// Machine-readable form of print_stats(), with the full histograms
+void print_stats_json(FILE* out) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"cache\": {\"capacity\": %u, \"hits\": %llu, \"misses\": %llu, \"dirty\": %u, "
+            "\"writebacks\": %llu, \"evictions\": %llu},\n", fs.cache.capacity,
+            (unsigned long long)fs.cache.hits, (unsigned long long)fs.cache.misses, fs.cache.dirty_count,
+            (unsigned long long)fs.cache.writebacks, (unsigned long long)fs.cache.evictions);
+    fprintf(out, "  \"dentry_cache\": {\"hits\": %llu, \"misses\": %llu},\n",
+            (unsigned long long)fs.dentry_hits, (unsigned long long)fs.dentry_misses);
+    fprintf(out, "  \"io\": {\"engine\": \"%s\", \"queue_depth\": %u, \"requests\": %llu, \"blocks\": %llu, "
+            "\"submits\": %llu, \"busy_ns\": %llu},\n", io_engine_name(), fs.io.queue_depth,
+            (unsigned long long)fs.io.requests, (unsigned long long)fs.io.blocks,
+            (unsigned long long)fs.io.submits, (unsigned long long)fs.io.busy_ns);
+    fprintf(out, "  \"journal\": {\"commits\": %llu, \"logged_blocks\": %llu, \"open_blocks\": %u},\n",
+            (unsigned long long)fs.journal.commits, (unsigned long long)fs.journal.logged_blocks,
+            fs.journal.count);
+    fprintf(out, "  \"device\": {\"blocks_read\": %llu, \"blocks_written\": %llu},\n",
+            (unsigned long long)fs.device.blocks_read, (unsigned long long)fs.device.blocks_written);
+    fprintf(out, "  \"free_space\": {\"free_blocks\": %u, \"groups\": %u, \"groups_scanned\": %u, "
+            "\"fat_pages\": %u, \"fat_pages_loaded\": %u},\n", fs.free_count, fs.group_count,
+            groups_scanned(), fs.fat_pages ? fs.boot_sector.fat_blocks : 0, fs.fat_pages_loaded);
+    
+    fprintf(out, "  \"hot_paths\": {\n");
+    for (int i = 0; i < STAT_COUNT; i++) {
+        const OpStat* stat = &fs.op_stats[i];
+        fprintf(out, "    \"%s\": {\"calls\": %llu, \"blocks\": %llu, \"total_ns\": %llu, \"max_ns\": %llu, "
+                "\"p50_ns\": %llu, \"p99_ns\": %llu, \"histogram\": [", stat_names[i],
+                (unsigned long long)stat->calls, (unsigned long long)stat->blocks,
+                (unsigned long long)stat->total_ns, (unsigned long long)stat->max_ns,
+                (unsigned long long)stat_percentile(stat, 0.50), (unsigned long long)stat_percentile(stat, 0.99));
+        for (int b = 0; b < STAT_BUCKETS; b++) {
+            fprintf(out, "%s%llu", b ? ", " : "", (unsigned long long)stat->buckets[b]);
+        }
+        fprintf(out, "]}%s\n", i + 1 < STAT_COUNT ? "," : "");
+    }
+    fprintf(out, "  }\n");
+    fprintf(out, "}\n");
+}
+
+// Zeroes every counter print_stats() reports. No operation is in flight
+// while the volume lock is held exclusively.
+void stats_reset() {
+    pthread_rwlock_wrlock(&fs.volume_lock);
+    memset(fs.op_stats, 0, sizeof(fs.op_stats));
+    fs.cache.hits = 0;
+    fs.cache.misses = 0;
+    fs.cache.writebacks = 0;
+    fs.cache.evictions = 0;
+    fs.dentry_hits = 0;
+    fs.dentry_misses = 0;
+    fs.io.requests = 0;
+    fs.io.blocks = 0;
+    fs.io.submits = 0;
+    fs.io.busy_ns = 0;
+    fs.journal.commits = 0;
+    fs.journal.logged_blocks = 0;
+    fs.device.blocks_read = 0;
+    fs.device.blocks_written = 0;
+    pthread_rwlock_unlock(&fs.volume_lock);
+}
+
+// Defragmentation
+//
+// defrag moves files into single free runs: every file whose chain has
+// more than one extent, and every file that fits a free run lower on the
+// disk, which is taken first-fit from the start of the data area. Files
+// pack towards the start and free space gathers behind them. Directories
+// are walked from the root with the volume lock shared, and each file is
+// moved with its own lock held exclusively, so the rest of the volume
+// stays usable meanwhile. The data is copied to the new run first; the
+// directory entry is then pointed at it and the old chain freed, in the
+// same journal transaction.
+//
+// A run may be limited in time and in blocks copied. One that stops early
+// remembers how many files it got through, and the next run starts after
+// them; a run that reaches the end starts from the root again next time.
+typedef struct {
+    uint32_t time_ms;         // 0: unlimited
+    uint32_t max_blocks;      // Blocks copied at most, 0: unlimited
+} DefragOptions;
+
+// Layout of the files and free space, for the before and after lines
+typedef struct {
+    uint32_t files;
+    uint64_t blocks;
+    uint64_t extents;
+    uint64_t links;           // Between consecutive blocks of a file
+    uint64_t breaks;          // Links that jump elsewhere on the disk
+    uint32_t free_runs;
+    uint32_t largest_free;
+} FragReport;
+
+typedef struct {
+    int relocate;             // 0 only fills in 'report'
+    DefragOptions opts;
+    uint64_t deadline_ns;
+    uint32_t skip;            // Files an earlier, interrupted run got through
+    uint32_t examined;
+    uint32_t moved;
+    uint64_t blocks_moved;
+    int stopped;              // The budget ran out
+    int failed;
+    FragReport report;
+    uint8_t* buffer;          // fs.readahead_blocks blocks
+    uint32_t* dirs;           // Directories still to walk, by first block
+    uint32_t dir_count;
+    uint32_t dir_capacity;
+} DefragContext;
+
+// Parses a comma-separated defrag option list such as "time=500,blocks=8192"
+static int parse_defrag_options(const char* options, DefragOptions* opts) {
+    opts->time_ms = 0;
+    opts->max_blocks = 0;
+    if (!options || options[0] == '\0') {
+        return 0;
+    }
+    
+    char buffer[256];
+    strncpy(buffer, options, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = '\0';
+    
+    for (char* option = strtok(buffer, ","); option; option = strtok(NULL, ",")) {
+        unsigned int value;
+        if (sscanf(option, "time=%u", &value) == 1) {
+            opts->time_ms = value;
+        } else if (sscanf(option, "blocks=%u", &value) == 1) {
+            opts->max_blocks = value;
+        } else {
+            printf("Error: Invalid defrag option '%s'\n", option);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Builds every group's free map bits, so free runs can be searched across
+// group boundaries
+static void defrag_scan_groups() {
+    for (uint32_t g = 0; g < fs.group_count; g++) {
+        if (!__atomic_load_n(&fs.groups[g].scanned, __ATOMIC_ACQUIRE)) {
+            pthread_mutex_lock(&fs.groups[g].lock);
+            group_scan(&fs.groups[g]);
+            pthread_mutex_unlock(&fs.groups[g].lock);
+        }
+    }
+}
+
+static void defrag_measure_free(FragReport* report) {
+    uint32_t from = fs.boot_sector.data_start_block;
+    while (from < fs.free_map_limit) {
+        uint32_t start = next_free_from(from, fs.free_map_limit);
+        if (start >= fs.free_map_limit) {
+            break;
+        }
+        uint32_t end = next_used_from(start, fs.free_map_limit);
+        report->free_runs++;
+        if (end - start > report->largest_free) {
+            report->largest_free = end - start;
+        }
+        from = end;
+    }
+}
+
+// Takes the lowest free run of 'count' blocks that starts below 'below'
+// and links it as a chain. The groups it spans are locked in ascending
+// order, which cannot deadlock with allocate_extent() holding one.
+static int defrag_claim(uint32_t count, uint32_t below, uint32_t* first) {
+    uint32_t from = fs.boot_sector.data_start_block;
+    uint32_t limit = below < fs.free_map_limit ? below : fs.free_map_limit;
+    
+    while (from < limit) {
+        uint32_t start = next_free_from(from, limit);
+        if (start >= limit || (uint64_t)start + count > fs.free_map_limit) {
+            return -1;
+        }
+        uint32_t end = next_used_from(start, start + count);
+        if (end < start + count) {
+            from = end;
+            continue;
+        }
+    
+        uint32_t first_group = start / ALLOC_GROUP_BLOCKS;
+        uint32_t last_group = (start + count - 1) / ALLOC_GROUP_BLOCKS;
+        for (uint32_t g = first_group; g <= last_group; g++) {
+            pthread_mutex_lock(&fs.groups[g].lock);
+        }
+        // Another writer may have taken part of it before the locks were held
+        int claimed = next_used_from(start, start + count) == start + count;
+        if (claimed) {
+            for (uint32_t i = 0; i + 1 < count; i++) {
+                fat_set(start + i, start + i + 1);
+            }
+            fat_set(start + count - 1, FAT_ENTRY_EOF);
+        }
+        for (uint32_t g = last_group + 1; g-- > first_group; ) {
+            pthread_mutex_unlock(&fs.groups[g].lock);
+        }
+    
+        if (claimed) {
+            *first = start;
+            return 0;
+        }
+        from = start;
+    }
+    return -1;
+}
+
+// Copies the file mapped by 'map' into the chain at 'start'
+static int defrag_copy(DefragContext* ctx, const FileHandle* map, uint32_t start) {
+    for (uint32_t index = 0; index < map->mapped_blocks; ) {
+        uint32_t block;
+        uint32_t run;
+        if (handle_run_at(map, index, fs.readahead_blocks, &block, &run) != 0 ||
+            read_blocks(block, run, ctx->buffer) != 0 || write_blocks(start + index, run, ctx->buffer) != 0) {
+            return -1;
+        }
+        index += run;
+    }
+    return 0;
+}
+
+// Moves one file if that helps and the budget allows. The caller holds
+// the volume lock shared and the file's directory locked.
+static void defrag_file(DefragContext* ctx, const DirEntryLoc* loc) {
+    DirectoryEntry entry;
+    FileHandle map;
+    memset(&map, 0, sizeof(FileHandle));
+    
+    file_lock(loc, 1);
+    if (dir_read_entry(loc, &entry) != 0 || entry.type != TYPE_FILE || entry.first_block == FAT_ENTRY_EOF ||
+        handle_scratch(&map, loc, &entry) != 0) {
+        goto done;
+    }
+    
+    // A chain shared with a snapshot is left where it is, as is the share
+    // table, whose place the mounted volume remembers
+    uint32_t count = map.mapped_blocks;
+    uint32_t below = map.extent_count > 1 ? UINT32_MAX : entry.first_block;
+    if ((entry.attributes & ATTR_SNAPSHOTS) || handle_shared_from(&map, count) < count) {
+        goto done;
+    }
+    if (count == 0 || (ctx->opts.max_blocks && count > ctx->opts.max_blocks)) {
+        goto done;
+    }
+    if (ctx->opts.max_blocks && ctx->blocks_moved + count > ctx->opts.max_blocks) {
+        ctx->stopped = 1;
+        goto done;
+    }
+    
+    uint32_t start;
+    if (defrag_claim(count, below, &start) != 0) {
+        goto done;
+    }
+    if (defrag_copy(ctx, &map, start) != 0) {
+        printf("Error: Cannot copy '%s'\n", entry.filename);
+        free_blocks(start);
+        fat_flush();
+        ctx->failed = 1;
+        goto done;
+    }
+    
+    // Write the new chain before the directory entry that points into it
+    uint32_t old_first_block = entry.first_block;
+    entry.first_block = start;
+    if (fat_flush() != 0 || dir_write_entry(loc, &entry) != 0) {
+        ctx->failed = 1;
+        goto done;
+    }
+    handle_update(loc, &entry, 0);
+    free_blocks(old_first_block);
+    fat_flush();
+    ctx->moved++;
+    ctx->blocks_moved += count;
+    
+done:
+    handle_release(&map);
+    pthread_rwlock_unlock(file_lock_for(loc));
+}
+
+static void defrag_measure_file(DefragContext* ctx, const DirEntryLoc* loc) {
+    DirectoryEntry entry;
+    file_lock(loc, 0);
+    if (dir_read_entry(loc, &entry) == 0 && entry.type == TYPE_FILE) {
+        uint64_t blocks = 0;
+        uint64_t extents = 0;
+        uint32_t previous = FAT_ENTRY_EOF;
+        ctx->report.files++;
+        for (uint32_t b = entry.first_block; b < FAT_ENTRY_BAD && blocks < fs.boot_sector.total_blocks;
+             b = fat_get(b)) {
+            if (b != previous + 1) {
+                extents++;
+            }
+            previous = b;
+            blocks++;
+        }
+        ctx->report.blocks += blocks;
+        ctx->report.extents += extents;
+    
+        // Empty and inline files have no links to count
+        if (blocks > 0) {
+            ctx->report.links += blocks - 1;
+            ctx->report.breaks += extents - 1;
+        }
+    }
+    pthread_rwlock_unlock(file_lock_for(loc));
+}
+
+static int defrag_visit(const DirectoryEntry* entry, const DirEntryLoc* loc, void* arg) {
+    DefragContext* ctx = arg;
+    
+    if (entry->type == TYPE_DIRECTORY) {
+        if (strcmp(entry->filename, ".") == 0 || strcmp(entry->filename, "..") == 0) {
+            return 0;
+        }
+        if (ctx->dir_count == ctx->dir_capacity) {
+            uint32_t capacity = ctx->dir_capacity * 2;
+            uint32_t* dirs = realloc(ctx->dirs, capacity * sizeof(uint32_t));
+            if (!dirs) {
+                ctx->failed = 1;
+                return -1;
+            }
+            ctx->dirs = dirs;
+            ctx->dir_capacity = capacity;
+        }
+        ctx->dirs[ctx->dir_count++] = entry->first_block;
+        return 0;
+    }
+    if (entry->type != TYPE_FILE) {
+        return 0;
+    }
+    
+    if (!ctx->relocate) {
+        defrag_measure_file(ctx, loc);
+        return 0;
+    }
+    if (++ctx->examined <= ctx->skip) {
+        return 0;
+    }
+    if (ctx->opts.time_ms && monotonic_ns() > ctx->deadline_ns) {
+        ctx->stopped = 1;
+    }
+    if (!ctx->stopped) {
+        defrag_file(ctx, loc);
+    }
+    if (ctx->stopped) {
+        ctx->examined--;
+        return 1;
+    }
+    return ctx->failed ? -1 : 0;
+}
+
+// Visits every directory reachable from the root, breadth first. Each
+// directory is locked shared while it is walked, never two at once.
+static void defrag_walk(DefragContext* ctx) {
+    ctx->dir_count = 0;
+    ctx->dirs[ctx->dir_count++] = fs.boot_sector.root_dir_block;
+    
+    for (uint32_t i = 0; i < ctx->dir_count && !ctx->stopped && !ctx->failed; i++) {
+        // A corrupt tree could name a directory more than once
+        if (ctx->dir_count > fs.boot_sector.total_blocks) {
+            ctx->failed = 1;
+            break;
+        }
+        pthread_rwlock_t* dir = dir_lock_for(ctx->dirs[i]);
+        pthread_rwlock_rdlock(dir);
+        int result = dir_iterate(ctx->dirs[i], defrag_visit, ctx);
+        pthread_rwlock_unlock(dir);
+        if (result < 0) {
+            ctx->failed = 1;
+        }
+    }
+}
+
+// Prints the layout. The score is the share of links between consecutive
+// blocks of a file that jump elsewhere on the disk: 0% when every file is
+// one extent.
+static void defrag_report(DefragContext* ctx, const char* when) {
+    int stopped = ctx->stopped;
+    memset(&ctx->report, 0, sizeof(FragReport));
+    ctx->relocate = 0;
+    ctx->stopped = 0;
+    defrag_walk(ctx);
+    defrag_measure_free(&ctx->report);
+    ctx->stopped = stopped;
+    
+    const FragReport* report = &ctx->report;
+    printf("%s: %u files, %llu blocks in %llu extents, fragmentation %.1f%%, "
+           "free space in %u runs (largest %u blocks)\n", when, report->files,
+           (unsigned long long)report->blocks, (unsigned long long)report->extents,
+           report->links ? 100.0 * report->breaks / report->links : 0.0, report->free_runs, report->largest_free);
+}
+
+int defrag(const char* options) {
+    DefragOptions opts;
+    if (parse_defrag_options(options, &opts) != 0) {
+        return -1;
+    }
+    
+    pthread_rwlock_rdlock(&fs.volume_lock);
+    if (!fs.device.ops) {
+        printf("Error: No partition mounted\n");
+        pthread_rwlock_unlock(&fs.volume_lock);
+        return -1;
+    }
+    
+    DefragContext ctx;
+    memset(&ctx, 0, sizeof(DefragContext));
+    ctx.opts = opts;
+    ctx.dir_capacity = 64;
+    ctx.dirs = malloc(ctx.dir_capacity * sizeof(uint32_t));
+    ctx.buffer = malloc((size_t)fs.readahead_blocks * fs.block_size);
+    if (!ctx.dirs || !ctx.buffer) {
+        printf("Error: Cannot allocate defrag buffers\n");
+        free(ctx.dirs);
+        free(ctx.buffer);
+        pthread_rwlock_unlock(&fs.volume_lock);
+        return -1;
+    }
+    
+    defrag_scan_groups();
+    defrag_report(&ctx, "Before");
+    
+    uint64_t start = monotonic_ns();
+    ctx.relocate = 1;
+    ctx.deadline_ns = start + (uint64_t)opts.time_ms * 1000000;
+    ctx.skip = fs.defrag_resume;
+    if (ctx.skip > 0) {
+        printf("Resuming after %u files\n", ctx.skip);
+    }
+    defrag_walk(&ctx);
+    fs.defrag_resume = ctx.stopped ? ctx.examined : 0;
+    printf("Moved %u files (%llu blocks) in %.2fs\n", ctx.moved, (unsigned long long)ctx.blocks_moved,
+           (monotonic_ns() - start) / 1e9);
+    
+    defrag_report(&ctx, "After");
+    if (ctx.stopped) {
+        printf("Budget used up after %u files; run defrag again to continue\n", ctx.examined);
+    }
+    
+    int result = ctx.failed ? -1 : 0;
+    free(ctx.dirs);
+    free(ctx.buffer);
+    pthread_rwlock_unlock(&fs.volume_lock);
+    return result;
+}
+
+// Consistency check
+//
+// check verifies that the FAT and the directory tree agree: every chain
+// ends in EOF without running into a free, bad or out-of-range block or
+// into itself, no block belongs to two chains, every file's chain has the
+// blocks its size needs, no allocated block is unreachable, and the free
+// counts and free map match the FAT. The volume is locked exclusively
+// throughout.
+//
+// The FAT is first copied into a flat array, and later scanned for lost
+// blocks, by worker threads each taking ranges of ALLOC_GROUP_BLOCKS
+// blocks. The tree is then walked from the root, claiming each
+// directory's chain as it is read. The file chains are validated by the
+// workers in two passes: each takes the blocks of its chains, a lower
+// owner id winning over a higher one (directories always win, files rank
+// in tree order), and then counts the leading blocks it kept. Whatever a
+// chain lost is cross-linked with the winner.
+//
+// With "repair", chains are cut after the last block they own, plain
+// files are shrunk to their chains or their chains to their sizes,
+// damaged compressed files are emptied, directories whose first block is
+// unusable are dropped, lost blocks are freed and the counts rebuilt.
+//
+// On a volume with snapshots, a file chain that runs into a block of a
+// lower file id is not cross-linked if the share table says the block has
+// other owners: it joins the lower chain there, and the tail it reaches
+// counts towards its length. The joins found at each block must match its
+// share count; repair sets the counts to them.
+#define CHECK_MAX_THREADS 16
+#define CHECK_FILE_ID 0x80000000u  // Owner ids of files start here, above every directory's
+
+enum { CHECK_OK, CHECK_BROKEN, CHECK_LOOP, CHECK_SHARED };
+
+typedef struct {
+    int repair;
+    uint32_t threads;         // 0: one per CPU, up to CHECK_MAX_THREADS
+} CheckOptions;
+
+// A chain found in the tree: a directory or a file
+typedef struct {
+    DirEntryLoc loc;          // Its record; unused for the root
+    uint32_t parent;          // Index of the directory holding it
+    uint32_t first_block;
+    uint32_t file_size;
+    uint8_t type;
+    uint8_t attributes;
+    uint8_t state;            // CHECK_*: how the chain ended
+    uint32_t claimed;         // Blocks taken in the first pass
+    uint32_t owned;           // Leading blocks still its own after both passes
+    uint32_t last_owned;      // The last of them, FAT_ENTRY_EOF if none
+    uint32_t stop_block;      // Where the chain went wrong
+    uint32_t other;           // Owner of stop_block for CHECK_SHARED
+    uint32_t join_block;      // Where it joins a lower chain's shared tail, FAT_ENTRY_EOF if not
+    uint32_t shared_blocks;   // Length of that tail
+    char name[MAX_FILENAME_SIZE];
+} CheckItem;
+
+typedef struct {
+    CheckOptions opts;
+    uint32_t total;
+    uint32_t* next;           // Copy of the FAT
+    uint32_t* owner;          // Owner id per block, 0 while unclaimed
+    uint16_t* refs;           // Chains joining at each block; NULL without snapshots
+    CheckItem* items;         // Index 0 is the root
+    uint32_t item_count;
+    uint32_t item_capacity;
+    uint32_t first_file;      // Items from here on are claimed by the workers
+    uint32_t phase;
+    uint32_t cursor;          // Next range or item a worker takes
+    uint32_t fat_free;        // Free FAT entries in the data area
+    uint32_t lost;
+    uint32_t share_errors;    // Blocks whose share count is not their joins
+    uint32_t bad_groups;      // Scanned groups whose free map or count is off
+    uint8_t* group_bad;
+    int failed;
+} CheckContext;
+
+enum { CHECK_PHASE_LOAD, CHECK_PHASE_CLAIM, CHECK_PHASE_VERIFY, CHECK_PHASE_LOST };
+
+static int parse_check_options(const char* options, CheckOptions* opts) {
+    opts->repair = 0;
+    opts->threads = 0;
+    if (!options || options[0] == '\0') {
+        return 0;
+    }
+    
+    char buffer[256];
+    strncpy(buffer, options, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = '\0';
+    
+    for (char* option = strtok(buffer, ","); option; option = strtok(NULL, ",")) {
+        unsigned int value;
+        if (strcmp(option, "repair") == 0) {
+            opts->repair = 1;
+        } else if (sscanf(option, "threads=%u", &value) == 1 && value >= 1 && value <= CHECK_MAX_THREADS) {
+            opts->threads = value;
+        } else {
+            printf("Error: Invalid check option '%s'\n", option);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Whether 'block' may be part of a chain
+static int check_usable(const CheckContext* ctx, uint32_t block) {
+    if (block >= ctx->total || (block < fs.boot_sector.data_start_block && block != fs.boot_sector.root_dir_block)) {
+        return 0;
+    }
+    uint32_t next = ctx->next[block];
+    return next != FAT_ENTRY_FREE && (next != FAT_ENTRY_BAD || block == fs.boot_sector.root_dir_block);
+}
+
+static uint32_t check_next(const CheckContext* ctx, uint32_t block) {
+    uint32_t next = ctx->next[block];
+    return next >= FAT_ENTRY_BAD ? FAT_ENTRY_EOF : next;
+}
+
+// Whether file 'id' reaching 'block', owned by 'current', joins its tail
+static int check_joins(const CheckContext* ctx, uint32_t block, uint32_t id, uint32_t current) {
+    return ctx->refs && id >= CHECK_FILE_ID && current >= CHECK_FILE_ID && share_count(block) > 0;
+}
+
+// First pass over one chain: takes every block not held by a lower id
+static void check_claim(CheckContext* ctx, CheckItem* item, uint32_t id) {
+    item->state = CHECK_OK;
+    item->claimed = 0;
+    item->join_block = FAT_ENTRY_EOF;
+    for (uint32_t block = item->first_block; block != FAT_ENTRY_EOF; block = check_next(ctx, block)) {
+        if (!check_usable(ctx, block)) {
+            item->state = CHECK_BROKEN;
+            item->stop_block = block;
+            return;
+        }
+        uint32_t current = __atomic_load_n(&ctx->owner[block], __ATOMIC_RELAXED);
+        do {
+            if (current == id) {
+                item->state = CHECK_LOOP;
+                item->stop_block = block;
+                return;
+            }
+            if (current != 0 && current < id && check_joins(ctx, block, id, current)) {
+                item->join_block = block;
+                return;
+            }
+            if (current != 0 && current < id) {
+                item->state = CHECK_SHARED;
+                item->stop_block = block;
+                item->other = current;
+                return;
+            }
+        } while (!__atomic_compare_exchange_n(&ctx->owner[block], &current, id, 0,
+                                              __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        item->claimed++;
+    }
+}
+
+// Second pass: the leading blocks the chain kept. A block lost to a lower
+// id after the first pass cuts the chain there, or is where it joins.
+static void check_verify(CheckContext* ctx, CheckItem* item, uint32_t id) {
+    item->owned = 0;
+    item->last_owned = FAT_ENTRY_EOF;
+    item->shared_blocks = 0;
+    uint32_t block = item->first_block;
+    for (uint32_t i = 0; i < item->claimed; i++, block = check_next(ctx, block)) {
+        uint32_t current = __atomic_load_n(&ctx->owner[block], __ATOMIC_RELAXED);
+        if (current != id && check_joins(ctx, block, id, current)) {
+            item->state = CHECK_OK;
+            item->join_block = block;
+            break;
+        }
+        if (current != id) {
+            item->state = CHECK_SHARED;
+            item->stop_block = block;
+            item->other = current;
+            return;
+        }
+        item->owned++;
+        item->last_owned = block;
+    }
+    
+    if (item->join_block != FAT_ENTRY_EOF) {
+        __atomic_fetch_add(&ctx->refs[item->join_block], 1, __ATOMIC_RELAXED);
+        for (block = item->join_block; block != FAT_ENTRY_EOF && check_usable(ctx, block) &&
+             item->shared_blocks < ctx->total; block = check_next(ctx, block)) {
+            item->shared_blocks++;
+        }
+    }
+}
+
+// Copies one range of the FAT, counts its free entries and compares them
+// with the free map of a scanned group
+static void check_load_range(CheckContext* ctx, uint32_t range) {
+    uint32_t start = range * ALLOC_GROUP_BLOCKS;
+    uint32_t end = start + ALLOC_GROUP_BLOCKS < ctx->total ? start + ALLOC_GROUP_BLOCKS : ctx->total;
+    uint32_t free_blocks = 0;
+    for (uint32_t block = start; block < end; block++) {
+        ctx->next[block] = fat_get(block);
+        if (ctx->next[block] == FAT_ENTRY_FREE && block >= fs.boot_sector.data_start_block &&
+            block < fs.free_map_limit) {
+            free_blocks++;
+        }
+    }
+    __atomic_fetch_add(&ctx->fat_free, free_blocks, __ATOMIC_RELAXED);
+    
+    if (range >= fs.group_count) {
+        return;
+    }
+    AllocGroup* group = &fs.groups[range];
+    if (!__atomic_load_n(&group->scanned, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    uint32_t mapped = 0;
+    int bad = 0;
+    for (uint32_t block = group->start; block < group->end; block++) {
+        int is_free = (__atomic_load_n(&fs.free_map[block / 64], __ATOMIC_RELAXED) >> (block % 64)) & 1;
+        mapped += is_free;
+        bad |= is_free != (ctx->next[block] == FAT_ENTRY_FREE);
+    }
+    if (bad || mapped != group->free_count) {
+        ctx->group_bad[range] = 1;
+        __atomic_fetch_add(&ctx->bad_groups, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void check_lost_range(CheckContext* ctx, uint32_t range) {
+    uint32_t start = range * ALLOC_GROUP_BLOCKS;
+    uint32_t end = start + ALLOC_GROUP_BLOCKS < fs.free_map_limit ? start + ALLOC_GROUP_BLOCKS : fs.free_map_limit;
+    uint32_t lost = 0;
+    uint32_t share_errors = 0;
+    if (start < fs.boot_sector.data_start_block) {
+        start = fs.boot_sector.data_start_block < end ? fs.boot_sector.data_start_block : end;
+    }
+    for (uint32_t block = start; block < end; block++) {
+        uint32_t next = ctx->next[block];
+        lost += next != FAT_ENTRY_FREE && next != FAT_ENTRY_BAD && ctx->owner[block] == 0;
+        share_errors += ctx->refs && share_count(block) != ctx->refs[block];
+    }
+    __atomic_fetch_add(&ctx->lost, lost, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&ctx->share_errors, share_errors, __ATOMIC_RELAXED);
+}
+
+// Runs the current phase: FAT ranges or file items, taken one at a time
+static void* check_worker(void* arg) {
+    CheckContext* ctx = arg;
+    uint32_t ranges = (ctx->total + ALLOC_GROUP_BLOCKS - 1) / ALLOC_GROUP_BLOCKS;
+    uint32_t count = ctx->phase == CHECK_PHASE_LOAD || ctx->phase == CHECK_PHASE_LOST ? ranges : ctx->item_count;
+    
+    for (;;) {
+        uint32_t i = __atomic_fetch_add(&ctx->cursor, 1, __ATOMIC_RELAXED);
+        if (ctx->phase == CHECK_PHASE_CLAIM || ctx->phase == CHECK_PHASE_VERIFY) {
+            i += ctx->first_file;
+        }
+        if (i >= count) {
+            break;
+        }
+        uint32_t id = CHECK_FILE_ID + i;
+        switch (ctx->phase) {
+        case CHECK_PHASE_LOAD:
+            check_load_range(ctx, i);
+            break;
+        case CHECK_PHASE_CLAIM:
+            check_claim(ctx, &ctx->items[i], id);
+            break;
+        case CHECK_PHASE_VERIFY:
+            check_verify(ctx, &ctx->items[i], id);
+            break;
+        default:
+            check_lost_range(ctx, i);
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void check_run_phase(CheckContext* ctx, uint32_t phase, uint32_t threads) {
+    pthread_t ids[CHECK_MAX_THREADS];
+    uint32_t started = 0;
+    ctx->phase = phase;
+    ctx->cursor = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(&ids[started], NULL, check_worker, ctx) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        check_worker(ctx);
+    }
+    for (uint32_t i = 0; i < started; i++) {
+        pthread_join(ids[i], NULL);
+    }
+}
+
+static CheckItem* check_add_item(CheckContext* ctx) {
+    if (ctx->item_count == ctx->item_capacity) {
+        uint32_t capacity = ctx->item_capacity ? ctx->item_capacity * 2 : 256;
+        CheckItem* items = realloc(ctx->items, capacity * sizeof(CheckItem));
+        if (!items) {
+            ctx->failed = 1;
+            return NULL;
+        }
+        ctx->items = items;
+        ctx->item_capacity = capacity;
+    }
+    CheckItem* item = &ctx->items[ctx->item_count++];
+    memset(item, 0, sizeof(CheckItem));
+    return item;
+}
+
+// Walks the tree breadth first. Each directory's chain is claimed before
+// its blocks are read, and only the blocks it owns are read; its files
+// and subdirectories are appended as items. Files are moved behind all
+// directories afterwards.
+static int check_walk_tree(CheckContext* ctx) {
+    CheckItem* root = check_add_item(ctx);
+    if (!root) {
+        return -1;
+    }
+    root->parent = UINT32_MAX;
+    root->type = TYPE_DIRECTORY;
+    root->first_block = fs.boot_sector.root_dir_block;
+    
+    uint8_t block_data[fs.block_size];
+    for (uint32_t d = 0; d < ctx->item_count; d++) {
+        if (ctx->items[d].type != TYPE_DIRECTORY) {
+            continue;
+        }
+        check_claim(ctx, &ctx->items[d], d + 1);
+        check_verify(ctx, &ctx->items[d], d + 1);
+    
+        uint32_t block = ctx->items[d].first_block;
+        for (uint32_t i = 0; i < ctx->items[d].owned; i++, block = check_next(ctx, block)) {
+            if (read_block(block, block_data) != 0) {
+                return -1;
+            }
+            dir_block_normalize(block_data);
+            for (uint32_t offset = 0; offset < fs.block_size; ) {
+                const DirRecord* rec = (const DirRecord*)(block_data + offset);
+                DirectoryEntry entry;
+                dir_record_decode(rec, &entry);
+                offset += rec->record_length;
+                if (rec->name_length == 0 || strcmp(entry.filename, ".") == 0 || strcmp(entry.filename, "..") == 0) {
+                    continue;
+                }
+                CheckItem* item = check_add_item(ctx);
+                if (!item) {
+                    return -1;
+                }
+                item->loc.block = block;
+                item->loc.offset = (uint16_t)(offset - rec->record_length);
+                item->parent = d;
+                item->first_block = entry.first_block;
+                item->file_size = entry.file_size;
+                item->type = entry.type;
+                item->attributes = entry.attributes;
+                strcpy(item->name, entry.filename);
+            }
+        }
+    }
+    
+    // Stable partition: directories first, keeping the parent indexes right
+    uint32_t* moved = malloc(ctx->item_count * sizeof(uint32_t));
+    CheckItem* sorted = malloc((ctx->item_count + 1) * sizeof(CheckItem));
+    if (!moved || !sorted) {
+        free(moved);
+        free(sorted);
+        return -1;
+    }
+    uint32_t count = 0;
+    for (int files = 0; files < 2; files++) {
+        for (uint32_t i = 0; i < ctx->item_count; i++) {
+            if ((ctx->items[i].type != TYPE_DIRECTORY) == files) {
+                moved[i] = count;
+                sorted[count++] = ctx->items[i];
+            }
+        }
+        if (!files) {
+            ctx->first_file = count;
+        }
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (sorted[i].parent != UINT32_MAX) {
+            sorted[i].parent = moved[sorted[i].parent];
+        }
+        if (sorted[i].state == CHECK_SHARED && sorted[i].other < CHECK_FILE_ID) {
+            sorted[i].other = moved[sorted[i].other - 1] + 1;
+        }
+    }
+    // Directory owner ids follow the items to their new indexes
+    for (uint32_t block = 0; block < ctx->total; block++) {
+        if (ctx->owner[block] != 0) {
+            ctx->owner[block] = moved[ctx->owner[block] - 1] + 1;
+        }
+    }
+    free(ctx->items);
+    free(moved);
+    ctx->items = sorted;
+    ctx->item_capacity = ctx->item_count + 1;
+    return 0;
+}
+
+static void check_item_path(const CheckContext* ctx, uint32_t index, char* out, size_t size) {
+    const CheckItem* item = &ctx->items[index];
+    if (item->parent == UINT32_MAX) {
+        snprintf(out, size, "/");
+        return;
+    }
+    check_item_path(ctx, item->parent, out, size);
+    size_t length = strlen(out);
+    snprintf(out + length, size - length, "%s%s", length > 1 ? "/" : "", item->name);
+}
+
+// Blocks a file's size needs, or 0 where that cannot be told from the size
+static uint32_t check_blocks_needed(const CheckItem* item) {
+    if (item->attributes & ATTR_COMPRESSED) {
+        return 0;
+    }
+    return (uint32_t)(((uint64_t)item->file_size + fs.block_size - 1) / fs.block_size);
+}
+
+// Prints what is wrong with one item; returns the number of problems
+static uint32_t check_report_item(const CheckContext* ctx, uint32_t index) {
+    const CheckItem* item = &ctx->items[index];
+    char path[MAX_PATH_SIZE];
+    char other[MAX_PATH_SIZE];
+    uint32_t problems = 0;
+    check_item_path(ctx, index, path, sizeof(path));
+    
+    if (item->state == CHECK_BROKEN) {
+        printf("  %s: chain broken at block %u (%s)\n", path, item->stop_block,
+               item->stop_block >= ctx->total ? "out of range" :
+               ctx->next[item->stop_block] == FAT_ENTRY_FREE ? "free" : "reserved or bad");
+        problems++;
+    } else if (item->state == CHECK_LOOP) {
+        printf("  %s: chain loops back to block %u\n", path, item->stop_block);
+        problems++;
+    } else if (item->state == CHECK_SHARED) {
+        uint32_t owner = item->other < CHECK_FILE_ID ? item->other - 1 : item->other - CHECK_FILE_ID;
+        check_item_path(ctx, owner, other, sizeof(other));
+        printf("  %s: cross-linked with %s at block %u\n", path, other, item->stop_block);
+        problems++;
+    }
+    if (item->type != TYPE_FILE) {
+        return problems;
+    }
+    
+    if (item->attributes & ATTR_INLINE) {
+        if (item->first_block != FAT_ENTRY_EOF) {
+            printf("  %s: inline file with a chain\n", path);
+            problems++;
+        }
+        if (item->file_size > INLINE_MAX_SIZE) {
+            printf("  %s: inline size %u above %u\n", path, item->file_size, INLINE_MAX_SIZE);
+            problems++;
+        }
+        return problems;
+    }
+    uint32_t needed = check_blocks_needed(item);
+    uint32_t length = item->owned + item->shared_blocks;
+    if (item->state == CHECK_OK && needed != 0 && length != needed) {
+        printf("  %s: size %u needs %u blocks, chain has %u\n", path, item->file_size, needed, length);
+        problems++;
+    } else if (item->state == CHECK_OK && item->file_size > 0 && length == 0) {
+        printf("  %s: size %u with no chain\n", path, item->file_size);
+        problems++;
+    }
+    return problems;
+}
+
+// Ends the item's chain after the blocks it owns
+static void check_cut_chain(CheckItem* item) {
+    if (item->last_owned != FAT_ENTRY_EOF) {
+        fat_set(item->last_owned, FAT_ENTRY_EOF);
+    } else {
+        item->first_block = FAT_ENTRY_EOF;
+    }
+}
+
+// Applies the repairs for one item and writes its entry if it changed
+static int check_repair_item(CheckContext* ctx, CheckItem* item) {
+    int damaged = item->state != CHECK_OK;
+    if (item->type == TYPE_DIRECTORY) {
+        if (item->parent == UINT32_MAX || !damaged) {
+            if (damaged) {
+                check_cut_chain(item);
+            }
+            return 0;
+        }
+        if (item->first_block == FAT_ENTRY_EOF || item->owned == 0) {
+            // Nothing left to hold its records: drop it, its blocks are lost
+            return dir_remove_entry(ctx->items[item->parent].first_block, &item->loc);
+        }
+        check_cut_chain(item);
+        return 0;
+    }
+    
+    DirectoryEntry entry;
+    if (dir_read_entry(&item->loc, &entry) != 0) {
+        return -1;
+    }
+    DirectoryEntry before = entry;
+    uint32_t length = item->owned + item->shared_blocks;
+    
+    if ((entry.attributes & ATTR_INLINE) && entry.first_block == FAT_ENTRY_EOF) {
+        if (entry.file_size > INLINE_MAX_SIZE) {
+            entry.file_size = 0;
+        }
+    } else if (entry.attributes & ATTR_COMPRESSED) {
+        if (damaged || (entry.file_size > 0 && length == 0)) {
+            // Its chunks cannot be found any more
+            check_cut_chain(item);
+            if (item->owned > 0) {
+                free_blocks(entry.first_block);
+            }
+            entry.first_block = FAT_ENTRY_EOF;
+            entry.file_size = 0;
+            entry.attributes &= ~ATTR_COMPRESSED;
+        }
+    } else {
+        entry.attributes &= ~ATTR_INLINE;
+        if (damaged) {
+            check_cut_chain(item);
+            entry.first_block = item->first_block;
+        }
+        // A shared tail cannot be cut short for one of its owners
+        uint32_t needed = check_blocks_needed(item);
+        if (length < needed) {
+            entry.file_size = length * fs.block_size;
+        } else if (length > needed && needed <= item->owned) {
+            // Keep the blocks the size needs and free the rest
+            uint32_t block = entry.first_block;
+            for (uint32_t i = 1; i < needed; i++) {
+                block = check_next(ctx, block);
+            }
+            if (needed == 0) {
+                free_blocks(entry.first_block);
+                entry.first_block = FAT_ENTRY_EOF;
+            } else {
+                uint32_t rest = fat_get(block);
+                fat_set(block, FAT_ENTRY_EOF);
+                free_blocks(rest);
+            }
+        }
+    }
+    
+    if (memcmp(&entry, &before, sizeof(DirectoryEntry)) == 0) {
+        return 0;
+    }
+    if (fat_flush() != 0 || dir_write_entry(&item->loc, &entry) != 0) {
+        return -1;
+    }
+    handle_update(&item->loc, &entry, 0);
+    return 0;
+}
+
+static int check_repair(CheckContext* ctx) {
+    // Share counts first, as freeing chains relies on them
+    if (ctx->refs) {
+        for (uint32_t block = fs.boot_sector.data_start_block; block < ctx->total; block++) {
+            share_set(block, ctx->refs[block]);
+        }
+        handle_reset_unshared();
+    }
+    for (uint32_t i = 0; i < ctx->item_count; i++) {
+        if (check_repair_item(ctx, &ctx->items[i]) != 0) {
+            return -1;
+        }
+    }
+    
+    // Free what no chain reaches; fat_set() keeps the free map in step
+    for (uint32_t block = fs.boot_sector.data_start_block; block < fs.free_map_limit; block++) {
+        uint32_t next = ctx->next[block];
+        if (next != FAT_ENTRY_FREE && next != FAT_ENTRY_BAD && ctx->owner[block] == 0) {
+            fat_set(block, FAT_ENTRY_FREE);
+            journal_revoke(block);
+        }
+    }
+    
+    // Rebuild the free map of groups that disagreed with the FAT, then the
+    // volume's free count
+    for (uint32_t g = 0; g < fs.group_count; g++) {
+        AllocGroup* group = &fs.groups[g];
+        if (!ctx->group_bad[g]) {
+            continue;
+        }
+        pthread_mutex_lock(&group->lock);
+        for (uint32_t block = group->start; block < group->end; block++) {
+            __atomic_fetch_and(&fs.free_map[block / 64], ~(1ULL << (block % 64)), __ATOMIC_RELAXED);
+        }
+        group->free_count = 0;
+        group->scanned = 0;
+        group_scan(group);
+        pthread_mutex_unlock(&group->lock);
+    }
+    uint32_t free_blocks = 0;
+    for (uint32_t block = fs.boot_sector.data_start_block; block < fs.free_map_limit; block++) {
+        free_blocks += fat_get(block) == FAT_ENTRY_FREE;
+    }
+    __atomic_store_n(&fs.free_count, free_blocks, __ATOMIC_RELAXED);
+    
+    // Directory chains may have been cut and directories dropped
+    dir_index_clear();
+    dentry_cache_clear();
+    return fat_flush();
+}
+
+// Checks the mounted volume, repairing it with the "repair" option.
+// Returns the number of problems found, or -1 if the check itself failed.
+int check_volume(const char* options) {
+    CheckOptions opts;
+    if (parse_check_options(options, &opts) != 0) {
+        return -1;
+    }
+    
+    pthread_rwlock_wrlock(&fs.volume_lock);
+    if (!fs.device.ops) {
+        printf("Error: No partition mounted\n");
+        pthread_rwlock_unlock(&fs.volume_lock);
+        return -1;
+    }
+    
+    uint64_t start = monotonic_ns();
+    CheckContext ctx;
+    memset(&ctx, 0, sizeof(CheckContext));
+    ctx.opts = opts;
+    ctx.total = fs.boot_sector.total_blocks;
+    ctx.next = malloc((size_t)ctx.total * sizeof(uint32_t));
+    ctx.owner = calloc(ctx.total, sizeof(uint32_t));
+    ctx.group_bad = calloc(fs.group_count + 1, 1);
+    ctx.refs = fs.shares ? calloc(ctx.total, sizeof(uint16_t)) : NULL;
+    uint32_t threads = opts.threads;
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus < 1 ? 1 : cpus > CHECK_MAX_THREADS ? CHECK_MAX_THREADS : (uint32_t)cpus;
+    }
+    
+    int result = ctx.next && ctx.owner && ctx.group_bad && (!fs.shares || ctx.refs) ? 0 : -1;
+    if (result != 0) {
+        printf("Error: Cannot allocate check tables\n");
+    }
+    if (result == 0) {
+        check_run_phase(&ctx, CHECK_PHASE_LOAD, threads);
+        result = check_walk_tree(&ctx);
+    }
+    if (result == 0) {
+        check_run_phase(&ctx, CHECK_PHASE_CLAIM, threads);
+        check_run_phase(&ctx, CHECK_PHASE_VERIFY, threads);
+        check_run_phase(&ctx, CHECK_PHASE_LOST, threads);
+    }
+    
+    uint32_t problems = 0;
+    if (result == 0) {
+        uint64_t chain_blocks = 0;
+        for (uint32_t i = 0; i < ctx.item_count; i++) {
+            problems += check_report_item(&ctx, i);
+            chain_blocks += ctx.items[i].owned;
+        }
+        if (ctx.lost > 0) {
+            printf("  %u lost blocks (allocated but in no chain)\n", ctx.lost);
+            problems++;
+        }
+        if (ctx.share_errors > 0) {
+            printf("  %u blocks with a wrong share count\n", ctx.share_errors);
+            problems++;
+        }
+        if (ctx.fat_free != fs.free_count) {
+            printf("  free count %u, FAT has %u free blocks\n", fs.free_count, ctx.fat_free);
+            problems++;
+        }
+        if (ctx.bad_groups > 0) {
+            printf("  free map of %u allocation groups out of step with the FAT\n", ctx.bad_groups);
+            problems++;
+        }
+        printf("Checked %u directories, %u files, %llu blocks in chains with %u thread%s in %.1f ms: ",
+               ctx.first_file, ctx.item_count - ctx.first_file, (unsigned long long)chain_blocks, threads,
+               threads == 1 ? "" : "s", (monotonic_ns() - start) / 1e6);
+        if (problems == 0) {
+            printf("no problems\n");
+        } else if (opts.repair) {
+            result = check_repair(&ctx);
+            printf("%u problems, %s\n", problems, result == 0 ? "repaired" : "repair failed");
+        } else {
+            printf("%u problems; run 'check repair' to fix them\n", problems);
+        }
+    }
+    
+    free(ctx.next);
+    free(ctx.owner);
+    free(ctx.group_bad);
+    free(ctx.refs);
+    free(ctx.items);
+    pthread_rwlock_unlock(&fs.volume_lock);
+    return result == 0 ? (int)problems : -1;
+}
+
+// Multi-threaded read benchmark
+//
+// Fills a scratch file in the current directory, then lets 1, 2, 4, ... up
+// to 'max_threads' threads read random ranges of it, each through its own
+// handle, for 'seconds' per step and prints the combined throughput.
+#define STRESS_FILE_SIZE (8 * 1024 * 1024)
+#define STRESS_READ_SIZE (16 * 1024)
+
+typedef struct {
+    int fd;
+    unsigned int seed;
+    int* stop;
+    uint64_t reads;
+    int failed;
+} StressWorker;
+
+static void* stress_reader(void* arg) {
+    StressWorker* worker = arg;
+    uint8_t* buffer = malloc(STRESS_READ_SIZE);
+    uint32_t ranges = STRESS_FILE_SIZE / STRESS_READ_SIZE;
+    
+    worker->failed = buffer == NULL;
+    while (!worker->failed && !__atomic_load_n(worker->stop, __ATOMIC_RELAXED)) {
+        uint32_t offset = (uint32_t)(rand_r(&worker->seed) % ranges) * STRESS_READ_SIZE;
+        if (fs_pread(worker->fd, buffer, STRESS_READ_SIZE, offset) != STRESS_READ_SIZE) {
+            worker->failed = 1;
+            break;
+        }
+        worker->reads++;
+    }
+    free(buffer);
+    return NULL;
+}
+
+static double elapsed_seconds(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int stress_test(uint32_t max_threads, uint32_t seconds) {
+    const char* name = "stress.tmp";
+    if (max_threads == 0 || max_threads > MAX_OPEN_FILES) {
+        printf("Error: Thread count must be between 1 and %d\n", MAX_OPEN_FILES);
+        return -1;
+    }
+    if (create_file(name) != 0) {
+        return -1;
+    }
+    
+    // Fill the scratch file
+    int fd = fs_open(name);
+    uint8_t* chunk = malloc(64 * 1024);
+    int result = fd >= 0 && chunk ? 0 : -1;
+    for (uint32_t offset = 0; result == 0 && offset < STRESS_FILE_SIZE; offset += 64 * 1024) {
+        memset(chunk, 'a' + (offset >> 16) % 26, 64 * 1024);
+        if (fs_pwrite(fd, chunk, 64 * 1024, offset) != 64 * 1024) {
+            result = -1;
+        }
+    }
+    free(chunk);
+    if (fd >= 0) {
+        fs_close(fd);
+    }
+    
+    printf("Random %u KB reads from a %u MB file, %us per step:\n",
+           STRESS_READ_SIZE / 1024, STRESS_FILE_SIZE / (1024 * 1024), seconds);
+    
+    for (uint32_t threads = 1; result == 0; threads *= 2) {
+        if (threads > max_threads) {
+            threads = max_threads;
+        }
+    
+        StressWorker workers[MAX_OPEN_FILES];
+        pthread_t ids[MAX_OPEN_FILES];
+        int stop = 0;
+        uint32_t started = 0;
+        struct timespec start;
+    
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (; started < threads; started++) {
+            memset(&workers[started], 0, sizeof(StressWorker));
+            workers[started].fd = fs_open(name);
+            workers[started].seed = started + 1;
+            workers[started].stop = &stop;
+            if (workers[started].fd < 0 ||
+                pthread_create(&ids[started], NULL, stress_reader, &workers[started]) != 0) {
+                if (workers[started].fd >= 0) {
+                    fs_close(workers[started].fd);
+                }
+                result = -1;
+                break;
+            }
+        }
+    
+        if (result == 0) {
+            struct timespec pause = { seconds, 0 };
+            nanosleep(&pause, NULL);
+        }
+        __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    
+        uint64_t reads = 0;
+        for (uint32_t i = 0; i < started; i++) {
+            pthread_join(ids[i], NULL);
+            fs_close(workers[i].fd);
+            reads += workers[i].reads;
+            if (workers[i].failed) {
+                result = -1;
+            }
+        }
+        double elapsed = elapsed_seconds(&start);
+    
+        if (result == 0) {
+            printf("  %2u thread%s: %9.1f MB/s %10.0f reads/s\n", threads, threads == 1 ? " " : "s",
+                   reads * (double)STRESS_READ_SIZE / (1024 * 1024) / elapsed, reads / elapsed);
+        }
+        if (threads == max_threads) {
+            break;
+        }
+    }
+    
+    if (result != 0) {
+        printf("Error: Stress test failed\n");
+    }
+    delete_file(name);
+    return result;
+}
+
+// Benchmark suite
+//
+// Formats a scratch image, mounts it with 'options' and times the core
+// operations on the empty volume, then again after filler files have used
+// 50% and 95% of the data area. Each step reports throughput, median and
+// 99th percentile latency, and the blocks the device read and wrote while
+// it ran. The operations' own console messages are discarded during a
+// step, and each operation is followed by the group-commit check the
+// console makes between commands, so latencies include commits.
+#define BENCH_IMAGE "bench.fs"
+#define BENCH_FILES 200
+#define BENCH_DIRS 50
+#define BENCH_LOOKUPS 2000
+#define BENCH_SMALL_SIZE 512
+#define BENCH_LARGE_SIZE (256 * 1024)
+#define BENCH_LARGE_WRITES 16
+
+typedef struct {
+    char* small;             // BENCH_SMALL_SIZE bytes of text
+    char* large;             // BENCH_LARGE_SIZE bytes of text
+    uint32_t level;          // Fill level being measured, for unique names
+    unsigned int seed;
+} BenchContext;
+
+typedef int (*BenchOp)(BenchContext* ctx, uint32_t i);
+
+// Points stdout at /dev/null. Returns the saved descriptor for
+// bench_restore(), or -1 if output could not be redirected.
+static int bench_silence() {
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (saved < 0 || null_fd < 0) {
+        if (saved >= 0) {
+            close(saved);
+        }
+        if (null_fd >= 0) {
+            close(null_fd);
+        }
+        return -1;
+    }
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+    return saved;
+}
+
+static void bench_restore(int saved) {
+    fflush(stdout);
+    if (saved >= 0) {
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    }
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench_file_name(char* name, uint32_t i) {
+    snprintf(name, MAX_FILENAME_SIZE, "f%u", i);
+}
+
+static int bench_create(BenchContext* ctx, uint32_t i) {
+    char name[MAX_FILENAME_SIZE];
+    (void)ctx;
+    bench_file_name(name, i);
+    return create_file(name);
+}
+
+static int bench_write_small(BenchContext* ctx, uint32_t i) {
+    char name[MAX_FILENAME_SIZE];
+    bench_file_name(name, i);
+    return write_file(name, ctx->small);
+}
+
+static int bench_write_large(BenchContext* ctx, uint32_t i) {
+    (void)i;
+    return write_file("large", ctx->large);
+}
+
+static int bench_read_small(BenchContext* ctx, uint32_t i) {
+    char name[MAX_FILENAME_SIZE];
+    (void)ctx;
+    bench_file_name(name, i);
+    return read_file(name);
+}
+
+static int bench_read_large(BenchContext* ctx, uint32_t i) {
+    (void)ctx;
+    (void)i;
+    return read_file("large");
+}
+
+static int bench_lookup(BenchContext* ctx, uint32_t i) {
+    char name[MAX_FILENAME_SIZE];
+    DirEntryLoc loc;
+    (void)i;
+    bench_file_name(name, rand_r(&ctx->seed) % BENCH_FILES);
+    
+    uint32_t dir_block;
+    char leaf[MAX_FILENAME_SIZE];
+    pthread_rwlock_t* dir = dir_lock_path(name, 0, &dir_block, leaf);
+    if (!dir) {
+        return -1;
+    }
+    int result = find_file_in_directory(dir_block, leaf, &loc);
+    dir_unlock(dir);
+    return result;
+}
+
+static int bench_truncate(BenchContext* ctx, uint32_t i) {
+    char name[MAX_FILENAME_SIZE];
+    (void)ctx;
+    bench_file_name(name, i);
+    return truncate_file(name, BENCH_SMALL_SIZE / 2);
+}
+
+static int bench_delete(BenchContext* ctx, uint32_t i) {
+    char name[MAX_FILENAME_SIZE];
+    (void)ctx;
+    bench_file_name(name, i);
+    return delete_file(name);
+}
+
+static int bench_mkdir(BenchContext* ctx, uint32_t i) {
+    char name[MAX_FILENAME_SIZE];
+    snprintf(name, sizeof(name), "d%u_%u", ctx->level, i);
+    return create_directory(name);
+}
+
+// Runs 'op' for i = 0 .. ops-1 and prints one result line. 'bytes' is the
+// data each operation moves, 0 where MB/s means nothing.
+static int bench_step(const char* name, BenchOp op, BenchContext* ctx, uint32_t ops, uint32_t bytes) {
+    uint64_t* latency = malloc(ops * sizeof(uint64_t));
+    if (!latency) {
+        return -1;
+    }
+    
+    uint64_t blocks_read = fs.device.blocks_read;
+    uint64_t blocks_written = fs.device.blocks_written;
+    int saved = bench_silence();
+    int result = 0;
+    uint64_t start = monotonic_ns();
+    for (uint32_t i = 0; i < ops && result == 0; i++) {
+        uint64_t op_start = monotonic_ns();
+        result = op(ctx, i);
+        journal_tick();
+        latency[i] = monotonic_ns() - op_start;
+    }
+    double seconds = (monotonic_ns() - start) / 1e9;
+    bench_restore(saved);
+    
+    if (result != 0) {
+        printf("Error: Benchmark step '%s' failed\n", name);
+        free(latency);
+        return -1;
+    }
+    
+    char rate[16] = "-";
+    if (bytes > 0) {
+        snprintf(rate, sizeof(rate), "%.1f", (double)ops * bytes / (1024 * 1024) / seconds);
+    }
+    qsort(latency, ops, sizeof(uint64_t), compare_u64);
+    printf("  %-12s %6u %10.0f %8s %9.1f %9.1f %9llu %9llu\n", name, ops, ops / seconds, rate,
+           latency[ops / 2] / 1e3, latency[(uint64_t)ops * 99 / 100] / 1e3,
+           (unsigned long long)(fs.device.blocks_read - blocks_read),
+           (unsigned long long)(fs.device.blocks_written - blocks_written));
+    free(latency);
+    return 0;
+}
+
+// Adds filler files until 'fraction' of the data area is in use
+static int bench_fill(double fraction) {
+    static uint32_t fill_files = 0;
+    uint32_t data_blocks = fs.boot_sector.total_blocks - fs.boot_sector.data_start_block;
+    uint32_t target_free = (uint32_t)(data_blocks * (1.0 - fraction));
+    uint8_t* chunk = calloc(1, 64 * 1024);
+    int result = chunk ? 0 : -1;
+    
+    int saved = bench_silence();
+    while (result == 0 && __atomic_load_n(&fs.free_count, __ATOMIC_RELAXED) > target_free) {
+        char name[MAX_FILENAME_SIZE];
+        snprintf(name, sizeof(name), "fill%u", fill_files++);
+        int fd = create_file(name) == 0 ? fs_open(name) : -1;
+        if (fd < 0) {
+            result = -1;
+            break;
+        }
+    
+        // At most 8 MB per file, and no further than the target
+        for (uint32_t offset = 0; offset < 8 * 1024 * 1024; offset += 64 * 1024) {
+            uint32_t free_blocks = __atomic_load_n(&fs.free_count, __ATOMIC_RELAXED);
+            if (free_blocks <= target_free) {
+                break;
+            }
+            uint32_t chunk_blocks = 64 * 1024 / fs.block_size;
+            uint32_t length = free_blocks - target_free < chunk_blocks ? (free_blocks - target_free) * fs.block_size
+                                                                       : 64 * 1024;
+            if (fs_pwrite(fd, chunk, length, offset) != (int)length) {
+                result = -1;
+                break;
+            }
+        }
+        fs_close(fd);
+        journal_tick();
+    }
+    bench_restore(saved);
+    free(chunk);
+    if (fraction == 0.0) {
+        fill_files = 0;
+    }
+    return result;
+}
+
+int bench(const char* options) {
+    static const double levels[] = { 0.0, 0.5, 0.95 };
+    
+    if (fs.device.ops) {
+        printf("Error: Unmount the partition before running the benchmark\n");
+        return -1;
+    }
+    
+    int saved = bench_silence();
+    int result = create_partition(BENCH_IMAGE, 0);
+    bench_restore(saved);
+    if (result != 0 || mount_partition(BENCH_IMAGE, options) != 0) {
+        printf("Error: Cannot set up benchmark image '%s'\n", BENCH_IMAGE);
+        unlink(BENCH_IMAGE);
+        return -1;
+    }
+    
+    BenchContext ctx = { malloc(BENCH_SMALL_SIZE + 1), malloc(BENCH_LARGE_SIZE + 1), 0, 1 };
+    if (!ctx.small || !ctx.large) {
+        result = -1;
+    } else {
+        memset(ctx.small, 's', BENCH_SMALL_SIZE);
+        ctx.small[BENCH_SMALL_SIZE] = '\0';
+        memset(ctx.large, 'L', BENCH_LARGE_SIZE);
+        ctx.large[BENCH_LARGE_SIZE] = '\0';
+    }
+    
+    for (uint32_t level = 0; result == 0 && level < sizeof(levels) / sizeof(levels[0]); level++) {
+        ctx.level = level;
+        if (bench_fill(levels[level]) != 0) {
+            printf("Error: Cannot fill the benchmark image to %.0f%%\n", levels[level] * 100);
+            result = -1;
+            break;
+        }
+    
+        printf("\n%.0f%% full (%u blocks free):\n", levels[level] * 100, fs.free_count);
+        printf("  %-12s %6s %10s %8s %9s %9s %9s %9s\n", "Operation", "Ops", "Ops/s", "MB/s",
+               "p50 us", "p99 us", "Blk read", "Blk write");
+        result = bench_step("mkdir", bench_mkdir, &ctx, BENCH_DIRS, 0);
+        if (result == 0) {
+            result = bench_step("create", bench_create, &ctx, BENCH_FILES, 0);
+        }
+        if (result == 0) {
+            result = bench_step("write small", bench_write_small, &ctx, BENCH_FILES, BENCH_SMALL_SIZE);
+        }
+        if (result == 0) {
+            saved = bench_silence();
+            result = create_file("large");
+            bench_restore(saved);
+        }
+        if (result == 0) {
+            result = bench_step("write large", bench_write_large, &ctx, BENCH_LARGE_WRITES, BENCH_LARGE_SIZE);
+        }
+        if (result == 0) {
+            result = bench_step("read small", bench_read_small, &ctx, BENCH_FILES, BENCH_SMALL_SIZE);
+        }
+        if (result == 0) {
+            result = bench_step("read large", bench_read_large, &ctx, BENCH_LARGE_WRITES, BENCH_LARGE_SIZE);
+        }
+        if (result == 0) {
+            result = bench_step("lookup", bench_lookup, &ctx, BENCH_LOOKUPS, 0);
+        }
+        if (result == 0) {
+            result = bench_step("truncate", bench_truncate, &ctx, BENCH_FILES, 0);
+        }
+        if (result == 0) {
+            result = bench_step("delete", bench_delete, &ctx, BENCH_FILES, 0);
+        }
+    
+        saved = bench_silence();
+        delete_file("large");
+        bench_restore(saved);
+    }
+    
+    free(ctx.small);
+    free(ctx.large);
+    saved = bench_silence();
+    unmount_partition();
+    bench_restore(saved);
+    unlink(BENCH_IMAGE);
+    return result;
+}
+
+// Console interface
+void print_help() {
+    printf("\nAvailable commands:\n");
+    printf("  format <filename> [opts] - Create and format a new partition (opts: prealloc,block=<bytes>,size=<MB>,fat=16|32,encrypt,key=<passphrase>)\n");
+    printf("  mount <filename> [opts]  - Mount an existing partition (opts: cache=<n>,readahead=<n>,commit=<s>,qd=<n>,aio=uring|threads,backend=pread|mmap,key=<passphrase>)\n");
+    printf("  unmount                  - Unmount current partition\n");
+    printf("  mkdir <dirname>          - Create a new directory\n");
+    printf("  cd <path>                - Change the current directory\n");
+    printf("  ls [path]                - List directory contents\n");
+    printf("  create <filename>        - Create a new file\n");
+    printf("  delete <filename>        - Delete a file\n");
+    printf("  read <filename>          - Read and display file content\n");
+    printf("  write <filename> <data>  - Write data to file\n");
+    printf("  append <filename> <data> - Append data to the end of a file\n");
+    printf("  import <host-path> <filename> - Copy a host file into the file system\n");
+    printf("  export <filename> <host-path> - Copy a file out to the host\n");
+    printf("  truncate <filename> <size> - Truncate file to specified size\n");
+    printf("  compress <filename>      - Store a file as LZ4-compressed chunks\n");
+    printf("  decompress <filename>    - Store a compressed file plain again\n");
+    printf("  open <filename>          - Open a file and print its handle\n");
+    printf("  close <fd>               - Close a file handle\n");
+    printf("  pread <fd> <offset> <n>  - Read n bytes at offset through a handle\n");
+    printf("  pwrite <fd> <offset> <data> - Write data at offset through a handle\n");
+    printf("  sync                     - Flush pending changes to disk\n");
+    printf("  stats [reset|json [host-path]] - Show, reset or dump (as JSON) I/O and hot-path statistics\n");
+    printf("  stress <threads> [secs]  - Benchmark concurrent random reads\n");
+    printf("  bench [mount-opts]       - Benchmark core operations on a scratch image\n");
+    printf("  defrag [time=ms,blocks=n] - Make files contiguous and pack them together\n");
+    printf("  check [repair,threads=n] - Check (and repair) the FAT against the directory tree\n");
+    printf("  snapshot create|delete <name> - Freeze the tree as /.snapshots/<name>, or drop it\n");
+    printf("  snapshot list            - List snapshots\n");
+    printf("  help                     - Show this help message\n");
+    printf("  exit                     - Exit the program\n");
+    printf("File and directory names may be paths: /abs/path, rel/path, . and ..\n");
+}
+
+// Reads commands from 'input' until end of file or 'exit'. Interactively
+// every command is followed by a group-commit check. In batch mode (a
+// script or a pipe) there are no banners or prompts, lines starting with
+// '#' are comments, and no per-command commit is made: the whole batch
+// builds one journal transaction (split only when it fills up), which is
+// committed when the batch ends. A line too long for the buffer is
+// reported and skipped whole, so no fragment of it runs as a command.
+void console_interface(FILE* input, int batch) {
+    char command[MAX_COMMAND_SIZE];
+    char arg1[256];
+    char arg2[1024];
+    unsigned line = 0;
+    
+    if (!batch) {
+        printf("Custom FAT File System Console\n");
+        printf("Type 'help' for available commands\n");
+    }
+    
+    while (1) {
+        if (!batch) {
+            printf("\n%s> ", fs.current_path);
+        }
+        fflush(stdout);
+        
+        if (fgets(command, sizeof(command), input) == NULL) {
+            break;
+        }
+        line++;
+        if (!strchr(command, '\n') && !feof(input)) {
+            int c;
+            int discarded = 0;
+            while ((c = fgetc(input)) != EOF && c != '\n') {
+                discarded |= c != '\r';
+            }
+            if (discarded) {
+                printf("Error: Line %u is longer than %d bytes, skipped\n", line, MAX_COMMAND_SIZE - 1);
+                continue;
+            }
+        }
+        
+        // Remove newline
+        command[strcspn(command, "\r\n")] = 0;
+        
+        // Parse command
+        if (strlen(command) == 0 || (batch && command[0] == '#')) {
+            continue;
+        }
+        
+        if (strcmp(command, "exit") == 0) {
+            break;
+        }
+        else if (strcmp(command, "help") == 0) {
+            print_help();
+        }
+        else if (strncmp(command, "format ", 7) == 0) {
+            int args = sscanf(command, "format %255s %1023s", arg1, arg2);
+            if (args >= 1) {
+                if (create_partition(arg1, args == 2 ? arg2 : NULL) == 0) {
+                    printf("Partition created and formatted successfully\n");
+                } else {
+                    printf("Failed to create partition\n");
+                }
+            } else {
+                printf("Usage: format <filename> [prealloc,block=<bytes>,size=<MB>,fat=16|32,encrypt,key=<passphrase>]\n");
+            }
+        }
+        else if (strncmp(command, "mount ", 6) == 0) {
+            int args = sscanf(command, "mount %255s %1023s", arg1, arg2);
+            if (args >= 1) {
+                if (mount_partition(arg1, args == 2 ? arg2 : NULL) == 0) {
+                    printf("Partition mounted successfully\n");
+                } else {
+                    printf("Failed to mount partition\n");
+                }
+            } else {
+                printf("Usage: mount <filename> [options]\n");
+            }
+        }
+        else if (strcmp(command, "sync") == 0) {
+            if (sync_partition() == 0) {
+                printf("Partition synced\n");
+            } else {
+                printf("Failed to sync partition\n");
+            }
+        }
+        else if (strcmp(command, "stats") == 0) {
+            print_stats();
+        }
+        else if (strcmp(command, "stats reset") == 0) {
+            stats_reset();
+            printf("Statistics reset\n");
+        }
+        else if (strcmp(command, "stats json") == 0) {
+            print_stats_json(stdout);
+        }
+        else if (strncmp(command, "stats json ", 11) == 0) {
+            FILE* out = sscanf(command, "stats json %1023s", arg2) == 1 ? fopen(arg2, "w") : NULL;
+            if (out) {
+                print_stats_json(out);
+                fclose(out);
+                printf("Statistics written to '%s'\n", arg2);
+            } else {
+                printf("Error: Cannot write statistics to '%s'\n", command + 11);
+            }
+        }
+        else if (strncmp(command, "stress ", 7) == 0) {
+            unsigned int threads, seconds = 2;
+            if (sscanf(command, "stress %u %u", &threads, &seconds) >= 1) {
+                stress_test(threads, seconds);
+            } else {
+                printf("Usage: stress <threads> [seconds]\n");
+            }
+        }
+        else if (strcmp(command, "bench") == 0 || strncmp(command, "bench ", 6) == 0) {
+            if (sscanf(command, "bench %1023s", arg2) == 1) {
+                bench(arg2);
+            } else {
+                bench(NULL);
+            }
+        }
+        else if (strcmp(command, "defrag") == 0 || strncmp(command, "defrag ", 7) == 0) {
+            if (sscanf(command, "defrag %1023s", arg2) == 1) {
+                defrag(arg2);
+            } else {
+                defrag(NULL);
+            }
+        }
+        else if (strcmp(command, "check") == 0 || strncmp(command, "check ", 6) == 0) {
+            if (sscanf(command, "check %1023s", arg2) == 1) {
+                check_volume(arg2);
+            } else {
+                check_volume(NULL);
+            }
+        }
+        else if (strncmp(command, "snapshot", 8) == 0 && (command[8] == ' ' || command[8] == '\0')) {
+            if (sscanf(command, "snapshot create %255s", arg1) == 1) {
+                snapshot_create(arg1);
+            } else if (sscanf(command, "snapshot delete %255s", arg1) == 1) {
+                snapshot_delete(arg1);
+            } else if (strcmp(command, "snapshot list") == 0) {
+                snapshot_list();
+            } else {
+                printf("Usage: snapshot create|delete <name>, snapshot list\n");
+            }
+        }
+        else if (strcmp(command, "unmount") == 0) {
+            unmount_partition();
+            printf("Partition unmounted\n");
+        }
+        else if (strncmp(command, "mkdir ", 6) == 0) {
+            if (sscanf(command, "mkdir %255s", arg1) == 1) {
+                create_directory(arg1);
+            } else {
+                printf("Usage: mkdir <dirname>\n");
+            }
+        }
+        else if (strcmp(command, "ls") == 0) {
+            list_directory(NULL);
+        }
+        else if (strncmp(command, "ls ", 3) == 0) {
+            if (sscanf(command, "ls %255s", arg1) == 1) {
+                list_directory(arg1);
+            } else {
+                list_directory(NULL);
+            }
+        }
+        else if (strncmp(command, "cd ", 3) == 0) {
+            if (sscanf(command, "cd %255s", arg1) == 1) {
+                change_directory(arg1);
+            } else {
+                printf("Usage: cd <path>\n");
+            }
+        }
+        else if (strncmp(command, "create ", 7) == 0) {
+            if (sscanf(command, "create %255s", arg1) == 1) {
+                create_file(arg1);
+            } else {
+                printf("Usage: create <filename>\n");
+            }
+        }
+        else if (strncmp(command, "delete ", 7) == 0) {
+            if (sscanf(command, "delete %255s", arg1) == 1) {
+                delete_file(arg1);
+            } else {
+                printf("Usage: delete <filename>\n");
+            }
+        }
+        else if (strncmp(command, "read ", 5) == 0) {
+            if (sscanf(command, "read %255s", arg1) == 1) {
+                read_file(arg1);
+            } else {
+                printf("Usage: read <filename>\n");
+            }
+        }
+        else if (strncmp(command, "write ", 6) == 0) {
+            if (sscanf(command, "write %255s %1023[^\n]", arg1, arg2) == 2) {
+                write_file(arg1, arg2);
+            } else {
+                printf("Usage: write <filename> <data>\n");
+            }
+        }
+        else if (strncmp(command, "append ", 7) == 0) {
+            if (sscanf(command, "append %255s %1023[^\n]", arg1, arg2) == 2) {
+                append_file(arg1, arg2);
+            } else {
+                printf("Usage: append <filename> <data>\n");
+            }
+        }
+        else if (strncmp(command, "import ", 7) == 0) {
+            if (sscanf(command, "import %255s %1023s", arg1, arg2) == 2) {
+                import_file(arg1, arg2);
+            } else {
+                printf("Usage: import <host-path> <filename>\n");
+            }
+        }
+        else if (strncmp(command, "export ", 7) == 0) {
+            if (sscanf(command, "export %255s %1023s", arg1, arg2) == 2) {
+                export_file(arg1, arg2);
+            } else {
+                printf("Usage: export <filename> <host-path>\n");
+            }
+        }
+        else if (strncmp(command, "truncate ", 9) == 0) {
+            unsigned int size;
+            if (sscanf(command, "truncate %255s %u", arg1, &size) == 2) {
+                truncate_file(arg1, size);
+            } else {
+                printf("Usage: truncate <filename> <size>\n");
+            }
+        }
+        else if (strncmp(command, "compress ", 9) == 0) {
+            if (sscanf(command, "compress %255s", arg1) == 1) {
+                compress_file(arg1, 1);
+            } else {
+                printf("Usage: compress <filename>\n");
+            }
+        }
+        else if (strncmp(command, "decompress ", 11) == 0) {
+            if (sscanf(command, "decompress %255s", arg1) == 1) {
+                compress_file(arg1, 0);
+            } else {
+                printf("Usage: decompress <filename>\n");
+            }
+        }
+        else if (strncmp(command, "open ", 5) == 0) {
+            if (sscanf(command, "open %255s", arg1) == 1) {
+                int fd = fs_open(arg1);
+                if (fd >= 0) {
+                    printf("File '%s' opened as handle %d\n", arg1, fd);
+                }
+            } else {
+                printf("Usage: open <filename>\n");
+            }
+        }
+        else if (strncmp(command, "close ", 6) == 0) {
+            int fd;
+            if (sscanf(command, "close %d", &fd) == 1) {
+                fs_close(fd);
+            } else {
+                printf("Usage: close <fd>\n");
+            }
+        }
+        else if (strncmp(command, "pread ", 6) == 0) {
+            int fd;
+            unsigned int offset, length;
+            if (sscanf(command, "pread %d %u %u", &fd, &offset, &length) == 3) {
+                if (length > sizeof(arg2)) {
+                    length = sizeof(arg2);
+                }
+                int result = fs_pread(fd, arg2, length, offset);
+                if (result >= 0) {
+                    printf("Read %d bytes:\n", result);
+                    fwrite(arg2, 1, result, stdout);
+                    printf("\n");
+                }
+            } else {
+                printf("Usage: pread <fd> <offset> <length>\n");
+            }
+        }
+        else if (strncmp(command, "pwrite ", 7) == 0) {
+            int fd;
+            unsigned int offset;
+            if (sscanf(command, "pwrite %d %u %1023[^\n]", &fd, &offset, arg2) == 3) {
+                int result = fs_pwrite(fd, arg2, strlen(arg2), offset);
+                if (result >= 0) {
+                    printf("Written %d bytes at offset %u\n", result, offset);
+                }
+            } else {
+                printf("Usage: pwrite <fd> <offset> <data>\n");
+            }
+        }
+        else {
+            printf("Unknown command: %s\n", command);
+            printf("Type 'help' for available commands\n");
+        }
+    
+        // Commit the metadata journal once enough has accumulated
+        if (!batch) {
+            journal_tick();
+        }
+    }
+    
+    if (batch) {
+        journal_flush();
+    }
+}
+
+// Usage: fatfs [-b script]. With -b, or when stdin is not a terminal, the
+// commands run as one batch without prompts.
+int main(int argc, char* argv[]) {
+    FILE* input = stdin;
+    int batch = !isatty(STDIN_FILENO);
+    
+    if (argc == 3 && strcmp(argv[1], "-b") == 0) {
+        input = strcmp(argv[2], "-") == 0 ? stdin : fopen(argv[2], "r");
+        if (!input) {
+            fprintf(stderr, "Error: Cannot open script '%s'\n", argv[2]);
+            return 1;
+        }
+        batch = 1;
+    } else if (argc != 1) {
+        fprintf(stderr, "Usage: %s [-b script]\n", argv[0]);
+        return 1;
+    }
+    
+    if (!batch) {
+        printf("Custom FAT File System Implementation\n");
+        printf("=====================================\n");
+    }
+    
+    // Initialize file system
+    fs_init();
+    
+    // Start console interface
+    console_interface(input, batch);
+    if (input != stdin) {
+        fclose(input);
+    }
+    
+    // Cleanup
+    unmount_partition();
+    
+    if (!batch) {
+        printf("Goodbye!\n");
+    }
+    return 0;
 }
\ No newline at end of file